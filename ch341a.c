@@ -0,0 +1,257 @@
+/*
+ * File:   ch341a.c
+ * Author: oetelaar
+ *
+ * Expand relay bit patterns to CH341A shift register commands.
+ * For a single 8 bit board this hardly matters, for a cascade of
+ * hundreds of A6275 registers the encoding should not branch per bit.
+ * The parallel (MEM mode) latch boards and the UIO stream pulses are at the end.
+ */
+
+#include <string.h>
+#include "ch341a.h"
+
+#if defined(CH341A_NO_SIMD)
+/* forced plain C */
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CH341A_USE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CH341A_USE_NEON 1
+#endif
+
+/*
+ * One input byte expands to 24 command bytes, output position i
+ * carries bit (7 - i / 3) of the input, the middle of each triplet
+ * also raises the clock. The tables below are that layout,
+ * split in 16 + 8 bytes for the vector registers.
+ */
+#if defined(CH341A_USE_SSE2) || defined(CH341A_USE_NEON)
+static const uint8_t sel_lo[16] = {
+    0x80, 0x80, 0x80, 0x40, 0x40, 0x40, 0x20, 0x20,
+    0x20, 0x10, 0x10, 0x10, 0x08, 0x08, 0x08, 0x04
+};
+static const uint8_t sel_hi[16] = {
+    0x04, 0x04, 0x02, 0x02, 0x02, 0x01, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+static const uint8_t clk_lo[16] = {
+    0, 8, 0, 0, 8, 0, 0, 8, 0, 0, 8, 0, 0, 8, 0, 0
+};
+static const uint8_t clk_hi[16] = {
+    8, 0, 0, 8, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+#endif
+
+/* expand the bits of b from bit 7 down to bit (8 - count) */
+static uint8_t *
+expand_partial(uint8_t b, unsigned count, uint8_t *out)
+{
+    for (unsigned k = 0; k < count; k++) {
+        /* 0x20 when the bit is set, 0x00 otherwise, no branch */
+        uint8_t v = (uint8_t) (((b >> (7 - k)) & 1) << 5);
+        out[0] = v;
+        out[1] = v | CH341A_PIN_CLOCK;
+        out[2] = v;
+        out += CH341A_CMDS_PER_BIT;
+    }
+    return out;
+}
+
+size_t
+ch341a_expand_bits_scalar(const uint8_t *bits, size_t nbits, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t nbytes = nbits / 8;
+
+    for (size_t i = 0; i < nbytes; i++)
+        p = expand_partial(bits[i], 8, p);
+
+    if (nbits & 7)
+        p = expand_partial(bits[nbytes], nbits & 7, p);
+
+    return (size_t) (p - out);
+}
+
+size_t
+ch341a_expand_bits(const uint8_t *bits, size_t nbits, uint8_t *out)
+{
+#if defined(CH341A_USE_SSE2)
+    const __m128i m0 = _mm_loadu_si128((const __m128i *) sel_lo);
+    const __m128i m1 = _mm_loadu_si128((const __m128i *) sel_hi);
+    const __m128i c0 = _mm_loadu_si128((const __m128i *) clk_lo);
+    const __m128i c1 = _mm_loadu_si128((const __m128i *) clk_hi);
+    const __m128i data = _mm_set1_epi8(CH341A_PIN_DATA);
+    uint8_t *p = out;
+    size_t nbytes = nbits / 8;
+
+    for (size_t i = 0; i < nbytes; i++) {
+        __m128i x = _mm_set1_epi8((char) bits[i]);
+        /* 0xff in every lane whose selected bit is set */
+        __m128i t0 = _mm_cmpeq_epi8(_mm_and_si128(x, m0), m0);
+        __m128i t1 = _mm_cmpeq_epi8(_mm_and_si128(x, m1), m1);
+        __m128i r0 = _mm_or_si128(_mm_and_si128(t0, data), c0);
+        __m128i r1 = _mm_or_si128(_mm_and_si128(t1, data), c1);
+        _mm_storeu_si128((__m128i *) p, r0);
+        _mm_storel_epi64((__m128i *) (p + 16), r1);
+        p += 8 * CH341A_CMDS_PER_BIT;
+    }
+    if (nbits & 7)
+        p = expand_partial(bits[nbytes], nbits & 7, p);
+
+    return (size_t) (p - out);
+#elif defined(CH341A_USE_NEON)
+    const uint8x16_t m0 = vld1q_u8(sel_lo);
+    const uint8x8_t m1 = vld1_u8(sel_hi);
+    const uint8x16_t c0 = vld1q_u8(clk_lo);
+    const uint8x8_t c1 = vld1_u8(clk_hi);
+    uint8_t *p = out;
+    size_t nbytes = nbits / 8;
+
+    for (size_t i = 0; i < nbytes; i++) {
+        /* vtst gives 0xff in every lane whose selected bit is set */
+        uint8x16_t t0 = vtstq_u8(vdupq_n_u8(bits[i]), m0);
+        uint8x8_t t1 = vtst_u8(vdup_n_u8(bits[i]), m1);
+        vst1q_u8(p, vorrq_u8(vandq_u8(t0, vdupq_n_u8(CH341A_PIN_DATA)), c0));
+        vst1_u8(p + 16, vorr_u8(vand_u8(t1, vdup_n_u8(CH341A_PIN_DATA)), c1));
+        p += 8 * CH341A_CMDS_PER_BIT;
+    }
+    if (nbits & 7)
+        p = expand_partial(bits[nbytes], nbits & 7, p);
+
+    return (size_t) (p - out);
+#else
+    return ch341a_expand_bits_scalar(bits, nbits, out);
+#endif
+}
+
+size_t
+ch341a_build_frame(const uint8_t *bits, size_t nbits, uint8_t *out)
+{
+    size_t n = 0;
+
+    /* start of the command frame */
+    out[n++] = 0x00;
+    n += ch341a_expand_bits(bits, nbits, out + n);
+    /* end of the command frame, pulse the latch */
+    out[n++] = 0x00;
+    out[n++] = CH341A_PIN_LATCH;
+
+    return n;
+}
+
+size_t
+ch341a_build_mem_write(const uint8_t *bits, size_t nbits, uint8_t *out)
+{
+    if (nbits == 0 || nbits > CH341A_PARA_MAX_BITS)
+        return 0;
+
+    out[0] = CH341A_PARA_CMD_W0;
+    if (nbits <= 8) {
+        out[1] = bits[0];
+        return 2;
+    }
+    /* a full first packet, then the W1 command in the next one */
+    memset(out + 1, bits[0], CH341A_PACKET_LEN - 1);
+    out[CH341A_PACKET_LEN] = CH341A_PARA_CMD_W1;
+    out[CH341A_PACKET_LEN + 1] = bits[1];
+    return CH341A_PACKET_LEN + 2;
+}
+
+/* UIO stream packets, a command that does not fit starts the next packet */
+typedef struct uio_stream
+{
+    uint8_t *out;
+    size_t n; /* bytes written */
+    size_t pkt; /* start of the current packet */
+} uio_stream_t;
+
+static void
+uio_begin(uio_stream_t *s)
+{
+    s->pkt = s->n;
+    s->out[s->n++] = CH341A_CMD_UIO_STREAM;
+}
+
+/* end the packet, full size so the next one follows in the same transfer */
+static void
+uio_next_packet(uio_stream_t *s)
+{
+    s->out[s->n++] = CH341A_UIO_STM_END;
+    while (s->n < s->pkt + CH341A_PACKET_LEN)
+        s->out[s->n++] = 0;
+    uio_begin(s);
+}
+
+static void
+uio_cmd(uio_stream_t *s, uint8_t cmd)
+{
+    /* keep room for the end command */
+    if (s->n - s->pkt >= CH341A_PACKET_LEN - 1)
+        uio_next_packet(s);
+    s->out[s->n++] = cmd;
+}
+
+static void
+uio_shift(uio_stream_t *s, const uint8_t *bits, size_t nbits)
+{
+    uint8_t pins[8 * CH341A_CMDS_PER_BIT];
+    size_t n = ch341a_expand_bits(bits, nbits, pins);
+
+    for (size_t i = 0; i < n; i++)
+        uio_cmd(s, CH341A_UIO_STM_OUT | pins[i]);
+}
+
+size_t
+ch341a_build_pulse(const uint8_t *on, const uint8_t *off, size_t nbits,
+                   unsigned us, uint8_t *out)
+{
+    uio_stream_t s = {out, 0, 0};
+
+    if (nbits == 0 || nbits > 8 || us > CH341A_PULSE_MAX_US)
+        return 0;
+
+    /* the on state goes into the register, latch low so nothing shows yet */
+    uio_begin(&s);
+    uio_cmd(&s, CH341A_UIO_STM_DIR | 0x3f);
+    uio_cmd(&s, CH341A_UIO_STM_OUT);
+    uio_shift(&s, on, nbits);
+
+    /* from here on the timing matters, start with a fresh packet */
+    uio_next_packet(&s);
+    uio_cmd(&s, CH341A_UIO_STM_OUT | CH341A_PIN_LATCH);
+    uio_cmd(&s, CH341A_UIO_STM_OUT);
+    uio_shift(&s, off, nbits);
+    while (us > 0) {
+        unsigned d = us < CH341A_UIO_MAX_US ? us : CH341A_UIO_MAX_US;
+        uio_cmd(&s, CH341A_UIO_STM_US | d);
+        us -= d;
+    }
+    /* same end state as ch341a_build_frame(), latch high */
+    uio_cmd(&s, CH341A_UIO_STM_OUT | CH341A_PIN_LATCH);
+    s.out[s.n++] = CH341A_UIO_STM_END;
+
+    return s.n;
+}
+
+size_t
+ch341a_build_stream_frame(const uint8_t *bits, size_t nbits, uint8_t *out)
+{
+    uio_stream_t s = {out, 0, 0};
+
+    if (nbits == 0 || nbits > CH341A_MAX_CHAIN_BITS)
+        return 0;
+
+    /* the same pin changes as ch341a_build_frame(), the chip plays them */
+    uio_begin(&s);
+    uio_cmd(&s, CH341A_UIO_STM_DIR | 0x3f);
+    uio_cmd(&s, CH341A_UIO_STM_OUT);
+    for (size_t i = 0; i < nbits; i += 8)
+        uio_shift(&s, bits + i / 8, nbits - i < 8 ? nbits - i : 8);
+    uio_cmd(&s, CH341A_UIO_STM_OUT);
+    uio_cmd(&s, CH341A_UIO_STM_OUT | CH341A_PIN_LATCH);
+    s.out[s.n++] = CH341A_UIO_STM_END;
+
+    return s.n;
+}
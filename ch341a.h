@@ -0,0 +1,137 @@
+/*
+ * File:   ch341a.h
+ * Author: oetelaar
+ *
+ * Encoding of relay bit patterns into CH341A command bytes.
+ * The A6275 shift register sits on the CH341A output pins:
+ *   0x20 = data (SDI), 0x08 = clock (CLK), 0x01 = latch (LE)
+ * Every output bit is clocked in with three commands :
+ *   off : 0x00 0x08 0x00
+ *   on  : 0x20 0x28 0x20
+ * Boards with a latch (74HC574 and the like) on the parallel data
+ * pins instead take a whole byte per strobe, see ch341a_build_mem_write()
+ * no libusb in here, the transfers are done by the caller
+ */
+
+#ifndef CH341A_H
+#define	CH341A_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CH341A_PIN_DATA  0x20
+#define CH341A_PIN_CLOCK 0x08
+#define CH341A_PIN_LATCH 0x01
+
+    /* command bytes per shifted bit */
+#define CH341A_CMDS_PER_BIT 3
+    /* one leading 0x00, trailing 0x00 0x01 to latch */
+#define CH341A_FRAME_OVERHEAD 3
+    /* longest cascade of shift registers we encode for */
+#define CH341A_MAX_CHAIN_BITS 1024
+#define CH341A_FRAME_LEN(nbits) ((nbits) * CH341A_CMDS_PER_BIT + CH341A_FRAME_OVERHEAD)
+
+    /*
+     * Expand nbits of a packed bitmap into 3 * nbits command bytes.
+     * bits[0] is shifted out first, most significant bit first, so the
+     * register at the far end of the chain goes in bits[0].
+     * Branch free, uses SSE2 or NEON when the compiler offers it.
+     * returns number of bytes written to out
+     */
+    size_t ch341a_expand_bits(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+    /* plain C version of the above, always available (reference) */
+    size_t ch341a_expand_bits_scalar(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+    /*
+     * Build a complete shift and latch frame, CH341A_FRAME_LEN(nbits) bytes.
+     * returns number of bytes written to out
+     */
+    size_t ch341a_build_frame(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+    /*
+     * Parallel (MEM) mode, numbers as in the vendor driver.
+     * The chip is switched with a vendor control request once after open,
+     * after that a bulk packet of PARA_CMD_W0 + data bytes strobes every
+     * data byte onto D0..D7 with address line A0 low, W1 the same with A0 high.
+     * A board with one latch on W0 takes 8 relays in one command,
+     * a second latch decoded from A0 gives 16.
+     */
+#define CH341A_REQ_PARA_INIT 0xb1
+#define CH341A_PARA_MODE_MEM 2
+#define CH341A_PARA_CMD_W0 0xa6
+#define CH341A_PARA_CMD_W1 0xa7
+    /* bulk packet size, a command and up to 31 data bytes */
+#define CH341A_PACKET_LEN 32
+#define CH341A_PARA_MAX_BITS 16
+#define CH341A_PARA_FRAME_MAX (2 * CH341A_PACKET_LEN)
+
+    /* wValue for CH341A_REQ_PARA_INIT */
+#define CH341A_PARA_INIT_VALUE(mode) (((mode) << 8) | 0x02)
+
+    /*
+     * Build the bulk transfer that latches nbits (8 or 16) in one go,
+     * bits[0] goes to the W0 latch, bits[1] to the W1 latch.
+     * For 16 bits the first packet is filled up to the packet size by
+     * repeating bits[0] (the latch keeps the last strobe), so both
+     * commands travel in one transfer without a short packet in between.
+     * returns number of bytes written to out, at most CH341A_PARA_FRAME_MAX,
+     * 0 when nbits is out of range
+     */
+    size_t ch341a_build_mem_write(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+    /*
+     * UIO stream, a list of pin commands the chip works through by itself.
+     * Every packet is 0xAB, commands, 0x20 (end). Commands are
+     * 0x40|d direction of D0..D5, 0x80|v output D0..D5, 0xC0|n wait n us.
+     */
+#define CH341A_CMD_UIO_STREAM 0xab
+#define CH341A_UIO_STM_DIR 0x40
+#define CH341A_UIO_STM_OUT 0x80
+#define CH341A_UIO_STM_US 0xc0
+#define CH341A_UIO_STM_END 0x20
+#define CH341A_UIO_MAX_US 63
+    /* longer than this the host timers are good enough */
+#define CH341A_PULSE_MAX_US 10000
+#define CH341A_PULSE_BUF_LEN (10 * CH341A_PACKET_LEN)
+
+    /*
+     * Build a pulse for the shift register board as one bulk transfer :
+     * outputs to on, wait us, outputs to off, timed by the chip.
+     * The on state is shifted in first (outputs unchanged), then one
+     * packet latches it, shifts in the off state, waits and latches again.
+     * For 8 bits and us <= 3 * 63 that packet holds the whole pulse, longer
+     * waits continue in the next packets of the same transfer.
+     * The width is us plus the time the chip needs to shift nbits,
+     * which is the same for every pulse.
+     * nbits up to 8, us up to CH341A_PULSE_MAX_US,
+     * out needs CH341A_PULSE_BUF_LEN bytes
+     * returns number of bytes written to out, 0 when out of range
+     */
+    size_t ch341a_build_pulse(const uint8_t *on, const uint8_t *off, size_t nbits,
+                              unsigned us, uint8_t *out);
+
+    /* a stream packet holds 30 commands, 1 + CH341A_FRAME_LEN(nbits) of them for a frame */
+#define CH341A_STREAM_FRAME_LEN(nbits) \
+    ((CH341A_FRAME_LEN(nbits) + 1 + CH341A_PACKET_LEN - 3) / (CH341A_PACKET_LEN - 2) * CH341A_PACKET_LEN)
+
+    /*
+     * The frame of ch341a_build_frame() as a UIO stream, so the whole
+     * shift and latch goes in one bulk transfer instead of a transfer
+     * per pin change. 8 bits fit in one packet. Used with -u only, the
+     * per pin commands are what the boards have been run with.
+     * nbits up to CH341A_MAX_CHAIN_BITS, out needs
+     * CH341A_STREAM_FRAME_LEN(nbits) bytes
+     * returns number of bytes written to out, 0 when out of range
+     */
+    size_t ch341a_build_stream_frame(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CH341A_H */
@@ -0,0 +1,48 @@
+/* 
+ * File:   clock.c
+ * Author: oetelaar
+ *
+ * real and simulated clock
+ */
+
+#include <time.h>
+#include "clock.h"
+
+static uint64_t
+monotonic_now_us(clock_source_t *c)
+{
+    struct timespec ts;
+    (void) c;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+clock_source_t clock_monotonic = {.now_us = monotonic_now_us};
+
+static uint64_t
+sim_now_us(clock_source_t *c)
+{
+    return c->sim_us;
+}
+
+void
+clock_sim_init(clock_source_t *c, uint64_t start_us)
+{
+    c->now_us = sim_now_us;
+    c->simulated = 1;
+    c->sim_us = start_us;
+}
+
+void
+clock_sim_set(clock_source_t *c, uint64_t us)
+{
+    if (c->simulated && us > c->sim_us)
+        c->sim_us = us;
+}
+
+void
+clock_sim_advance(clock_source_t *c, uint64_t us)
+{
+    if (c->simulated)
+        c->sim_us += us;
+}
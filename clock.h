@@ -0,0 +1,47 @@
+/* 
+ * File:   clock.h
+ * Author: oetelaar
+ *
+ * Where the daemon gets its time from. Normally CLOCK_MONOTONIC,
+ * a simulated clock only moves when told to, so timed behaviour
+ * (heartbeats, timeouts, pulses) can be run hours ahead in no time.
+ */
+
+#ifndef CLOCK_H
+#define	CLOCK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+    typedef struct clock_source
+    {
+        /* microseconds since some fixed point, never goes back */
+        uint64_t(*now_us)(struct clock_source *c);
+        int simulated; /* time only moves when told to, nobody may sleep on it */
+        uint64_t sim_us; /* the time of a simulated clock */
+    } clock_source_t;
+
+    /* the real thing */
+    extern clock_source_t clock_monotonic;
+
+    /* make c a simulated clock standing at start_us */
+    void clock_sim_init(clock_source_t *c, uint64_t start_us);
+    /* move a simulated clock forward to us, never backwards */
+    void clock_sim_set(clock_source_t *c, uint64_t us);
+    /* move a simulated clock forward by us */
+    void clock_sim_advance(clock_source_t *c, uint64_t us);
+
+    static inline uint64_t
+    clock_now_us(clock_source_t *c)
+    {
+        return c->now_us(c);
+    }
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CLOCK_H */
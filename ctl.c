@@ -0,0 +1,235 @@
+/*
+ * File:   ctl.c
+ * Author: oetelaar
+ *
+ * The daemon side of the relay command connections, see ctl.h
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ctl.h"
+#include "evloop.h"
+#include "net.h"
+#include "sched.h"
+#include "logging.h"
+
+typedef struct ctl_conn
+{
+    int fd;
+    net_buf_t in;
+    net_buf_t out;
+    sched_client_t *sc; /* every message is a batch */
+} ctl_conn_t;
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    uint8_t *seen; /* boards of the message being answered */
+    int lfd;
+} ctl = {.lfd = -1};
+
+void
+ctl_put_record(uint8_t *p, const ctl_record_t *r)
+{
+    uint16_t b = htons(r->type == CTL_ACK ? r->failed : r->board);
+    uint32_t w1 = htonl(r->type == CTL_SET ? r->set : r->count);
+    uint32_t w2 = htonl(r->clear);
+    uint64_t s = htobe64(r->seq);
+
+    memset(p, 0, CTL_RECORD_LEN);
+    p[0] = r->type;
+    memcpy(p + 2, &b, 2);
+    memcpy(p + 4, &w1, 4);
+    if (r->type == CTL_SET)
+        memcpy(p + 8, &w2, 4);
+    else
+        memcpy(p + 8, &s, 8);
+}
+
+void
+ctl_get_record(const uint8_t *p, ctl_record_t *r)
+{
+    uint16_t b;
+    uint32_t w1, w2;
+    uint64_t s;
+
+    memset(r, 0, sizeof (*r));
+    memcpy(&b, p + 2, 2);
+    memcpy(&w1, p + 4, 4);
+    r->type = p[0];
+    if (r->type == CTL_SET) {
+        memcpy(&w2, p + 8, 4);
+        r->board = ntohs(b);
+        r->set = ntohl(w1);
+        r->clear = ntohl(w2);
+    } else {
+        memcpy(&s, p + 8, 8);
+        if (r->type == CTL_FAILED)
+            r->board = ntohs(b);
+        else
+            r->failed = ntohs(b);
+        r->count = ntohl(w1);
+        r->seq = be64toh(s);
+    }
+}
+
+static void
+ctl_close(ctl_conn_t *c)
+{
+    lwsl_info("ctl: connection closed\n");
+    evloop_del(c->fd);
+    close(c->fd);
+    sched_client_free(c->sc);
+    net_buf_free(&c->in);
+    net_buf_free(&c->out);
+    free(c);
+}
+
+static int
+ctl_send(ctl_conn_t *c, const ctl_record_t *r)
+{
+    uint8_t *p = net_buf_reserve(&c->out, CTL_RECORD_LEN);
+
+    if (!p)
+        return -1;
+    ctl_put_record(p, r);
+    c->out.len += CTL_RECORD_LEN;
+    return 0;
+}
+
+/* write what the socket takes, stop reading while our batches pile up */
+static int
+ctl_flush(ctl_conn_t *c)
+{
+    if (net_buf_send(c->fd, &c->out) < 0)
+        return -1;
+    evloop_modify(c->fd, (sched_queued(c->sc) < SCHED_MAX_QUEUED ? POLLIN : 0) |
+                  (c->out.len ? POLLOUT : 0));
+    return 0;
+}
+
+/* a message has been written, every board it touched once */
+static void
+ctl_done(sched_client_t *sc, const sched_batch_t *b, void *arg)
+{
+    ctl_conn_t *c = arg;
+    ctl_record_t ack = {.type = CTL_ACK, .seq = b->tag};
+    ctl_record_t f = {.type = CTL_FAILED};
+    int rc = 0;
+    (void) sc;
+
+    for (int i = 0; i < b->n; i++) {
+        unsigned k = b->ch[i].board;
+        if (k < (unsigned) ctl.nboards) {
+            if (ctl.seen[k])
+                continue;
+            ctl.seen[k] = 1;
+        }
+        /* not connected : kept, goes out when the board is back, but not done now */
+        if (!sched_board_failed(k)) {
+            ack.count++;
+            continue;
+        }
+        ack.failed++;
+        f.board = (uint16_t) k;
+        rc |= ctl_send(c, &f);
+    }
+    for (int i = 0; i < b->n; i++)
+        if (b->ch[i].board < (unsigned) ctl.nboards)
+            ctl.seen[b->ch[i].board] = 0;
+
+    rc |= ctl_send(c, &ack);
+    if (rc != 0) {
+        lwsl_warn("ctl: peer does not read its acks, closing\n");
+        ctl_close(c);
+    } else if (ctl_flush(c) != 0) {
+        ctl_close(c);
+    }
+}
+
+static void
+ctl_fd_cb(int fd, short revents, void *arg)
+{
+    ctl_conn_t *c = arg;
+    int rc = 0;
+    (void) fd;
+
+    if (revents & POLLIN) {
+        if (net_buf_recv(c->fd, &c->in) < 0) {
+            ctl_close(c);
+            return;
+        }
+        size_t i;
+        for (i = 0; i + CTL_RECORD_LEN <= c->in.len; i += CTL_RECORD_LEN) {
+            ctl_record_t r;
+            ctl_get_record(c->in.data + i, &r);
+            if (r.type == CTL_SET)
+                rc |= sched_add(c->sc, r.board, r.set, r.clear);
+            else if (r.type == CTL_END)
+                rc |= sched_submit(c->sc, r.seq);
+        }
+        if (rc != 0) {
+            lwsl_err("ctl: out of memory, closing\n");
+            ctl_close(c);
+            return;
+        }
+        net_buf_consume(&c->in, i);
+    } else if (revents & (POLLERR | POLLHUP)) {
+        ctl_close(c);
+        return;
+    }
+
+    if (ctl_flush(c) != 0)
+        ctl_close(c);
+}
+
+static void
+ctl_accept_cb(int fd, short revents, void *arg)
+{
+    (void) revents;
+    (void) arg;
+
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+
+    ctl_conn_t *c = calloc(1, sizeof (*c));
+    char name[80] = "ctl ";
+    if (c) {
+        net_peer_name(cfd, name + 4, sizeof (name) - 4);
+        c->sc = sched_client_new("ctl", name, ctl_done, c);
+    }
+    if (!c || !c->sc) {
+        free(c);
+        close(cfd);
+        return;
+    }
+    net_setup(cfd);
+    c->fd = cfd;
+    evloop_add(cfd, POLLIN, ctl_fd_cb, c);
+    lwsl_info("ctl: new connection\n");
+}
+
+int
+ctl_start(ios_handle_t **boards, int nboards, const char *listen_on)
+{
+    assert(boards && nboards > 0);
+
+    int fd = net_listen(listen_on, 16);
+    if (fd < 0)
+        return -1;
+
+    ctl.boards = boards;
+    ctl.nboards = nboards;
+    ctl.seen = calloc(nboards, 1);
+    ctl.lfd = fd;
+    evloop_add(fd, POLLIN, ctl_accept_cb, NULL);
+    lwsl_notice("accepting relay commands on %s for %d board(s)\n", listen_on, nboards);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * File:   ctl.h
+ * Author: oetelaar
+ *
+ * Relay commands over TCP, for the fleet gateway (gw.c) or anything
+ * else that wants to drive a daemon without temp files.
+ *
+ * The wire format is a stream of fixed 16 byte records, network order :
+ *   'M' pad (1) board (2) set mask (4) clear mask (4) pad (4)
+ *   'E' pad (3) records (4) sequence (8)           end of a message
+ *   'F' pad (1) board (2) pad (12)                  a board that failed
+ *   'K' pad (1) failed (2) written (4) sequence (8)  ack of a message
+ * A message is any number of 'M' records and an 'E'. The daemon applies
+ * the whole message, writes every board it touched once, and answers
+ * with an 'F' for every board that failed (not connected, USB error,
+ * no such board) and one 'K'. Messages are answered in order, so the
+ * sender can have many in flight on one connection.
+ */
+
+#ifndef CTL_H
+#define	CTL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define CTL_RECORD_LEN 16
+#define CTL_SET 'M'
+#define CTL_END 'E'
+#define CTL_ACK 'K'
+#define CTL_FAILED 'F'
+
+    typedef struct ctl_record
+    {
+        uint8_t type;
+        uint16_t board; /* M, F */
+        uint16_t failed; /* K */
+        uint32_t set; /* M */
+        uint32_t clear; /* M */
+        uint32_t count; /* E records, K boards written */
+        uint64_t seq; /* E, K */
+    } ctl_record_t;
+
+    void ctl_put_record(uint8_t *p, const ctl_record_t *r);
+    void ctl_get_record(const uint8_t *p, ctl_record_t *r);
+
+    /* accept command connections on [addr:]port for these boards, returns 0 or -1 */
+    int ctl_start(ios_handle_t **boards, int nboards, const char *listen_on);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CTL_H */
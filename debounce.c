@@ -0,0 +1,118 @@
+/*
+ * File:   debounce.c
+ * Author: oetelaar
+ *
+ * Integrating debounce, see debounce.h
+ *
+ * Per word of inputs s[0] is the debounced state, s[1] the inputs whose
+ * counter is not at rest (not at samples for a 1, not at 0 for a 0) and
+ * s[2 ..] the counter bits. At rest with state 1 means the counter is at
+ * samples, with state 0 at 0, so those two need not be stored.
+ */
+
+#include <stdlib.h>
+#include "debounce.h"
+
+static debounce_word_t
+debounce_valid(const debounce_t *d, int w)
+{
+    int n = d->ninputs - w * DEBOUNCE_WORD_BITS;
+
+    return n >= DEBOUNCE_WORD_BITS ? ~(debounce_word_t) 0 : ((debounce_word_t) 1 << n) - 1;
+}
+
+int
+debounce_init(debounce_t *d, int ninputs, unsigned samples)
+{
+    if (ninputs <= 0 || samples < 1 || samples >= 1u << DEBOUNCE_MAX_BITS)
+        return -1;
+    d->ninputs = ninputs;
+    d->nwords = DEBOUNCE_WORDS(ninputs);
+    d->samples = samples;
+    d->bits = 0;
+    while (samples >> d->bits)
+        d->bits++;
+    d->v = calloc((size_t) d->nwords * (2 + d->bits), sizeof (*d->v));
+    return d->v ? 0 : -1;
+}
+
+void
+debounce_free(debounce_t *d)
+{
+    free(d->v);
+    d->v = NULL;
+}
+
+void
+debounce_reset(debounce_t *d, const debounce_word_t *raw)
+{
+    const int stride = 2 + d->bits;
+
+    for (int w = 0; w < d->nwords; w++) {
+        debounce_word_t *s = d->v + w * stride;
+        s[0] = raw[w] & debounce_valid(d, w);
+        s[1] = 0;
+        for (int i = 0; i < d->bits; i++)
+            s[2 + i] = (d->samples >> i) & 1 ? s[0] : 0;
+    }
+}
+
+int
+debounce_sample(debounce_t *d, const debounce_word_t *raw,
+                debounce_word_t *rise, debounce_word_t *fall)
+{
+    const int stride = 2 + d->bits;
+    int edges = 0;
+
+    for (int w = 0; w < d->nwords; w++) {
+        debounce_word_t *s = d->v + w * stride;
+        debounce_word_t *c = s + 2;
+        debounce_word_t valid = debounce_valid(d, w);
+        debounce_word_t in = raw[w] & valid;
+        debounce_word_t old = s[0];
+
+        if (rise)
+            rise[w] = 0;
+        if (fall)
+            fall[w] = 0;
+        /* the common case, nothing bounces here */
+        if (!(in ^ old) && !s[1])
+            continue;
+
+        /* count up where 1 and not at samples yet, down where 0 and not at 0 */
+        debounce_word_t carry = in & ~(old & ~s[1]);
+        debounce_word_t borrow = ~in & ~(~old & ~s[1]) & valid;
+        debounce_word_t top = ~(debounce_word_t) 0, zero = ~(debounce_word_t) 0;
+        for (int i = 0; i < d->bits; i++) {
+            debounce_word_t ci = c[i];
+            debounce_word_t n = ci ^ (carry | borrow);
+            carry &= ci;
+            borrow &= ~ci;
+            c[i] = n;
+            top &= (d->samples >> i) & 1 ? n : ~n;
+            zero &= ~n;
+        }
+
+        debounce_word_t st = (old | top) & ~zero & valid;
+        s[0] = st;
+        s[1] = ~((st & top) | (~st & zero)) & valid;
+
+        debounce_word_t changed = st ^ old;
+        if (changed) {
+            if (rise)
+                rise[w] = changed & st;
+            if (fall)
+                fall[w] = changed & ~st;
+            edges += __builtin_popcountll(changed);
+        }
+    }
+    return edges;
+}
+
+int
+debounce_state(const debounce_t *d, int i)
+{
+    if (i < 0 || i >= d->ninputs)
+        return 0;
+    return (d->v[(i / DEBOUNCE_WORD_BITS) * (2 + d->bits)] >> (i % DEBOUNCE_WORD_BITS)) & 1;
+}
@@ -0,0 +1,67 @@
+/*
+ * File:   debounce.h
+ * Author: oetelaar
+ *
+ * Integrating debounce of many digital inputs at once, for the input
+ * ports (Elomax port 1, expander boards) sampled at a fixed rate.
+ *
+ * Every input has a counter 0 .. samples. A sample of 1 counts it up,
+ * a 0 counts it down, the debounced input goes to 1 when the counter
+ * reaches samples and back to 0 when it reaches 0. So a contact has to
+ * be mostly closed for about samples periods before it counts as closed,
+ * and bounce in between only moves the counter.
+ *
+ * The counters are kept bit sliced : bit i of all counters of a word
+ * of inputs is one word, so a whole word of inputs is done with a few
+ * bitwise operations per counter bit, no loop over the inputs. Words
+ * where nothing moves (every input equal to its debounced state and its
+ * counter at rest) are skipped. Only debounced edges come out.
+ */
+
+#ifndef DEBOUNCE_H
+#define	DEBOUNCE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+    typedef uint64_t debounce_word_t;
+#define DEBOUNCE_WORD_BITS 64
+    /* counter bits, samples can be 1 .. (1 << DEBOUNCE_MAX_BITS) - 1 */
+#define DEBOUNCE_MAX_BITS 8
+    /* words for n inputs, input i is bit i % 64 of word i / 64 */
+#define DEBOUNCE_WORDS(n) (((n) + DEBOUNCE_WORD_BITS - 1) / DEBOUNCE_WORD_BITS)
+
+    typedef struct debounce
+    {
+        int ninputs;
+        int nwords;
+        unsigned samples;
+        int bits; /* counter bits in use */
+        /* per word : state, busy, then the counter bits, low bit first */
+        debounce_word_t *v;
+    } debounce_t;
+
+    /* for ninputs inputs and samples (1 .. 255) samples, all 0 and settled, returns 0 or -1 */
+    int debounce_init(debounce_t *d, int ninputs, unsigned samples);
+    void debounce_free(debounce_t *d);
+    /* take raw as the debounced state without edges, at start or after a reconnect */
+    void debounce_reset(debounce_t *d, const debounce_word_t *raw);
+
+    /*
+     * one sample of all inputs (nwords words), rise and fall (nwords
+     * words each, may be NULL) get the inputs that changed, returns the
+     * number of edges
+     */
+    int debounce_sample(debounce_t *d, const debounce_word_t *raw,
+                        debounce_word_t *rise, debounce_word_t *fall);
+    /* debounced state of input i */
+    int debounce_state(const debounce_t *d, int i);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DEBOUNCE_H */
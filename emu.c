@@ -0,0 +1,231 @@
+/* 
+ * File:   emu.c
+ * Author: oetelaar
+ *
+ * The emulated board, see emu.h
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "emu.h"
+#include "ch341a.h"
+#include "logging.h"
+
+/* the CH341A "set output" packet as sent by send_relay_cmd(), pins at [5] */
+#define CH341A_CMD_SET_OUTPUT 0xa1
+#define CH341A_SET_OUTPUT_PINS 5
+/* Elomax commands */
+#define ELOMAX_CMD_OUTPUT 0x4f
+#define ELOMAX_CMD_PULLUP 0x55
+
+static emu_board_t *
+emu_of(ios_handle_t *h)
+{
+    return h->transport_data;
+}
+
+/* a transfer takes time, on a simulated clock we make that happen */
+static uint64_t
+emu_transfer_time(emu_board_t *b, int len)
+{
+    b->transfers++;
+    b->bytes += len;
+    if (b->clock->simulated)
+        clock_sim_advance(b->clock, b->transfer_us);
+    return clock_now_us(b->clock);
+}
+
+static void
+emu_frame(emu_board_t *b, uint32_t outputs, uint64_t t_us)
+{
+    b->outputs = outputs;
+    b->frames++;
+    b->last_frame_us = t_us;
+    if (b->on_frame)
+        b->on_frame(b, outputs, t_us, b->on_frame_arg);
+}
+
+/* new state of the CH341A pins, clock and latch act on the rising edge */
+static void
+emu_set_pins(emu_board_t *b, uint8_t pins, uint64_t t_us)
+{
+    uint8_t rising = pins & ~b->pins;
+
+    if (rising & CH341A_PIN_CLOCK)
+        b->shift = (b->shift << 1) | ((pins & CH341A_PIN_DATA) ? 1 : 0);
+    if (rising & CH341A_PIN_LATCH)
+        emu_frame(b, b->shift & 0xff, t_us);
+    b->pins = pins;
+}
+
+/* CH341A parallel writes, one or more packets of command + data bytes */
+static void
+emu_para_write(emu_board_t *b, const uint8_t *buf, int len, uint64_t t_us)
+{
+    int strobes = 0;
+
+    /* without the init the pins are still in serial mode */
+    if (b->para_mode != CH341A_PARA_MODE_MEM)
+        return;
+    for (int p = 0; p < len; p += CH341A_PACKET_LEN) {
+        int end = p + CH341A_PACKET_LEN < len ? p + CH341A_PACKET_LEN : len;
+        int a;
+        if (buf[p] == CH341A_PARA_CMD_W0)
+            a = 0;
+        else if (buf[p] == CH341A_PARA_CMD_W1)
+            a = 1;
+        else
+            continue;
+        /* every byte is strobed, the latch keeps the last one */
+        if (end - p > 1) {
+            b->latch[a] = buf[end - 1];
+            strobes++;
+        }
+    }
+    if (strobes)
+        emu_frame(b, b->latch[0] | ((uint32_t) b->latch[1] << 8), t_us);
+}
+
+/*
+ * CH341A UIO stream, the chip runs the commands one after the other,
+ * waits are added to the time (and to a simulated clock), so the
+ * frames carry the time the chip would latch them
+ */
+static void
+emu_uio_stream(emu_board_t *b, const uint8_t *buf, int len, uint64_t t_us)
+{
+    uint64_t waited = 0;
+
+    for (int p = 0; p < len; p += CH341A_PACKET_LEN) {
+        int end = p + CH341A_PACKET_LEN < len ? p + CH341A_PACKET_LEN : len;
+        if (buf[p] != CH341A_CMD_UIO_STREAM)
+            break;
+        for (int i = p + 1; i < end && buf[i] != CH341A_UIO_STM_END; i++) {
+            uint8_t c = buf[i];
+            switch (c & 0xc0) {
+            case CH341A_UIO_STM_OUT:
+                emu_set_pins(b, c & 0x3f, t_us + waited);
+                break;
+            case CH341A_UIO_STM_US:
+                waited += c & 0x3f;
+                break;
+            default:
+                /* direction and input, nothing to see on the relays */
+                break;
+            }
+        }
+    }
+    b->uio_us += waited;
+    if (b->clock->simulated)
+        clock_sim_advance(b->clock, waited);
+}
+
+static int
+emu_open(ios_handle_t *h, uint16_t vid, uint16_t pid)
+{
+    emu_board_t *b = emu_of(h);
+    (void) vid;
+    (void) pid;
+
+    assert(NULL == h->device_handle);
+    if (!b->present) {
+        lwsl_warn("Cannot open device: emulated board unplugged\n");
+        return -1;
+    }
+    /* never dereferenced, only tells the rest we are connected */
+    h->device_handle = (libusb_device_handle *) b;
+    h->output_pending = 1;
+    /* a fresh open finds the chip in its power on mode */
+    b->para_mode = -1;
+    lwsl_info("emulated %s board is open\n",
+              b->brand == ELOMAX ? "Elomax" : b->brand == CH341A_PAR ? "CH341A parallel" : "CH341A");
+    return 0;
+}
+
+static void
+emu_drop(ios_handle_t *h)
+{
+    h->device_handle = NULL;
+}
+
+static int
+emu_bulk_out(ios_handle_t *h, uint8_t endpoint, uint8_t *buf, int len,
+             int *actual, unsigned timeout_ms)
+{
+    emu_board_t *b = emu_of(h);
+    (void) endpoint;
+    (void) timeout_ms;
+
+    *actual = 0;
+    if (!b->present)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (b->fail_next) {
+        b->fail_next--;
+        return LIBUSB_ERROR_IO;
+    }
+
+    uint64_t t = emu_transfer_time(b, len);
+    if (len > CH341A_SET_OUTPUT_PINS && buf[0] == CH341A_CMD_SET_OUTPUT)
+        emu_set_pins(b, buf[CH341A_SET_OUTPUT_PINS], t);
+    else if (buf[0] == CH341A_CMD_UIO_STREAM)
+        emu_uio_stream(b, buf, len, t);
+    else if (len > 1 && (buf[0] == CH341A_PARA_CMD_W0 || buf[0] == CH341A_PARA_CMD_W1))
+        emu_para_write(b, buf, len, t);
+
+    *actual = len;
+    return 0;
+}
+
+static int
+emu_control_out(ios_handle_t *h, uint8_t request_type, uint8_t request,
+                uint16_t value, uint16_t index, uint8_t *buf, uint16_t len,
+                unsigned timeout_ms)
+{
+    emu_board_t *b = emu_of(h);
+    (void) request_type;
+    (void) index;
+    (void) timeout_ms;
+
+    if (!b->present)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (b->fail_next) {
+        b->fail_next--;
+        return LIBUSB_ERROR_IO;
+    }
+
+    uint64_t t = emu_transfer_time(b, len);
+    if (request == CH341A_REQ_PARA_INIT)
+        b->para_mode = value >> 8;
+    else if (len >= 2 && buf[0] == ELOMAX_CMD_OUTPUT)
+        emu_frame(b, buf[1], t);
+
+    return len;
+}
+
+const ios_transport_t ios_emu_transport = {
+    .name = "emulator",
+    .open = emu_open,
+    .drop = emu_drop,
+    .close = emu_drop,
+    .bulk_out = emu_bulk_out,
+    .control_out = emu_control_out,
+};
+
+void
+emu_board_init(emu_board_t *b, device_brand_t brand, clock_source_t *clock)
+{
+    memset(b, 0, sizeof (*b));
+    b->brand = brand;
+    b->present = 1;
+    b->transfer_us = EMU_TRANSFER_US;
+    b->clock = clock ? clock : &clock_monotonic;
+    b->para_mode = -1;
+}
+
+void
+emu_attach(ios_handle_t *h, emu_board_t *b)
+{
+    h->transport = &ios_emu_transport;
+    h->transport_data = b;
+    b->brand = h->device_brand;
+}
@@ -0,0 +1,64 @@
+/* 
+ * File:   emu.h
+ * Author: oetelaar
+ *
+ * Emulated relay board behind the ios_transport_t calls.
+ * Decodes what the daemon sends (CH341A pin commands and UIO streams
+ * into an A6275 shift register, CH341A parallel writes into latches, or Elomax
+ * output packets) into relay outputs,
+ * with a simple timing model : every transfer takes transfer_us,
+ * on a simulated clock that time is added to the clock.
+ * Waits in a UIO stream add their time as well, the pin commands
+ * themselves take none.
+ */
+
+#ifndef EMU_H
+#define	EMU_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+#include "clock.h"
+
+    /* a synchronous full speed transfer costs about one USB frame */
+#define EMU_TRANSFER_US 1000
+
+    typedef struct emu_board
+    {
+        device_brand_t brand;
+        int present; /* 0 = unplugged, open() fails */
+        unsigned transfer_us; /* time one transfer takes */
+        unsigned fail_next; /* failure injection, this many transfers fail with an I/O error */
+        clock_source_t *clock; /* time stamps, a simulated one is moved by the transfers */
+
+        uint8_t pins; /* CH341A output pins */
+        uint32_t shift; /* A6275 shift register */
+        int para_mode; /* parallel mode set by the init request, -1 = not yet */
+        uint8_t latch[2]; /* parallel mode latches on A0 low / high */
+        uint32_t outputs; /* what the relays do now */
+
+        uint64_t frames; /* outputs taken over (latch pulses, parallel writes, Elomax output commands) */
+        uint64_t transfers;
+        uint64_t bytes;
+        uint64_t uio_us; /* time spent in UIO stream waits */
+        uint64_t last_frame_us; /* clock time of the last frame */
+
+        /* called for every frame the board takes */
+        void (*on_frame)(struct emu_board *b, uint32_t outputs, uint64_t t_us, void *arg);
+        void *on_frame_arg;
+    } emu_board_t;
+
+    extern const ios_transport_t ios_emu_transport;
+
+    /* a present board, relays off, clock NULL = clock_monotonic */
+    void emu_board_init(emu_board_t *b, device_brand_t brand, clock_source_t *clock);
+    /* drive b instead of real hardware */
+    void emu_attach(ios_handle_t *h, emu_board_t *b);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EMU_H */
@@ -0,0 +1,382 @@
+/* 
+ * File:   evloop.c
+ * Author: oetelaar
+ *
+ * poll() over a small table of fds, no threads, no magic
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "evloop.h"
+#include "lag.h"
+#include "logging.h"
+
+typedef struct
+{
+    evloop_cb_t cb;
+    void *arg;
+    int kind; /* what lag.c charges the callback to */
+} evloop_entry_t;
+
+typedef struct
+{
+    int id; /* 0 = free slot */
+    uint64_t due; /* evloop_now_us() when it fires */
+    uint64_t period; /* us, 0 = one shot */
+    evloop_timer_cb_t cb;
+    void *arg;
+} evloop_timer_t;
+
+static struct pollfd *pfds; /* handed to poll() as is */
+static evloop_entry_t *entries; /* same index as pfds */
+static int nfds;
+static int maxfds;
+
+static evloop_timer_t *timers; /* few of them, a plain table will do */
+static int ntimers;
+static int last_timer_id;
+
+/* evloop_defer(), run at the end of the round */
+#define EVLOOP_MAX_DEFER 64
+static struct
+{
+    evloop_timer_cb_t cb;
+    void *arg;
+} defers[EVLOOP_MAX_DEFER];
+static int ndefers;
+static int defers_done; /* the ones before this have run in this round */
+
+static clock_source_t *clk = &clock_monotonic;
+static int quit_code = -1; /* >= 0 when evloop_quit() was called */
+static int stuck; /* simulated clock without timers or fds, evloop_run() gives up */
+
+static int
+evloop_find(int fd)
+{
+    for (int i = 0; i < nfds; i++)
+        if (pfds[i].fd == fd)
+            return i;
+    return -1;
+}
+
+int
+evloop_add(int fd, short events, evloop_cb_t cb, void *arg)
+{
+    if (fd < 0 || evloop_find(fd) >= 0)
+        return -1;
+
+    if (nfds == maxfds) {
+        int n = maxfds ? maxfds * 2 : 16;
+        struct pollfd *p = realloc(pfds, n * sizeof (*p));
+        if (!p)
+            return -1;
+        pfds = p;
+        evloop_entry_t *e = realloc(entries, n * sizeof (*e));
+        if (!e)
+            return -1;
+        entries = e;
+        maxfds = n;
+    }
+
+    pfds[nfds].fd = fd;
+    pfds[nfds].events = events;
+    pfds[nfds].revents = 0;
+    entries[nfds].cb = cb;
+    entries[nfds].arg = arg;
+    entries[nfds].kind = LAG_FD;
+    nfds++;
+    return 0;
+}
+
+int
+evloop_set_kind(int fd, int kind)
+{
+    int i = evloop_find(fd);
+    if (i < 0)
+        return -1;
+    entries[i].kind = kind;
+    return 0;
+}
+
+int
+evloop_modify(int fd, short events)
+{
+    int i = evloop_find(fd);
+    if (i < 0)
+        return -1;
+    pfds[i].events = events;
+    return 0;
+}
+
+void
+evloop_del(int fd)
+{
+    int i = evloop_find(fd);
+    if (i < 0)
+        return;
+    /* keep the table dense, the last one moves into the hole */
+    nfds--;
+    pfds[i] = pfds[nfds];
+    entries[i] = entries[nfds];
+}
+
+uint64_t
+evloop_now_us(void)
+{
+    return clock_now_us(clk);
+}
+
+uint64_t
+evloop_now_ms(void)
+{
+    return clock_now_us(clk) / 1000;
+}
+
+void
+evloop_set_clock(clock_source_t *c)
+{
+    clk = c ? c : &clock_monotonic;
+}
+
+clock_source_t *
+evloop_clock(void)
+{
+    return clk;
+}
+
+int
+evloop_timer_add(unsigned ms, int repeat, evloop_timer_cb_t cb, void *arg)
+{
+    int i;
+
+    for (i = 0; i < ntimers; i++)
+        if (!timers[i].id)
+            break;
+
+    if (i == ntimers) {
+        evloop_timer_t *t = realloc(timers, (ntimers + 8) * sizeof (*t));
+        if (!t)
+            return -1;
+        memset(t + ntimers, 0, 8 * sizeof (*t));
+        timers = t;
+        ntimers += 8;
+    }
+
+    if (++last_timer_id <= 0)
+        last_timer_id = 1;
+    timers[i].id = last_timer_id;
+    timers[i].due = evloop_now_us() + (uint64_t) ms * 1000;
+    timers[i].period = repeat ? (uint64_t) ms * 1000 : 0;
+    timers[i].cb = cb;
+    timers[i].arg = arg;
+    return timers[i].id;
+}
+
+void
+evloop_timer_del(int id)
+{
+    if (id <= 0)
+        return;
+    for (int i = 0; i < ntimers; i++)
+        if (timers[i].id == id)
+            timers[i].id = 0;
+}
+
+/* when the first timer is due, UINT64_MAX when there are none */
+static uint64_t
+evloop_next_due(void)
+{
+    uint64_t due = UINT64_MAX;
+
+    for (int i = 0; i < ntimers; i++)
+        if (timers[i].id && timers[i].due < due)
+            due = timers[i].due;
+    return due;
+}
+
+/* poll() timeout until the first timer, bounded by timeout_ms */
+static int
+evloop_timeout(int timeout_ms)
+{
+    uint64_t due = evloop_next_due();
+    uint64_t now = evloop_now_us();
+
+    if (due == UINT64_MAX)
+        return timeout_ms;
+
+    /* round up, waking up early only means another round */
+    uint64_t left = due > now ? (due - now + 999) / 1000 : 0;
+    if (timeout_ms < 0 || left < (uint64_t) timeout_ms)
+        timeout_ms = (int) left;
+    return timeout_ms;
+}
+
+/*
+ * Lateness is real time, like all of lag.h. On the real loop clock that
+ * is from the due time to the call. A simulated clock is moved to the due
+ * time and has no real time for it, there it is from the start of the
+ * timers of this round to the call, what the timers before it took.
+ */
+static uint64_t
+evloop_timer_late(uint64_t due, uint64_t real_start)
+{
+    uint64_t real = clock_now_us(&clock_monotonic);
+
+    if (clk->simulated)
+        return real - real_start;
+    return real > due ? real - due : 0;
+}
+
+static void
+evloop_run_timers(void)
+{
+    uint64_t now = evloop_now_us();
+    uint64_t real_start = clock_now_us(&clock_monotonic);
+
+    for (int i = 0; i < ntimers; i++) {
+        if (!timers[i].id || timers[i].due > now)
+            continue;
+        evloop_timer_cb_t cb = timers[i].cb;
+        void *arg = timers[i].arg;
+        /* at the call, a slow timer before it makes it late too */
+        uint64_t late = evloop_timer_late(timers[i].due, real_start);
+        if (timers[i].period) {
+            timers[i].due += timers[i].period;
+            if (timers[i].due <= now) /* we were stalled, do not catch up */
+                timers[i].due = now + timers[i].period;
+        } else
+            timers[i].id = 0;
+        /* the callback may add timers, the table can move */
+        lag_enter_timer(late);
+        cb(arg);
+        lag_leave();
+    }
+}
+
+int
+evloop_defer(evloop_timer_cb_t cb, void *arg)
+{
+    for (int i = defers_done; i < ndefers; i++)
+        if (defers[i].cb == cb && defers[i].arg == arg)
+            return 0;
+    if (ndefers == EVLOOP_MAX_DEFER) {
+        lwsl_err("evloop: too many deferred calls\n");
+        return -1;
+    }
+    defers[ndefers].cb = cb;
+    defers[ndefers].arg = arg;
+    ndefers++;
+    return 0;
+}
+
+/* the ones deferred while these run are for the next round */
+static void
+evloop_run_defers(void)
+{
+    int n = ndefers;
+
+    for (int i = 0; i < n; i++) {
+        defers_done = i + 1;
+        lag_enter(LAG_DEFER);
+        defers[i].cb(defers[i].arg);
+        lag_leave();
+    }
+    memmove(defers, defers + n, (ndefers - n) * sizeof (defers[0]));
+    ndefers -= n;
+    defers_done = 0;
+}
+
+int
+evloop_run_once(int timeout_ms)
+{
+    int n;
+
+    /* something deferred for the next round, do not sleep */
+    if (ndefers)
+        timeout_ms = 0;
+
+    if (clk->simulated) {
+        /* look at the fds, but the time is ours to move */
+        n = poll(pfds, nfds, 0);
+        if (n == 0) {
+            uint64_t now = evloop_now_us();
+            uint64_t until = evloop_next_due();
+            if (timeout_ms >= 0 && now + (uint64_t) timeout_ms * 1000 < until)
+                until = now + (uint64_t) timeout_ms * 1000;
+            if (until != UINT64_MAX)
+                clock_sim_set(clk, until);
+            else if (timeout_ms < 0) {
+                /* no timer will ever be due, only an fd can still happen */
+                if (!nfds) {
+                    lwsl_err("evloop: simulated clock and nothing to wait for\n");
+                    stuck = 1;
+                    return -1;
+                }
+                n = poll(pfds, nfds, -1);
+            }
+        }
+    } else {
+        n = poll(pfds, nfds, evloop_timeout(timeout_ms));
+    }
+
+    if (n < 0) {
+        if (errno != EINTR)
+            lwsl_err("poll() failed : %s\n", strerror(errno));
+        return -1;
+    }
+
+    lag_round_begin();
+    evloop_run_timers();
+
+    /* 
+     * walk backwards, a callback may delete its own fd (moving the last
+     * entry into its slot) which we have then already handled
+     */
+    int handled = 0;
+    for (int i = nfds - 1; i >= 0 && handled < n; i--) {
+        if (i >= nfds)
+            continue;
+        short revents = pfds[i].revents;
+        if (!revents)
+            continue;
+        pfds[i].revents = 0;
+        handled++;
+        lag_enter_fd(entries[i].kind);
+        entries[i].cb(pfds[i].fd, revents, entries[i].arg);
+        lag_leave();
+    }
+    evloop_run_defers();
+    lag_round_end();
+    return handled;
+}
+
+void
+evloop_run_until(uint64_t until_ms)
+{
+    while (evloop_now_ms() < until_ms) {
+        uint64_t left = until_ms - evloop_now_ms();
+        evloop_run_once(left > 1000 ? 1000 : (int) left);
+    }
+}
+
+int
+evloop_run(void)
+{
+    while (quit_code < 0) {
+        evloop_run_once(-1);
+        if (stuck) {
+            stuck = 0;
+            return -1;
+        }
+    }
+    int code = quit_code;
+    quit_code = -1;
+    return code;
+}
+
+void
+evloop_quit(int code)
+{
+    quit_code = code < 0 ? 0 : code;
+}
@@ -0,0 +1,71 @@
+/* 
+ * File:   evloop.h
+ * Author: oetelaar
+ *
+ * Minimal poll() based event loop for the daemon.
+ * Every source of events (inotify, fuse, sockets) registers its fd
+ * with a callback, the loop calls it when the fd is ready.
+ */
+
+#ifndef EVLOOP_H
+#define	EVLOOP_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <poll.h>
+#include <stdint.h>
+#include "clock.h"
+
+    typedef void (*evloop_cb_t)(int fd, short revents, void *arg);
+    typedef void (*evloop_timer_cb_t)(void *arg);
+
+    /* watch fd for events (POLLIN etc), returns 0 or -1 */
+    int evloop_add(int fd, short events, evloop_cb_t cb, void *arg);
+    /* change the events we wait for on an already added fd */
+    int evloop_modify(int fd, short events);
+    /* what the lag monitor charges the callback of fd to (lag_kind_t), LAG_FD by default */
+    int evloop_set_kind(int fd, int kind);
+    /* stop watching fd, safe to call from inside a callback */
+    void evloop_del(int fd);
+    /* 
+     * call cb after ms milliseconds, again every ms when repeat is set
+     * returns a timer id (> 0) or -1
+     */
+    int evloop_timer_add(unsigned ms, int repeat, evloop_timer_cb_t cb, void *arg);
+    /* cancel a timer, safe to call from inside its own callback, id 0 is ignored */
+    void evloop_timer_del(int id);
+    /* 
+     * call cb once at the end of this round of the loop, after the ready
+     * fds and due timers, to act once on everything that came in
+     * (the same cb and arg deferred twice runs once), returns 0 or -1
+     */
+    int evloop_defer(evloop_timer_cb_t cb, void *arg);
+    /* time of the loop clock, what the timers run on */
+    uint64_t evloop_now_ms(void);
+    uint64_t evloop_now_us(void);
+    /* 
+     * run on another clock (NULL = clock_monotonic). With a simulated clock
+     * the loop never sleeps, when no fd is ready it moves the clock straight
+     * to the next timer.
+     */
+    void evloop_set_clock(clock_source_t *c);
+    clock_source_t *evloop_clock(void);
+    /* 
+     * run until evloop_quit(), returns its code, or -1 on a simulated
+     * clock with no timers and no fds left (nothing could ever happen)
+     */
+    int evloop_run(void);
+    /* make evloop_run() return code after this round */
+    void evloop_quit(int code);
+    /* run the loop until the clock passes until_ms, for simulated clocks */
+    void evloop_run_until(uint64_t until_ms);
+    /* wait at most timeout_ms (-1 = forever), run the callbacks, runs due timers, returns number of fds handled or -1 */
+    int evloop_run_once(int timeout_ms);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EVLOOP_H */
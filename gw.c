@@ -0,0 +1,682 @@
+/*
+ * File:   gw.c
+ * Author: oetelaar
+ *
+ * The fleet gateway, see gw.h
+ *
+ * Per host there is one connection to its daemon (ctl.c protocol),
+ * the message being collected for this round, and the messages in
+ * flight, oldest first. The daemon answers in order, so an ack is
+ * always for the oldest message. A message remembers the requests
+ * waiting for it and the boards each of them touched, so a failed
+ * board only fails the requests that asked for it. A request is
+ * answered when its last host acked.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "gw.h"
+#include "ctl.h"
+#include "evloop.h"
+#include "net.h"
+#include "stats.h"
+#include "logging.h"
+
+typedef struct gw_client
+{
+    int fd; /* -1 once closed */
+    net_buf_t in;
+    net_buf_t out;
+    uint64_t lines; /* request lines so far */
+    int pending; /* requests not answered yet */
+} gw_client_t;
+
+typedef struct gw_req
+{
+    gw_client_t *c;
+    uint64_t id;
+    int outstanding; /* hosts that did not ack yet */
+    int failed; /* hosts that failed */
+    uint64_t t0_us;
+    struct gw_req *next; /* free list */
+} gw_req_t;
+
+/* a request and a board it touched, the entries of one request are next to each other */
+typedef struct gw_wait
+{
+    gw_req_t *r;
+    uint16_t board;
+} gw_wait_t;
+
+typedef struct gw_msg
+{
+    uint64_t seq;
+    gw_wait_t *wait;
+    int nwait;
+    struct gw_msg *next;
+} gw_msg_t;
+
+typedef struct gw_cmd
+{
+    uint16_t board;
+    uint32_t set;
+    uint32_t clear;
+} gw_cmd_t;
+
+typedef struct gw_host
+{
+    char *name;
+    char *host;
+    char *port;
+    int fd; /* -1 when not connected */
+    int connecting;
+    int retry_timer;
+    net_buf_t in;
+    net_buf_t out;
+
+    /* the message of this round */
+    gw_cmd_t *cmd;
+    int ncmd, cmdcap;
+    gw_wait_t *wait;
+    int nwait, waitcap;
+    int queued; /* in gw.flush */
+    gw_req_t *last_req; /* to count a request once per host */
+
+    gw_msg_t *head, *tail; /* in flight */
+    uint64_t seq;
+    /* F records of the ack being read */
+    uint16_t *failed;
+    int nfailed, failedcap;
+} gw_host_t;
+
+static struct
+{
+    gw_host_t *hosts;
+    int nhosts;
+    gw_host_t **flush; /* hosts with a message for this round */
+    int nflush;
+    gw_req_t *free_reqs;
+
+    /* for the stats */
+    uint64_t requests, commands, messages;
+    uint64_t last_requests, last_commands, last_messages, last_us;
+    stats_hist_t latency;
+} gw;
+
+static void gw_host_connect(void *arg);
+
+/* ------------------------------------------------------------------ */
+/* clients */
+
+static void
+gw_client_free(void *arg)
+{
+    gw_client_t *c = arg;
+
+    if (c->fd >= 0 || c->pending)
+        return;
+    net_buf_free(&c->in);
+    net_buf_free(&c->out);
+    free(c);
+}
+
+/* the struct stays until the last request of it is answered */
+static void
+gw_client_close(gw_client_t *c)
+{
+    if (c->fd < 0)
+        return;
+    evloop_del(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    evloop_defer(gw_client_free, c);
+}
+
+static void
+gw_client_send(gw_client_t *c, const char *line)
+{
+    if (c->fd < 0)
+        return;
+    if (net_buf_append(&c->out, line, strlen(line)) != 0) {
+        lwsl_warn("gateway: client does not read its answers, closing\n");
+        gw_client_close(c);
+        return;
+    }
+    if (net_buf_send(c->fd, &c->out) < 0) {
+        gw_client_close(c);
+        return;
+    }
+    evloop_modify(c->fd, POLLIN | (c->out.len ? POLLOUT : 0));
+}
+
+static void
+gw_req_done(gw_req_t *r)
+{
+    gw_client_t *c = r->c;
+    char line[64];
+
+    if (r->failed)
+        snprintf(line, sizeof (line), "%llu err %d\n", (unsigned long long) r->id, r->failed);
+    else
+        snprintf(line, sizeof (line), "%llu ok\n", (unsigned long long) r->id);
+    gw_client_send(c, line);
+    stats_hist_add(&gw.latency, evloop_now_us() - r->t0_us);
+
+    c->pending--;
+    if (c->fd < 0 && c->pending == 0)
+        evloop_defer(gw_client_free, c);
+    r->next = gw.free_reqs;
+    gw.free_reqs = r;
+}
+
+static void
+gw_req_ack(gw_req_t *r, int failed)
+{
+    if (failed)
+        r->failed++;
+    if (--r->outstanding == 0)
+        gw_req_done(r);
+}
+
+/* a host answered (or failed) the requests in wait, failed are the boards it could not do */
+static void
+gw_wait_done(const gw_wait_t *wait, int nwait, const uint16_t *failed, int nfailed,
+             int all_failed)
+{
+    for (int i = 0; i < nwait;) {
+        gw_req_t *r = wait[i].r;
+        int bad = all_failed;
+        for (; i < nwait && wait[i].r == r; i++)
+            for (int f = 0; f < nfailed && !bad; f++)
+                bad = failed[f] == wait[i].board;
+        gw_req_ack(r, bad);
+    }
+}
+
+static gw_host_t *
+gw_host_by_name(const char *name, size_t len)
+{
+    for (int i = 0; i < gw.nhosts; i++)
+        if (strlen(gw.hosts[i].name) == len && !memcmp(gw.hosts[i].name, name, len))
+            return &gw.hosts[i];
+    return NULL;
+}
+
+static int
+gw_grow(void **p, int *cap, int need, size_t size)
+{
+    if (need <= *cap)
+        return 0;
+    int n = *cap ? *cap * 2 : 16;
+    while (n < need)
+        n *= 2;
+    void *q = realloc(*p, n * size);
+    if (!q)
+        return -1;
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+/* add to the message of this round, later commands win */
+static int
+gw_host_add(gw_host_t *h, gw_req_t *r, unsigned board, unsigned relay, int on)
+{
+    uint32_t bit = 1u << (relay - 1);
+    int i;
+
+    int w = h->nwait;
+
+    if (h->last_req != r) {
+        h->last_req = r;
+        if (h->fd < 0 || h->connecting) {
+            r->failed++;
+            return 0;
+        }
+        r->outstanding++;
+    } else if (h->fd < 0 || h->connecting) {
+        return 0;
+    } else {
+        /* this request has entries at the end already, one per board */
+        while (w > 0 && h->wait[w - 1].r == r && h->wait[w - 1].board != board)
+            w--;
+    }
+    if (w == 0 || h->wait[w - 1].r != r) {
+        if (gw_grow((void **) &h->wait, &h->waitcap, h->nwait + 1, sizeof (*h->wait)))
+            return -1;
+        h->wait[h->nwait].r = r;
+        h->wait[h->nwait].board = (uint16_t) board;
+        h->nwait++;
+    }
+
+    for (i = 0; i < h->ncmd; i++)
+        if (h->cmd[i].board == board)
+            break;
+    if (i == h->ncmd) {
+        if (gw_grow((void **) &h->cmd, &h->cmdcap, h->ncmd + 1, sizeof (*h->cmd)))
+            return -1;
+        h->cmd[i].board = (uint16_t) board;
+        h->cmd[i].set = h->cmd[i].clear = 0;
+        h->ncmd++;
+    }
+    if (on) {
+        h->cmd[i].set |= bit;
+        h->cmd[i].clear &= ~bit;
+    } else {
+        h->cmd[i].clear |= bit;
+        h->cmd[i].set &= ~bit;
+    }
+    if (!h->queued) {
+        h->queued = 1;
+        gw.flush[gw.nflush++] = h;
+    }
+    return 0;
+}
+
+/* host/board/relay=value, returns 0 or -1 */
+static int
+gw_parse_cmd(const char *tok, size_t len, gw_host_t **h, unsigned *board,
+             unsigned *relay, int *on)
+{
+    char buf[GW_MAX_LINE];
+    char *eq, *s2, *s1;
+
+    if (len >= sizeof (buf))
+        return -1;
+    memcpy(buf, tok, len);
+    buf[len] = '\0';
+    if (!(eq = strchr(buf, '=')))
+        return -1;
+    *eq = '\0';
+    if (!(s2 = strrchr(buf, '/')))
+        return -1;
+    *s2 = '\0';
+    if (!(s1 = strrchr(buf, '/')))
+        return -1;
+
+    char *end;
+    *board = strtoul(s1 + 1, &end, 10);
+    if (end == s1 + 1 || *end || *board > 0xffff)
+        return -1;
+    *relay = strtoul(s2 + 1, &end, 10);
+    if (end == s2 + 1 || *end || *relay < FIRST_RELAY_NO || *relay > LAST_RELAY_NO)
+        return -1;
+
+    const char *v = eq + 1;
+    if (!strcmp(v, "1") || !strcmp(v, "on"))
+        *on = 1;
+    else if (!strcmp(v, "0") || !strcmp(v, "off"))
+        *on = 0;
+    else
+        return -1;
+
+    *h = gw_host_by_name(buf, s1 - buf);
+    return *h ? 0 : -1;
+}
+
+static void gw_flush(void *arg);
+
+static void
+gw_client_line(gw_client_t *c, const char *line, size_t len)
+{
+    struct
+    {
+        gw_host_t *h;
+        unsigned board, relay;
+        int on;
+    } cmds[GW_MAX_CMDS];
+    int ncmds = 0;
+    char reply[GW_MAX_LINE + 64];
+    uint64_t id = ++c->lines;
+
+    /* check the whole line first, it is all or nothing */
+    for (size_t i = 0; i < len;) {
+        while (i < len && (line[i] == ' ' || line[i] == '\t'))
+            i++;
+        size_t j = i;
+        while (j < len && line[j] != ' ' && line[j] != '\t')
+            j++;
+        if (j == i)
+            break;
+        if (ncmds == GW_MAX_CMDS ||
+            gw_parse_cmd(line + i, j - i, &cmds[ncmds].h, &cmds[ncmds].board,
+                         &cmds[ncmds].relay, &cmds[ncmds].on) != 0) {
+            snprintf(reply, sizeof (reply), "%llu err bad %.*s\n",
+                     (unsigned long long) id, (int) (j - i), line + i);
+            gw_client_send(c, reply);
+            return;
+        }
+        ncmds++;
+        i = j;
+    }
+
+    gw_req_t *r = gw.free_reqs;
+    if (r)
+        gw.free_reqs = r->next;
+    else if (!(r = malloc(sizeof (*r)))) {
+        gw_client_close(c);
+        return;
+    }
+    memset(r, 0, sizeof (*r));
+    r->c = c;
+    r->id = id;
+    r->t0_us = evloop_now_us();
+    c->pending++;
+    gw.requests++;
+    gw.commands += ncmds;
+
+    /* hold it until all hosts are asked, an early failure must not answer it */
+    r->outstanding = 1;
+    for (int k = 0; k < ncmds; k++)
+        if (gw_host_add(cmds[k].h, r, cmds[k].board, cmds[k].relay, cmds[k].on) != 0)
+            r->failed++;
+    for (int k = 0; k < ncmds; k++)
+        cmds[k].h->last_req = NULL;
+    if (gw.nflush)
+        evloop_defer(gw_flush, NULL);
+    gw_req_ack(r, 0);
+}
+
+static void
+gw_client_cb(int fd, short revents, void *arg)
+{
+    gw_client_t *c = arg;
+    (void) fd;
+
+    if (revents & POLLIN) {
+        if (net_buf_recv(c->fd, &c->in) < 0) {
+            gw_client_close(c);
+            return;
+        }
+        size_t start = 0;
+        for (size_t i = 0; i < c->in.len && c->fd >= 0; i++) {
+            if (c->in.data[i] != '\n')
+                continue;
+            size_t len = i - start;
+            if (len && c->in.data[start + len - 1] == '\r')
+                len--;
+            if (len)
+                gw_client_line(c, (const char *) c->in.data + start, len);
+            start = i + 1;
+        }
+        if (c->fd < 0)
+            return;
+        net_buf_consume(&c->in, start);
+        if (c->in.len > GW_MAX_LINE) {
+            lwsl_warn("gateway: request line too long, closing\n");
+            gw_client_close(c);
+            return;
+        }
+    } else if (revents & (POLLERR | POLLHUP)) {
+        gw_client_close(c);
+        return;
+    }
+
+    if (net_buf_send(c->fd, &c->out) < 0) {
+        gw_client_close(c);
+        return;
+    }
+    evloop_modify(c->fd, POLLIN | (c->out.len ? POLLOUT : 0));
+}
+
+static void
+gw_accept_cb(int fd, short revents, void *arg)
+{
+    (void) revents;
+    (void) arg;
+
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+
+    gw_client_t *c = calloc(1, sizeof (*c));
+    if (!c) {
+        close(cfd);
+        return;
+    }
+    net_setup(cfd);
+    c->fd = cfd;
+    evloop_add(cfd, POLLIN, gw_client_cb, c);
+}
+
+/* ------------------------------------------------------------------ */
+/* hosts */
+
+/* everything in flight and in this round fails, retry the connection later */
+static void
+gw_host_lost(gw_host_t *h, const char *why)
+{
+    lwsl_warn("gateway: %s (%s:%s) lost (%s), retry in %d ms\n",
+              h->name, h->host, h->port, why, GW_RETRY_MS);
+    evloop_del(h->fd);
+    close(h->fd);
+    h->fd = -1;
+    h->connecting = 0;
+    h->in.len = 0;
+    h->out.len = 0;
+
+    while (h->head) {
+        gw_msg_t *m = h->head;
+        h->head = m->next;
+        gw_wait_done(m->wait, m->nwait, NULL, 0, 1);
+        free(m->wait);
+        free(m);
+    }
+    h->tail = NULL;
+
+    h->ncmd = 0;
+    int n = h->nwait;
+    h->nwait = 0;
+    h->nfailed = 0;
+    gw_wait_done(h->wait, n, NULL, 0, 1);
+
+    evloop_timer_del(h->retry_timer);
+    h->retry_timer = evloop_timer_add(GW_RETRY_MS, 0, gw_host_connect, h);
+}
+
+static void
+gw_host_send(gw_host_t *h)
+{
+    if (net_buf_send(h->fd, &h->out) < 0) {
+        gw_host_lost(h, strerror(errno));
+        return;
+    }
+    evloop_modify(h->fd, POLLIN | (h->out.len ? POLLOUT : 0));
+}
+
+/* the message of this round goes out */
+static void
+gw_host_flush(gw_host_t *h)
+{
+    h->queued = 0;
+    if (h->ncmd == 0 || h->fd < 0)
+        return;
+
+    gw_msg_t *m = malloc(sizeof (*m));
+    uint8_t *p = net_buf_reserve(&h->out, (h->ncmd + 1) * CTL_RECORD_LEN);
+    if (!m || !p) {
+        free(m);
+        gw_host_lost(h, "daemon does not keep up");
+        return;
+    }
+
+    for (int i = 0; i < h->ncmd; i++) {
+        ctl_record_t r = {.type = CTL_SET, .board = h->cmd[i].board,
+            .set = h->cmd[i].set, .clear = h->cmd[i].clear};
+        ctl_put_record(p, &r);
+        p += CTL_RECORD_LEN;
+    }
+    ctl_record_t e = {.type = CTL_END, .count = h->ncmd, .seq = ++h->seq};
+    ctl_put_record(p, &e);
+    h->out.len += (h->ncmd + 1) * CTL_RECORD_LEN;
+
+    /* the waiters go with the message */
+    m->seq = h->seq;
+    m->wait = h->wait;
+    m->nwait = h->nwait;
+    m->next = NULL;
+    h->wait = NULL;
+    h->nwait = h->waitcap = 0;
+    h->ncmd = 0;
+    if (h->tail)
+        h->tail->next = m;
+    else
+        h->head = m;
+    h->tail = m;
+    gw.messages++;
+
+    gw_host_send(h);
+}
+
+static void
+gw_flush(void *arg)
+{
+    (void) arg;
+
+    for (int i = 0; i < gw.nflush; i++)
+        gw_host_flush(gw.flush[i]);
+    gw.nflush = 0;
+}
+
+static void
+gw_host_cb(int fd, short revents, void *arg)
+{
+    gw_host_t *h = arg;
+
+    if (h->connecting) {
+        int err = 0;
+        socklen_t len = sizeof (err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            gw_host_lost(h, strerror(err));
+            return;
+        }
+        h->connecting = 0;
+        lwsl_notice("gateway: connected to %s (%s:%s)\n", h->name, h->host, h->port);
+        evloop_modify(fd, POLLIN);
+        return;
+    }
+
+    if (revents & POLLIN) {
+        if (net_buf_recv(fd, &h->in) < 0) {
+            gw_host_lost(h, "closed by daemon");
+            return;
+        }
+        size_t i;
+        for (i = 0; i + CTL_RECORD_LEN <= h->in.len; i += CTL_RECORD_LEN) {
+            ctl_record_t k;
+            gw_msg_t *m = h->head;
+            ctl_get_record(h->in.data + i, &k);
+            if (k.type == CTL_FAILED) {
+                if (!gw_grow((void **) &h->failed, &h->failedcap, h->nfailed + 1,
+                             sizeof (*h->failed)))
+                    h->failed[h->nfailed++] = k.board;
+                continue;
+            }
+            if (k.type != CTL_ACK || !m)
+                continue;
+            if (k.seq != m->seq)
+                lwsl_warn("gateway: %s acked %llu, expected %llu\n", h->name,
+                          (unsigned long long) k.seq, (unsigned long long) m->seq);
+            h->head = m->next;
+            if (!h->head)
+                h->tail = NULL;
+            gw_wait_done(m->wait, m->nwait, h->failed, h->nfailed, 0);
+            h->nfailed = 0;
+            free(m->wait);
+            free(m);
+        }
+        net_buf_consume(&h->in, i);
+    } else if (revents & (POLLERR | POLLHUP)) {
+        gw_host_lost(h, "socket error");
+        return;
+    }
+
+    gw_host_send(h);
+}
+
+static void
+gw_host_connect(void *arg)
+{
+    gw_host_t *h = arg;
+
+    h->retry_timer = 0;
+    h->fd = net_connect(h->host, h->port);
+    if (h->fd < 0) {
+        h->retry_timer = evloop_timer_add(GW_RETRY_MS, 0, gw_host_connect, h);
+        return;
+    }
+    h->connecting = 1;
+    evloop_add(h->fd, POLLOUT, gw_host_cb, h);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+gw_stats(void *arg)
+{
+    uint64_t now = evloop_now_us();
+    double s = (now - gw.last_us) / 1e6;
+    uint64_t msgs = gw.messages - gw.last_messages;
+    char hist[160];
+    int up = 0;
+    (void) arg;
+
+    for (int i = 0; i < gw.nhosts; i++)
+        up += gw.hosts[i].fd >= 0 && !gw.hosts[i].connecting;
+    stats_hist_format(&gw.latency, hist, sizeof (hist));
+    lwsl_notice("gateway: hosts=%d/%d requests/s=%.0f commands/s=%.0f commands/message=%.1f latency us %s\n",
+                up, gw.nhosts,
+                (gw.requests - gw.last_requests) / s, (gw.commands - gw.last_commands) / s,
+                msgs ? (double) (gw.commands - gw.last_commands) / msgs : 0.0, hist);
+    stats_hist_reset(&gw.latency);
+    gw.last_requests = gw.requests;
+    gw.last_commands = gw.commands;
+    gw.last_messages = gw.messages;
+    gw.last_us = now;
+}
+
+int
+gw_run(const char *listen_on, char **hosts, int nhosts, unsigned stats_interval)
+{
+    assert(nhosts > 0 && nhosts <= GW_MAX_HOSTS);
+
+    gw.hosts = calloc(nhosts, sizeof (*gw.hosts));
+    gw.flush = calloc(nhosts, sizeof (*gw.flush));
+    for (int i = 0; i < nhosts; i++) {
+        gw_host_t *h = &gw.hosts[i];
+        gw.nhosts = i + 1;
+        const char *eq = strchr(hosts[i], '=');
+        const char *addr = eq ? eq + 1 : hosts[i];
+        h->name = eq ? strndup(hosts[i], eq - hosts[i]) : strdup(hosts[i]);
+        if (net_split_host_port(addr, &h->host, &h->port) != 0 || !h->host) {
+            lwsl_err("gateway host must be [name=]host:port, not %s\n", hosts[i]);
+            return 1;
+        }
+        if (strchr(h->name, '/') || gw_host_by_name(h->name, strlen(h->name)) != h) {
+            lwsl_err("gateway host name %s has a / or is used twice\n", h->name);
+            return 1;
+        }
+        h->fd = -1;
+    }
+
+    int fd = net_listen(listen_on, 64);
+    if (fd < 0)
+        return 1;
+    evloop_add(fd, POLLIN, gw_accept_cb, NULL);
+
+    for (int i = 0; i < nhosts; i++)
+        gw_host_connect(&gw.hosts[i]);
+
+    if (stats_interval) {
+        gw.last_us = evloop_now_us();
+        evloop_timer_add(stats_interval * 1000, 1, gw_stats, NULL);
+    }
+    lwsl_notice("gateway for %d host(s), clients on %s\n", nhosts, listen_on);
+    return evloop_run();
+}
@@ -0,0 +1,48 @@
+/*
+ * File:   gw.h
+ * Author: oetelaar
+ *
+ * Fleet gateway : one process that keeps a connection open to the
+ * relay daemons of many hosts (started with -c) and takes relay
+ * commands from control programs as text lines :
+ *
+ *   <host>/<board>/<relay>=<1|0|on|off> [more of the same ...]\n
+ *
+ * Every line is one request, answered with one line when every daemon
+ * it went to has acknowledged :
+ *
+ *   <n> ok
+ *   <n> err <failed> <why>
+ *
+ * n counts the lines of the connection from 1, so a client can send
+ * many lines without waiting. Everything that comes in for one host in
+ * one round of the event loop goes out as one message, so a burst of
+ * changes costs one write and one ack per host, not one per relay.
+ */
+
+#ifndef GW_H
+#define	GW_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define GW_MAX_HOSTS 256
+    /* relay commands in one request line */
+#define GW_MAX_CMDS 256
+#define GW_MAX_LINE 4096
+#define GW_RETRY_MS 1000
+
+    /*
+     * serve clients on [addr:]port, hosts are [name=]host:port, the name
+     * (default host:port) is what the clients use, runs until evloop_quit()
+     * stats_interval > 0 logs throughput and latency this often (seconds)
+     * returns the exit code
+     */
+    int gw_run(const char *listen_on, char **hosts, int nhosts, unsigned stats_interval);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* GW_H */
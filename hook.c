@@ -0,0 +1,286 @@
+/* 
+ * File:   hook.c
+ * Author: oetelaar
+ *
+ * The relay path only does a non blocking write() of a fixed size
+ * record into a pipe (atomic, smaller than PIPE_BUF). When the helper
+ * is behind and the pipe is full the record is dropped and counted,
+ * switching relays is more important than the audit trail.
+ * A helper that dies is reaped (SIGCHLD) and started again after
+ * HOOK_RESTART_MS, records meanwhile are dropped and counted too.
+ * A standby writes nothing, so it has no records until it takes over.
+ *
+ * The helper runs every hook for a record one after the other with
+ * these environment variables (masks in hex, bit 0 = relay 1) :
+ *   RELAY_BOARD (0 .. -n - 1) RELAY_OLD RELAY_NEW RELAY_CHANGED RELAY_REQUESTED
+ *   RELAY_GENERATION RELAY_OK RELAY_TIME (seconds.microseconds)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "hook.h"
+#include "evloop.h"
+#include "logging.h"
+
+#define HOOK_RESTART_MS 1000
+
+typedef struct
+{
+    uint64_t generation;
+    int32_t board; /* board_index */
+    uint32_t old_bits; /* confirmed before the write */
+    uint32_t new_bits; /* confirmed after the write */
+    uint32_t requested; /* what was asked for */
+    int32_t ok; /* 0 when the board did not take it */
+    int64_t tv_sec;
+    int32_t tv_usec;
+} hook_record_t;
+
+static int hook_fd = -1; /* write end of the pipe, -1 = no helper */
+static unsigned long hook_dropped;
+static char *const *hook_cmds;
+static int hook_n;
+static pid_t hook_pid = -1;
+static int hook_restart_timer;
+static int sigchld_fds[2] = {-1, -1}; /* the handler writes, the loop reads */
+
+static void
+hook_setenv(const char *name, const char *fmt, unsigned long long v)
+{
+    char buf[32];
+    snprintf(buf, sizeof (buf), fmt, v);
+    setenv(name, buf, 1);
+}
+
+static void
+hook_run(const char *cmd, const hook_record_t *r)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        lwsl_err("hook helper: fork() failed : %s\n", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        char buf[32];
+        hook_setenv("RELAY_BOARD", "%llu", r->board);
+        hook_setenv("RELAY_OLD", "%llx", r->old_bits);
+        hook_setenv("RELAY_NEW", "%llx", r->new_bits);
+        hook_setenv("RELAY_CHANGED", "%llx", r->old_bits ^ r->new_bits);
+        hook_setenv("RELAY_REQUESTED", "%llx", r->requested);
+        hook_setenv("RELAY_GENERATION", "%llu", r->generation);
+        hook_setenv("RELAY_OK", "%llu", r->ok ? 1 : 0);
+        snprintf(buf, sizeof (buf), "%lld.%06d", (long long) r->tv_sec, (int) r->tv_usec);
+        setenv("RELAY_TIME", buf, 1);
+        execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+        lwsl_notice("hook helper: '%s' exit status %d\n", cmd, WEXITSTATUS(status));
+}
+
+/* the helper process, runs until the daemon closes the pipe */
+static void
+hook_helper(int fd, char *const cmds[], int n)
+{
+    hook_record_t r;
+
+    /* the hooks are waited for one by one, not through the daemon's handler */
+    signal(SIGCHLD, SIG_DFL);
+    for (;;) {
+        ssize_t len = read(fd, &r, sizeof (r));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len != (ssize_t) sizeof (r))
+            break; /* EOF, the daemon is gone */
+        for (int i = 0; i < n; i++)
+            hook_run(cmds[i], &r);
+    }
+    _exit(0);
+}
+
+static void
+hook_dropped_one(const char *why)
+{
+    if ((hook_dropped++ % 100) == 0)
+        lwsl_warn("hook helper %s, %lu changes dropped\n", why, hook_dropped);
+}
+
+static void
+hook_listener(ios_handle_t *h, uint32_t old_outputbits, void *arg)
+{
+    hook_record_t r;
+    struct timeval tv;
+    (void) arg;
+
+    /* the board was not written, it is not ours to drive (yet) */
+    if (h->standby)
+        return;
+    /* only real changes, and failures */
+    if (old_outputbits == h->outputbits && !h->output_pending)
+        return;
+    if (hook_fd < 0) {
+        hook_dropped_one("is restarting");
+        return;
+    }
+
+    gettimeofday(&tv, NULL);
+    memset(&r, 0, sizeof (r));
+    r.generation = h->generation;
+    r.board = h->board_index;
+    r.old_bits = old_outputbits;
+    r.new_bits = h->outputbits;
+    r.requested = h->active_relays;
+    r.ok = !h->output_pending;
+    r.tv_sec = tv.tv_sec;
+    r.tv_usec = tv.tv_usec;
+
+    if (write(hook_fd, &r, sizeof (r)) == (ssize_t) sizeof (r))
+        return;
+
+    if (errno == EAGAIN) {
+        hook_dropped_one("is behind");
+    } else {
+        /* SIGCHLD brings it back */
+        lwsl_err("hook helper gone (%s)\n", strerror(errno));
+        close(hook_fd);
+        hook_fd = -1;
+        hook_dropped_one("is restarting");
+    }
+}
+
+/* fork the helper with a new pipe, returns 0 or -1 */
+static int
+hook_spawn(void)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        lwsl_err("hook pipe() failed : %s\n", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        lwsl_err("hook fork() failed : %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        /* a restart forks the running daemon, keep none of its sockets and devices */
+        long max = sysconf(_SC_OPEN_MAX);
+        if (max < 0 || max > 65536)
+            max = 65536;
+        for (int fd = 3; fd < max; fd++)
+            if (fd != fds[0])
+                close(fd);
+        hook_helper(fds[0], hook_cmds, hook_n);
+    }
+
+    close(fds[0]);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    hook_fd = fds[1];
+    hook_pid = pid;
+    lwsl_info("hook helper pid=%d runs %d hook(s)\n", pid, hook_n);
+    return 0;
+}
+
+static void
+hook_restart(void *arg)
+{
+    (void) arg;
+
+    hook_restart_timer = 0;
+    if (hook_pid < 0 && hook_spawn() != 0)
+        hook_restart_timer = evloop_timer_add(HOOK_RESTART_MS, 0, hook_restart, NULL);
+}
+
+static void
+hook_sigchld(int sig)
+{
+    int saved = errno;
+    (void) sig;
+
+    if (write(sigchld_fds[1], "c", 1) < 0) {
+        /* full, a wake up is pending anyway */
+    }
+    errno = saved;
+}
+
+/* a child ended, see if it was the helper */
+static void
+hook_sigchld_cb(int fd, short revents, void *arg)
+{
+    char buf[64];
+    int status;
+    (void) revents;
+    (void) arg;
+
+    while (read(fd, buf, sizeof (buf)) > 0)
+        ;
+    if (hook_pid < 0 || waitpid(hook_pid, &status, WNOHANG) != hook_pid)
+        return;
+
+    if (WIFSIGNALED(status))
+        lwsl_err("hook helper pid=%d killed by signal %d, restart in %d ms\n",
+                 hook_pid, WTERMSIG(status), HOOK_RESTART_MS);
+    else
+        lwsl_err("hook helper pid=%d exit status %d, restart in %d ms\n",
+                 hook_pid, WEXITSTATUS(status), HOOK_RESTART_MS);
+    hook_pid = -1;
+    if (hook_fd >= 0) {
+        close(hook_fd);
+        hook_fd = -1;
+    }
+    if (!hook_restart_timer)
+        hook_restart_timer = evloop_timer_add(HOOK_RESTART_MS, 0, hook_restart, NULL);
+}
+
+int
+hook_start(ios_handle_t **boards, int nboards, char *const cmds[], int n)
+{
+    struct sigaction sa;
+
+    if (n <= 0)
+        return 0;
+
+    hook_cmds = cmds;
+    hook_n = n;
+
+    /* SIGCHLD is turned into a readable fd for the event loop */
+    if (pipe(sigchld_fds) != 0) {
+        lwsl_err("hook pipe() failed : %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(sigchld_fds[i], F_SETFL, fcntl(sigchld_fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sigchld_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = hook_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    /* a dead helper must not kill the daemon, and we never block on it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (hook_spawn() != 0)
+        return -1;
+    evloop_add(sigchld_fds[0], POLLIN, hook_sigchld_cb, NULL);
+    for (int k = 0; k < nboards; k++)
+        ios_add_listener(boards[k], hook_listener, NULL);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/* 
+ * File:   hook.h
+ * Author: oetelaar
+ *
+ * Run local commands (notify, audit) when relays change.
+ * A helper process is forked once at startup, the daemon hands it a
+ * small record per change over a pipe and never waits for it.
+ */
+
+#ifndef HOOK_H
+#define	HOOK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define HOOK_MAX IOS_MAX_HOOKS
+
+    /* 
+     * fork the helper that runs cmds[0..n-1] with /bin/sh -c for every change
+     * of any of the boards, call before opening them so the child is small.
+     * returns 0 or -1
+     */
+    int hook_start(ios_handle_t **boards, int nboards, char *const cmds[], int n);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HOOK_H */
@@ -0,0 +1,556 @@
+/* 
+ * File:   ios.c
+ * Author: oetelaar
+ *
+ * Writing the IO boards : the Abacom (CH341A shift register), Elomax and
+ * CH341A parallel protocols over a transport (libusb or the emulator),
+ * and getting a board back when it went away.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "ios.h"
+#include "ch341a.h"
+#include "evloop.h"
+#include "lag.h"
+#include "logging.h"
+
+/* For API documentation see iosolution.h */
+/* I2CSolution van Elomax is USB device */
+
+static const uint16_t vid_table[] = {0x1a86, 0x07a0, 0x1a86};
+static const uint16_t pid_table[] = {0x5512, 0x1008, 0x5512};
+
+static void ios_schedule_reconnect(ios_handle_t *h);
+
+static int ios_open_devices; /* boards with an open device handle, all transports */
+
+/* implementation */
+
+/* forget the device after an error, the requested state stays pending */
+static void
+ios_drop_device(ios_handle_t *handle)
+{
+    if (handle->device_handle != NULL) {
+        handle->transport->drop(handle);
+        ios_open_devices--;
+    }
+    handle->device_handle = NULL;
+    handle->output_pending = 1;
+    /* the daemon gets the board back by itself */
+    if (handle->run_as_daemon)
+        ios_schedule_reconnect(handle);
+}
+
+int
+ios_open_device_count(void)
+{
+    return ios_open_devices;
+}
+
+static int
+ios_send(ios_handle_t *handle)
+{
+    /* bmRequest Type	 
+     * Bit 7: Request direction (0=Host to device – Out, 1=Device to host – In).
+     * Bits 5-6: Request type (0=standard, 1=class, 2=vendor, 3=reserved).
+     * Bits 0-4: Recipient (0=device, 1=interface, 2=endpoint, 3=other).
+     *
+     * int usb_control_msg(
+     * usb_dev_handle *dev,
+     * int requesttype, 0x21 see doc
+     * int request, 0x09 (set configuration)
+     * int value, (??)
+     * int index, (??)
+     * char *bytes, (data)
+     * int size, (number of bytes in data)
+     * int timeout); (milli seconds)
+     * */
+    //libusb_set_configuration()
+    /* 0x21 Byte : 0010 0001 , class, interface, host to device */
+    if (NULL == handle->device_handle) {
+        fprintf(stderr, "could not send, handle==null\n");
+        return (-1);
+    }
+    static const int packet_len = 8;
+    int writen_size = handle->transport->control_out(
+                                                     handle, 0x21,
+                                                     LIBUSB_REQUEST_SET_CONFIGURATION,
+                                                     0x00, 0,
+                                                     handle->data, packet_len,
+                                                     100);
+
+    if (writen_size != packet_len) {
+        fprintf(stderr, "Failed to send all the byte of the packet (%i)\n", writen_size);
+
+    }
+
+    return writen_size;
+}
+
+int
+USB_setup_device(ios_handle_t *handle)
+{
+    /* the elomax device needs some setup before accepting commands */
+    assert(handle);
+    assert(handle->device_brand < DEVICE_BRAND_LAST);
+
+    switch (handle->device_brand) {
+    case ABACOM:
+        lwsl_debug("ABACOM, nothing to do, USB_setup_device()\n");
+        break;
+    case ELOMAX:
+        /* Elomax setup */
+        lwsl_debug("ELOMAX, USB_setup_device() enable pull ups\n");
+        /* setup the pull up resistors */
+        handle->data[0] = 0x55;
+        handle->data[1] = 0xFF;
+        handle->data[2] = 0xFF;
+        int r;
+        r = ios_send(handle);
+        if (r < 0) {
+            ios_drop_device(handle);
+            return -1;
+        } else {
+            /* success */
+            /* check for pending output and do it */
+            if (handle->output_pending) {
+                if (USB_write_IO(handle) != -1) {
+                    return 0;
+                } else {
+                    return -1;
+                }
+            }
+        }
+        break;
+    case CH341A_PAR:
+        /* switch the chip to MEM mode, D0..D7 and the strobe drive the latch */
+        lwsl_debug("CH341A_PAR, USB_setup_device() parallel MEM mode\n");
+        if (handle->transport->control_out(handle, 0x40, CH341A_REQ_PARA_INIT,
+                                           CH341A_PARA_INIT_VALUE(CH341A_PARA_MODE_MEM),
+                                           0, NULL, 0, 100) < 0) {
+            lwsl_notice("parallel mode init failed\n");
+            ios_drop_device(handle);
+            return -1;
+        }
+        if (handle->output_pending)
+            return (USB_write_IO(handle) != -1) ? 0 : -1;
+        break;
+    default:
+        fprintf(stderr, "can not happen. invalid device brand\n");
+    }
+
+
+    return 0;
+}
+
+static int
+send_relay_cmd(ios_handle_t *handle, uint8_t cmd)
+{
+    static const unsigned char ch341a_cmd_part1[] = {0xa1, 0x6a, 0x1f, 0x00, 0x10};
+    static const unsigned char ch341a_cmd_part2[] = {0x3f, 0x00, 0x00, 0x00, 0x00};
+
+    uint8_t buf[32] = {0}; // buf is large enough
+    int n = sizeof (ch341a_cmd_part1);
+    int m = sizeof (ch341a_cmd_part2);
+
+    /* fill buf with complete message */
+    memcpy(buf, ch341a_cmd_part1, n);
+    buf[n] = cmd;
+    memcpy(buf + n + 1, ch341a_cmd_part2, m);
+
+    /* send message to usb endpoint */
+    static const int endpointid = 2; // for some reason
+    int numbytes = n + m + 1;
+    int actual_length = 0;
+
+    /* do usb action, rv !=0 on error */
+    int rv = handle->transport->bulk_out(handle, endpointid, buf, numbytes, &actual_length, 100);
+
+
+    //for (int i = 0; i < numbytes; i++)
+    //    lwsl_debug("pos=%02d val=%02x", i, buf[i]);
+
+    if (rv != 0)
+        lwsl_notice("libusb_bulk_transfer() failed");
+
+    // return 0 on successful write
+    return (numbytes != actual_length);
+}
+
+/* Actual communication with the device and saving the status */
+static int
+ios_write_board(ios_handle_t *handle)
+{
+    assert(handle);
+    assert(handle->device_handle);
+    uint8_t active_relays = (uint8_t) handle->active_relays;
+    //uint8_t verbose = handle->verbose;
+
+    if (ELOMAX == handle->device_brand) {
+        // do the Elomax protocol
+        handle->data[0] = 0x4F; /* command for i2csolution */
+        handle->data[1] = 0x00; /* port 0 output */
+        handle->data[2] = 0x00; /* port 1 output */
+        handle->data[3] = 0x00;
+        handle->data[4] = 0x00;
+        handle->data[5] = 0x00;
+        handle->data[6] = 0x00;
+        handle->data[7] = 0x00;
+
+        handle->data[1] = (unsigned char) active_relays; /* bitjes van poort 0 */
+        handle->data[2] = 0xFF; /* bitjes van poort 1 (inputs) allemaal hoog wegens pullups */
+
+        int r = ios_send(handle);
+        if (r < 0) {
+            ios_drop_device(handle);
+            return -1; // problems
+        } else {
+            /* succes, so reset flag */
+            handle->outputbits = active_relays; /* keep state here */
+            handle->output_pending = 0;
+        }
+
+    } else if (CH341A_PAR == handle->device_brand) {
+        /* parallel mode, the whole byte in one bulk transfer */
+        uint8_t frame[CH341A_PARA_FRAME_MAX];
+        size_t n = ch341a_build_mem_write(&active_relays, 8, frame);
+        int actual_length = 0;
+        if (handle->transport->bulk_out(handle, 2, frame, (int) n, &actual_length, 100) != 0
+            || actual_length != (int) n) {
+            lwsl_notice("parallel write failed\n");
+            goto error;
+        }
+    } else if (!handle->uio_stream) {
+        // do the ch341a protocol
+        /* expand the mask into the command frame, then send it byte by byte */
+        uint8_t frame[CH341A_FRAME_LEN(8)];
+        size_t n = ch341a_build_frame(&active_relays, 8, frame);
+        for (size_t i = 0; i < n; i++)
+            if (send_relay_cmd(handle, frame[i])) goto error;
+    } else {
+        /* -u : shift and latch as one UIO stream, one bulk transfer per frame */
+        uint8_t frame[CH341A_STREAM_FRAME_LEN(8)];
+        size_t n = ch341a_build_stream_frame(&active_relays, 8, frame);
+        int actual_length = 0;
+        if (handle->transport->bulk_out(handle, 2, frame, (int) n, &actual_length, 100) != 0
+            || actual_length != (int) n) {
+            lwsl_notice("libusb_bulk_transfer() failed\n");
+            goto error;
+        }
+    }
+
+    /* Remember the status */
+    handle->output_pending = 0;
+    handle->outputbits = active_relays;
+    return 0; // success
+error:
+    ios_drop_device(handle);
+    return -1; // problems
+}
+
+/* 
+ * Every write of the relay state goes through here, whoever asked for it.
+ * Each call is a new generation of the state, the listeners
+ * (replication etc) get to see it after the board has been written.
+ */
+int
+USB_write_IO(ios_handle_t *handle)
+{
+    assert(handle);
+    uint32_t old_outputbits = handle->outputbits;
+    int rc = 0;
+
+    handle->generation++;
+
+    if (handle->standby) {
+        /* another daemon drives the outputs, keep it for when we take over */
+        handle->output_pending = 1;
+    } else {
+        lag_enter(LAG_USB);
+        rc = ios_write_board(handle);
+        lag_leave();
+    }
+
+    for (int i = 0; i < handle->nlisteners; i++)
+        handle->listeners[i].cb(handle, old_outputbits, handle->listeners[i].arg);
+
+    return rc;
+}
+
+/*
+ * A pulse goes out as one UIO stream, the chip does the waiting,
+ * so the width does not depend on the host or the USB frame timing.
+ * The state before and after the pulse is the same, so the
+ * listeners are not told, and a standby leaves it to the primary.
+ */
+int
+USB_pulse_IO(ios_handle_t *handle, uint32_t mask, unsigned us)
+{
+    assert(handle);
+
+    if (handle->device_brand != ABACOM) {
+        lwsl_warn("pulses need the CH341A shift register board (-m 0)\n");
+        return -1;
+    }
+    if (us > CH341A_PULSE_MAX_US) {
+        lwsl_warn("pulse of %u us too long, at most %d\n", us, CH341A_PULSE_MAX_US);
+        return -1;
+    }
+    if (handle->standby)
+        return 0;
+    if (NULL == handle->device_handle)
+        return -1;
+
+    /* the pulse starts from what the board shows, so bring it up to date */
+    if (handle->output_pending || handle->outputbits != handle->active_relays)
+        if (USB_write_IO(handle) != 0)
+            return -1;
+
+    uint8_t off = (uint8_t) handle->outputbits;
+    uint8_t on = off | (uint8_t) mask;
+    uint8_t buf[CH341A_PULSE_BUF_LEN];
+    size_t n = ch341a_build_pulse(&on, &off, 8, us, buf);
+    int actual_length = 0;
+
+    lwsl_info("board %d pulse 0x%02x for %u us\n", handle->board_index, on & ~off, us);
+    lag_enter(LAG_USB);
+    int r = handle->transport->bulk_out(handle, 2, buf, (int) n, &actual_length, 100);
+    lag_leave();
+    if (r != 0 || actual_length != (int) n) {
+        lwsl_notice("pulse transfer failed\n");
+        ios_drop_device(handle);
+        return -1;
+    }
+    return 0;
+}
+
+int
+ios_add_listener(ios_handle_t *h, ios_listener_t cb, void *arg)
+{
+    assert(h);
+    if (h->nlisteners >= IOS_MAX_LISTENERS)
+        return -1;
+    h->listeners[h->nlisteners].cb = cb;
+    h->listeners[h->nlisteners].arg = arg;
+    h->nlisteners++;
+    return 0;
+}
+
+/* 
+ * The libusb transport, the real board.
+ */
+static libusb_context *shared_usb_context;
+static int shared_usb_users; /* device handles open on it */
+
+static int
+libusb_transport_open(ios_handle_t *handle, uint16_t VID, uint16_t PID)
+{
+    assert(NULL == handle->device_handle);
+
+    libusb_device **devs = {0}; // to retrieve a list of devices
+    libusb_device_handle *udh = NULL;
+    int r = 0;
+
+    /* one libusb session for all boards, kept over reconnects */
+    if (NULL == shared_usb_context) {
+        r = libusb_init(&shared_usb_context); // initialize the library for the session we just declared
+        if (r < 0) {
+            lwsl_err("Init Error %d\n", r); // there was an error
+            shared_usb_context = NULL;
+            return -1;
+        }
+        libusb_set_debug(shared_usb_context, 3);
+    }
+    libusb_context *ctx = shared_usb_context;
+    handle->usb_context = ctx;
+
+    ssize_t cnt = libusb_get_device_list(ctx, &devs); // get the list of devices
+    if (cnt < 0) {
+        lwsl_err("Get Device Error\n"); // there was an error
+        return -1;
+    }
+
+
+    lwsl_info("[%ld] Devices in list.\n", cnt);
+
+    if (handle->board_index == 0) {
+        udh = libusb_open_device_with_vid_pid(ctx, VID, PID); // ch341a_USB_VENDOR_ID, ch341a_USB_PROUCT_ID
+    } else {
+        /* more boards of the same kind, take the n-th one on the bus */
+        int n = handle->board_index;
+        for (ssize_t k = 0; k < cnt && !udh; k++) {
+            struct libusb_device_descriptor desc;
+            if (libusb_get_device_descriptor(devs[k], &desc) == 0 &&
+                desc.idVendor == VID && desc.idProduct == PID && n-- == 0)
+                if (libusb_open(devs[k], &udh) != 0)
+                    udh = NULL;
+        }
+    }
+
+    /* not needed anymore, on every path (the daemon retries for ever) */
+    libusb_free_device_list(devs, 1); // free the list, unref the devices in it
+
+    if (!udh) {
+        lwsl_warn("Cannot open device: libusb %p\n", udh);
+        return -1;
+    }
+
+    lwsl_info("Device is open\n");
+
+    if (libusb_kernel_driver_active(udh, 0) == 1) { // find out if kernel driver is attached
+        lwsl_info("Kernel Driver Active\n");
+
+        if (libusb_detach_kernel_driver(udh, 0) == 0) // detach it
+            lwsl_info("Kernel Driver Detached!\n");
+        else
+            lwsl_info("Kernel Driver Detach failed!\n");
+
+    }
+
+    r = libusb_claim_interface(udh, 0); // claim interface 0 
+
+    if (r < 0) {
+        lwsl_info("Cannot Claim Interface : %d\n", r);
+        libusb_close(udh);
+        handle->device_handle = NULL;
+        handle->output_pending = 1;
+        return -1;
+    }
+
+    lwsl_info("Claimed Interface\n");
+
+    handle->device_handle = udh; // copy for later use
+    shared_usb_users++;
+    handle->output_pending = 1;
+
+    return 0; // success
+}
+
+static void
+libusb_transport_drop(ios_handle_t *h)
+{
+    libusb_close(h->device_handle);
+    h->device_handle = NULL;
+    shared_usb_users--;
+}
+
+static void
+libusb_transport_close(ios_handle_t *h)
+{
+    if (h->device_handle)
+        libusb_transport_drop(h);
+
+    /* the last one to leave turns off the light */
+    if (shared_usb_users == 0 && shared_usb_context) {
+        libusb_exit(shared_usb_context);
+        shared_usb_context = NULL;
+    }
+}
+
+static int
+libusb_transport_bulk_out(ios_handle_t *h, uint8_t endpoint, uint8_t *buf, int len,
+                          int *actual, unsigned timeout_ms)
+{
+    return libusb_bulk_transfer(h->device_handle, endpoint, buf, len, actual, timeout_ms);
+}
+
+static int
+libusb_transport_control_out(ios_handle_t *h, uint8_t request_type, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *buf, uint16_t len,
+                             unsigned timeout_ms)
+{
+    return libusb_control_transfer(h->device_handle, request_type, request,
+                                   value, index, buf, len, timeout_ms);
+}
+
+const ios_transport_t ios_libusb_transport = {
+    .name = "libusb",
+    .open = libusb_transport_open,
+    .drop = libusb_transport_drop,
+    .close = libusb_transport_close,
+    .bulk_out = libusb_transport_bulk_out,
+    .control_out = libusb_transport_control_out,
+};
+
+int
+USB_open_device(ios_handle_t *handle, uint16_t VID, uint16_t PID)
+{
+    assert(handle);
+    if (NULL == handle->transport)
+        handle->transport = &ios_libusb_transport;
+    lag_enter(LAG_USB);
+    int r = handle->transport->open(handle, VID, PID);
+    lag_leave();
+    if (r != 0)
+        return -1;
+    ios_open_devices++;
+    return 0;
+}
+
+void
+USB_close_device(ios_handle_t *h)
+{
+    assert(h);
+    if (h->device_handle)
+        ios_open_devices--;
+    h->transport->close(h);
+}
+
+int
+ios_open(ios_handle_t *handle)
+{
+    assert(handle->device_brand < DEVICE_BRAND_LAST);
+    return USB_open_device(handle, vid_table[handle->device_brand], pid_table[handle->device_brand]);
+}
+
+int
+ios_connect(ios_handle_t *h)
+{
+    if (0 == ios_open(h)) {
+        USB_setup_device(h);
+        return 0;
+    }
+    lwsl_notice("IO board %d not found, trying again in the background\n", h->board_index);
+    h->output_pending = 1;
+    ios_schedule_reconnect(h);
+    return -1;
+}
+
+static void
+ios_reconnect_cb(void *arg)
+{
+    ios_handle_t *h = arg;
+
+    h->reconnect_timer = 0;
+    if (h->device_handle)
+        return;
+
+    if (0 == ios_open(h)) {
+        lwsl_notice("IO board %d is back\n", h->board_index);
+        h->reconnect_delay_ms = 0;
+        USB_setup_device(h);
+        /* what was asked for while it was gone */
+        if (h->device_handle && h->output_pending)
+            USB_write_IO(h);
+    } else {
+        ios_schedule_reconnect(h);
+    }
+}
+
+/* try again later, backing off from RECONNECT_MIN_MS to RECONNECT_MAX_MS */
+static void
+ios_schedule_reconnect(ios_handle_t *h)
+{
+    if (h->reconnect_timer)
+        return;
+
+    if (h->reconnect_delay_ms == 0)
+        h->reconnect_delay_ms = RECONNECT_MIN_MS;
+    else if ((h->reconnect_delay_ms *= 2) > RECONNECT_MAX_MS)
+        h->reconnect_delay_ms = RECONNECT_MAX_MS;
+
+    lwsl_info("IO board %d gone, try again in %u ms\n", h->board_index, h->reconnect_delay_ms);
+    h->reconnect_timer = evloop_timer_add(h->reconnect_delay_ms, 0, ios_reconnect_cb, h);
+}
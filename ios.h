@@ -0,0 +1,126 @@
+/* 
+ * File:   ios.h
+ * Author: oetelaar
+ *
+ * The IO board handle, shared by the modules that drive the relays,
+ * and the calls (ios.c) that write it to the board
+ */
+
+#ifndef IOS_H
+#define	IOS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <libusb.h>
+
+#define FIRST_RELAY_NO 1
+#define LAST_RELAY_NO 8
+/* the bits a relay mask may have, bit 0 = relay FIRST_RELAY_NO */
+#define RELAY_MASK_ALL ((1u << (LAST_RELAY_NO - FIRST_RELAY_NO + 1)) - 1)
+
+typedef enum device_brand
+{
+    ABACOM = 0, ELOMAX = 1,
+    CH341A_PAR = 2, /* CH341A in parallel (MEM) mode, relays on a latch */
+    DEVICE_BRAND_LAST
+} device_brand_t;
+
+#define IOS_MAX_LISTENERS 8
+#define IOS_MAX_HOOKS 8
+/* a daemon tries to get a lost board back, waiting longer every time */
+#define RECONNECT_MIN_MS 50
+#define RECONNECT_MAX_MS 5000
+
+struct ios_handle;
+
+/* told about every USB_write_IO(), old_outputbits is the state before it */
+typedef void (*ios_listener_t)(struct ios_handle *h, uint32_t old_outputbits, void *arg);
+
+/* 
+ * How the bytes get to the board. Normally libusb, the emulator (emu.c)
+ * puts a simulated board behind the same calls.
+ * return values are libusb style, negative on error
+ */
+typedef struct ios_transport
+{
+    const char *name;
+    /* find and claim the board, sets h->device_handle on success, 0 or -1 */
+    int (*open)(struct ios_handle *h, uint16_t vid, uint16_t pid);
+    /* let go of the board after an error, h->device_handle becomes NULL */
+    void (*drop)(struct ios_handle *h);
+    /* let go of the board and everything else */
+    void (*close)(struct ios_handle *h);
+    /* bulk OUT transfer, 0 and *actual set on success */
+    int (*bulk_out)(struct ios_handle *h, uint8_t endpoint, uint8_t *buf, int len,
+            int *actual, unsigned timeout_ms);
+    /* control OUT transfer, returns bytes written */
+    int (*control_out)(struct ios_handle *h, uint8_t request_type, uint8_t request,
+            uint16_t value, uint16_t index, uint8_t *buf, uint16_t len,
+            unsigned timeout_ms);
+} ios_transport_t;
+
+extern const ios_transport_t ios_libusb_transport;
+
+typedef struct ios_handle
+{
+    uint32_t active_relays; // bit mask requested 
+    uint32_t outputbits; // bit mask set
+    uint8_t data[8]; // buf for Elomax
+
+    const ios_transport_t *transport; // libusb unless set otherwise
+    void *transport_data; // for the transport (the emulated board)
+    libusb_context *usb_context; // pointer to usb context
+    libusb_device_handle *device_handle; // pointer to the usb device handle, NULL = not connected
+    device_brand_t device_brand; /* 0 = ch341a 1= Elomax IOsolutions I2c device */
+    int uio_stream; // -u : shift register frame as one UIO stream, not yet tried on a board
+
+    /* flag when output needs to be sent, but is not yet done (retry later ?) */
+    int output_pending; // cleared by write success 
+    // int verbose; // verbose output to console
+    int use_syslog; // use syslog for logging instead of console
+    int run_as_daemon; // run as daemon, use /tmp/ID/D_OUT_99 inotify for control
+    char *event_dir; // where to listen and send events
+    char *mount_dir; // where to mount the relay filesystem (NULL = none)
+    char *repl_peer; // host:port of the standby we replicate to (NULL = none)
+    char *repl_listen; // [addr:]port to listen on as standby (NULL = not a standby)
+    char *hooks[IOS_MAX_HOOKS]; // commands to run on every change
+    int nhooks;
+
+    int board_index; // 0 .. boards-1, n-th board of this kind on the bus
+    int watch; // inotify watch descriptor of event_dir
+    int reconnect_timer; // evloop timer id while waiting to reconnect
+    unsigned reconnect_delay_ms; // current back off
+
+    uint64_t generation; // bumped by every USB_write_IO()
+    int standby; // set while a primary daemon drives the outputs, board is not written
+
+    struct
+    {
+        ios_listener_t cb;
+        void *arg;
+    } listeners[IOS_MAX_LISTENERS];
+    int nlisteners;
+} ios_handle_t;
+
+/* declaration */
+void USB_close_device(ios_handle_t *h);
+int USB_open_device(ios_handle_t *handle, uint16_t VID, uint16_t PID);
+/* USB_open_device() with the VID and PID of the device brand */
+int ios_open(ios_handle_t *handle);
+/* ios_open() and set up, or leave it to the reconnect timer, returns 0 when open */
+int ios_connect(ios_handle_t *handle);
+int USB_setup_device(ios_handle_t *handle);
+int USB_write_IO(ios_handle_t *handle);
+/* relays in mask that are off go on for us microseconds, timed by the chip (CH341A serial board) */
+int USB_pulse_IO(ios_handle_t *handle, uint32_t mask, unsigned us);
+int ios_add_listener(ios_handle_t *h, ios_listener_t cb, void *arg);
+int ios_open_device_count(void); // open device handles, for leak checks
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* IOS_H */
@@ -0,0 +1,211 @@
+/*
+ * File:   lag.c
+ * Author: oetelaar
+ *
+ * The event loop lag monitor, see lag.h
+ * Two clock reads per handler call, no allocation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "lag.h"
+#include "clock.h"
+#include "stats.h"
+#include "logging.h"
+
+static const char *lag_names[LAG_KINDS] = {
+    "loop", "inotify", "fuse", "fds", "timers", "deferred", "usb", "log"
+};
+
+typedef struct
+{
+    lag_kind_t kind;
+    uint64_t own; /* us, without what was called from it */
+} lag_frame_t;
+
+static struct
+{
+    unsigned threshold_us;
+    int in_round;
+    uint64_t round_start;
+    uint64_t last; /* time up to here has been charged */
+    lag_frame_t stack[LAG_MAX_DEPTH]; /* [0] is the loop itself */
+    int depth;
+    int ignored; /* enters outside a round or too deep, their leaves are ignored too */
+
+    /* this round */
+    uint64_t spent[LAG_KINDS];
+    unsigned calls[LAG_KINDS];
+    uint64_t worst_ready;
+    uint64_t worst_late;
+
+    stats_hist_t kind[LAG_KINDS];
+    stats_hist_t ready;
+    stats_hist_t late;
+    stats_hist_t round;
+    unsigned long slow_rounds;
+
+    void (*emit)(int level, const char *line); /* the log output we time */
+} lag;
+
+static uint64_t
+lag_now(void)
+{
+    return clock_now_us(&clock_monotonic);
+}
+
+/* the time since the last switch goes to whatever ran */
+static void
+lag_charge(uint64_t t)
+{
+    lag_frame_t *f = &lag.stack[lag.depth - 1];
+
+    f->own += t - lag.last;
+    lag.spent[f->kind] += t - lag.last;
+    lag.last = t;
+}
+
+static void
+lag_push(lag_kind_t kind, uint64_t t)
+{
+    if (!lag.in_round || lag.depth == LAG_MAX_DEPTH) {
+        lag.ignored++;
+        return;
+    }
+    lag_charge(t);
+    lag.stack[lag.depth].kind = kind;
+    lag.stack[lag.depth].own = 0;
+    lag.depth++;
+    lag.calls[kind]++;
+}
+
+void
+lag_enter(lag_kind_t kind)
+{
+    lag_push(kind, lag_now());
+}
+
+void
+lag_leave(void)
+{
+    if (lag.ignored) {
+        lag.ignored--;
+        return;
+    }
+    if (lag.depth <= 1)
+        return;
+    lag_charge(lag_now());
+    lag.depth--;
+    stats_hist_add(&lag.kind[lag.stack[lag.depth].kind], lag.stack[lag.depth].own);
+}
+
+void
+lag_enter_fd(lag_kind_t kind)
+{
+    uint64_t t = lag_now();
+
+    if (lag.in_round) {
+        uint64_t waited = t - lag.round_start;
+        stats_hist_add(&lag.ready, waited);
+        if (waited > lag.worst_ready)
+            lag.worst_ready = waited;
+    }
+    lag_push(kind, t);
+}
+
+void
+lag_enter_timer(uint64_t late_us)
+{
+    stats_hist_add(&lag.late, late_us);
+    if (late_us > lag.worst_late)
+        lag.worst_late = late_us;
+    lag_enter(LAG_TIMER);
+}
+
+void
+lag_round_begin(void)
+{
+    uint64_t t = lag_now();
+
+    lag.in_round = 1;
+    lag.round_start = t;
+    lag.last = t;
+    lag.depth = 1;
+    lag.stack[0].kind = LAG_LOOP;
+    lag.stack[0].own = 0;
+    lag.ignored = 0;
+    memset(lag.spent, 0, sizeof (lag.spent));
+    memset(lag.calls, 0, sizeof (lag.calls));
+    lag.worst_ready = 0;
+    lag.worst_late = 0;
+}
+
+void
+lag_round_end(void)
+{
+    char where[200];
+    int n = 0;
+
+    if (!lag.in_round)
+        return;
+    uint64_t t = lag_now();
+    lag_charge(t);
+    lag.in_round = 0;
+
+    uint64_t took = t - lag.round_start;
+    stats_hist_add(&lag.round, took);
+    if (!lag.threshold_us || took <= lag.threshold_us)
+        return;
+
+    lag.slow_rounds++;
+    for (int k = 0; k < LAG_KINDS && n < (int) sizeof (where); k++)
+        if (lag.spent[k])
+            n += snprintf(where + n, sizeof (where) - n, " %s %llu (%u)", lag_names[k],
+                          (unsigned long long) lag.spent[k], lag.calls[k]);
+    lwsl_warn("lag: round took %llu us, us (calls) :%s, fd waited up to %llu us, timer late up to %llu us\n",
+              (unsigned long long) took, where,
+              (unsigned long long) lag.worst_ready, (unsigned long long) lag.worst_late);
+}
+
+static void
+lag_emit(int level, const char *line)
+{
+    lag_enter(LAG_LOG);
+    lag.emit(level, line);
+    lag_leave();
+}
+
+void
+lag_start(unsigned threshold_ms)
+{
+    lag.threshold_us = threshold_ms * 1000;
+    if (lwsl_emit != lag_emit) {
+        lag.emit = lwsl_emit;
+        lwsl_emit = lag_emit;
+    }
+}
+
+static void
+lag_report_hist(const char *name, stats_hist_t *s)
+{
+    char buf[160];
+
+    if (!s->count)
+        return;
+    stats_hist_format(s, buf, sizeof (buf));
+    lwsl_notice("lag: %-8s us %s\n", name, buf);
+    stats_hist_reset(s);
+}
+
+void
+lag_report(void)
+{
+    if (lag.slow_rounds)
+        lwsl_notice("lag: %lu round(s) over %u us\n", lag.slow_rounds, lag.threshold_us);
+    lag.slow_rounds = 0;
+    lag_report_hist("round", &lag.round);
+    lag_report_hist("ready", &lag.ready);
+    lag_report_hist("late", &lag.late);
+    for (int k = 1; k < LAG_KINDS; k++)
+        lag_report_hist(lag_names[k], &lag.kind[k]);
+}
@@ -0,0 +1,70 @@
+/*
+ * File:   lag.h
+ * Author: oetelaar
+ *
+ * How responsive the event loop is, measured all the time.
+ *
+ * The loop tells us when poll() returned and when it calls a handler,
+ * the USB and logging code tell us when they start and stop. Time is
+ * charged to the innermost kind only, so a USB write done from the
+ * inotify handler counts as usb, not as inotify. Into histograms go
+ *   ready     us from poll() returning to the fd handler being called
+ *   late      us a timer ran after it was due (on a simulated loop clock :
+ *             after the first timer of its round was called)
+ *   round     us of work per round of the loop (poll() to poll())
+ *   <kind>    us per call of each kind, its own time
+ * A round that takes longer than the threshold is logged right away,
+ * with where the time went.
+ *
+ * Always the real clock, also when the loop runs on a simulated one.
+ */
+
+#ifndef LAG_H
+#define	LAG_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+    typedef enum lag_kind
+    {
+        LAG_LOOP = 0, /* the loop itself, between handlers */
+        LAG_INOTIFY,
+        LAG_FUSE,
+        LAG_FD, /* every other fd : sockets, pipes */
+        LAG_TIMER,
+        LAG_DEFER,
+        LAG_USB,
+        LAG_LOG,
+        LAG_KINDS
+    } lag_kind_t;
+
+#define LAG_DEFAULT_MS 100
+    /* nesting of handlers, deeper is charged to the deepest we know */
+#define LAG_MAX_DEPTH 8
+
+    /* log rounds over threshold_ms (0 = never), and time the log output */
+    void lag_start(unsigned threshold_ms);
+
+    /* called by the loop */
+    void lag_round_begin(void);
+    void lag_round_end(void);
+    /* an fd handler of this kind is called now */
+    void lag_enter_fd(lag_kind_t kind);
+    /* a timer is called now, late_us after it was due */
+    void lag_enter_timer(uint64_t late_us);
+
+    /* around anything that may take long : USB transfers, log output */
+    void lag_enter(lag_kind_t kind);
+    void lag_leave(void);
+
+    /* log the histograms and start new ones */
+    void lag_report(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LAG_H */
@@ -0,0 +1,244 @@
+/*
+ * File:   lease.c
+ * Author: oetelaar
+ *
+ * Leased relays, see lease.h
+ */
+
+#include <stdlib.h>
+#include "lease.h"
+#include "sched.h"
+#include "evloop.h"
+#include "stats.h"
+#include "logging.h"
+
+#define LEASE_RELAYS (LAST_RELAY_NO - FIRST_RELAY_NO + 1)
+
+typedef struct lease
+{
+    struct lease *prev, *next; /* in its slot */
+    uint64_t expires; /* tick, may be later than the slot it is in */
+    int slot; /* -1 = no lease */
+    int was_on; /* on before the lease came, left on when it runs out */
+    unsigned board;
+    int pin;
+} lease_t;
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    lease_t **by_board; /* LEASE_RELAYS each, allocated with the first lease */
+    lease_t *slot[LEASE_SLOTS];
+    unsigned active;
+    uint64_t tick; /* done up to and including this one */
+    int timer; /* only while there are leases */
+    sched_client_t *sc;
+
+    /* since the last report */
+    unsigned long granted;
+    unsigned long renewed;
+    unsigned long expired;
+    unsigned long kept_on; /* expired on a relay that was on before */
+    stats_hist_t late; /* us after the tick it was due */
+} lease;
+
+static uint64_t
+lease_now(void)
+{
+    return evloop_now_ms() / LEASE_TICK_MS;
+}
+
+static void
+lease_link(lease_t *l, int slot)
+{
+    l->slot = slot;
+    l->prev = NULL;
+    l->next = lease.slot[slot];
+    if (l->next)
+        l->next->prev = l;
+    lease.slot[slot] = l;
+}
+
+static void
+lease_unlink(lease_t *l)
+{
+    if (l->prev)
+        l->prev->next = l->next;
+    else
+        lease.slot[l->slot] = l->next;
+    if (l->next)
+        l->next->prev = l->prev;
+    l->slot = -1;
+}
+
+static lease_t *
+lease_find(unsigned board, int pin, int create)
+{
+    if (board >= (unsigned) lease.nboards || pin < FIRST_RELAY_NO || pin > LAST_RELAY_NO)
+        return NULL;
+    lease_t *ls = lease.by_board[board];
+    if (!ls) {
+        if (!create)
+            return NULL;
+        ls = calloc(LEASE_RELAYS, sizeof (*ls));
+        if (!ls)
+            return NULL;
+        for (int i = 0; i < LEASE_RELAYS; i++) {
+            ls[i].slot = -1;
+            ls[i].board = board;
+            ls[i].pin = FIRST_RELAY_NO + i;
+        }
+        lease.by_board[board] = ls;
+    }
+    return &ls[pin - FIRST_RELAY_NO];
+}
+
+/* returns 1 when the relay has to be switched off */
+static int
+lease_expire(lease_t *l, uint64_t now_us)
+{
+    uint32_t bit = 1u << (l->pin - 1);
+
+    lease_unlink(l);
+    lease.active--;
+    lease.expired++;
+    stats_hist_add(&lease.late, now_us - l->expires * LEASE_TICK_MS * 1000);
+    lwsl_info("lease: board %u relay %d expired\n", l->board, l->pin);
+    /* not ours to switch off */
+    if (l->was_on) {
+        lease.kept_on++;
+        return 0;
+    }
+    /* switched off already by someone else, nothing to write */
+    if (!(sched_pending_relays(l->board) & bit))
+        return 0;
+    sched_add(lease.sc, l->board, 0, bit);
+    return 1;
+}
+
+static void lease_tick(void *arg);
+
+/* at the start of the next tick, a repeating timer would drift off it */
+static void
+lease_arm(void)
+{
+    uint64_t next_us = (lease.tick + 1) * LEASE_TICK_MS * 1000;
+    uint64_t now_us = evloop_now_us();
+    unsigned ms = next_us > now_us ? (next_us - now_us + 999) / 1000 : 0;
+
+    lease.timer = evloop_timer_add(ms, 0, lease_tick, NULL);
+}
+
+static void
+lease_tick(void *arg)
+{
+    uint64_t now = lease_now();
+    uint64_t now_us = evloop_now_us();
+    int off = 0;
+    (void) arg;
+
+    lease.timer = 0;
+
+    /* after a long stall every slot once is enough */
+    if (now - lease.tick > LEASE_SLOTS)
+        lease.tick = now - LEASE_SLOTS;
+
+    while (lease.tick < now) {
+        lease.tick++;
+        int s = lease.tick % LEASE_SLOTS;
+        lease_t *l = lease.slot[s];
+        while (l) {
+            lease_t *next = l->next;
+            if (l->expires <= lease.tick)
+                off += lease_expire(l, now_us);
+            else if ((int) (l->expires % LEASE_SLOTS) != s) {
+                /* renewed since it was put here */
+                lease_unlink(l);
+                lease_link(l, l->expires % LEASE_SLOTS);
+            }
+            l = next;
+        }
+    }
+
+    /* all that ran out now in one frame */
+    if (off)
+        sched_submit(lease.sc, 0);
+
+    if (lease.active)
+        lease_arm();
+}
+
+int
+lease_start(ios_handle_t **boards, int nboards)
+{
+    lease.boards = boards;
+    lease.nboards = nboards;
+    lease.by_board = calloc(nboards, sizeof (*lease.by_board));
+    lease.sc = sched_client_new("lease", "lease", NULL, NULL);
+    return lease.by_board && lease.sc ? 0 : -1;
+}
+
+int
+lease_renew(unsigned board, int pin, unsigned ms)
+{
+    lease_t *l = lease_find(board, pin, 1);
+
+    if (!l || !ms)
+        return -1;
+    /* with what is queued, a set or clear of this round is not written yet */
+    int on = !!(sched_pending_relays(board) & (1u << (pin - 1)));
+    uint64_t now = lease_now();
+    uint64_t expires = now + ((uint64_t) ms + LEASE_TICK_MS - 1) / LEASE_TICK_MS;
+
+    if (l->slot < 0) {
+        if (!lease.active++) {
+            lease.tick = now;
+            if (!lease.timer)
+                lease_arm();
+        }
+        lease_link(l, expires % LEASE_SLOTS);
+        l->was_on = on;
+        lease.granted++;
+    } else {
+        /* a later deadline waits for its slot to come round, an earlier one can not */
+        if (expires < l->expires) {
+            lease_unlink(l);
+            lease_link(l, expires % LEASE_SLOTS);
+        }
+        /* switched off meanwhile, from now on the lease has it */
+        if (!on)
+            l->was_on = 0;
+        lease.renewed++;
+    }
+    l->expires = expires;
+    return !on;
+}
+
+void
+lease_end(unsigned board, int pin)
+{
+    lease_t *l = lease_find(board, pin, 0);
+
+    if (!l || l->slot < 0)
+        return;
+    lease_unlink(l);
+    lease.active--;
+}
+
+void
+lease_report(void)
+{
+    char lat[160];
+
+    if (!lease.active && !lease.granted && !lease.renewed && !lease.expired)
+        return;
+    stats_hist_format(&lease.late, lat, sizeof (lat));
+    lwsl_notice("lease: active=%u new=%lu renewed=%lu expired=%lu (left on %lu) late us %s\n",
+                lease.active, lease.granted, lease.renewed, lease.expired, lease.kept_on, lat);
+    lease.granted = 0;
+    lease.renewed = 0;
+    lease.expired = 0;
+    lease.kept_on = 0;
+    stats_hist_reset(&lease.late);
+}
@@ -0,0 +1,58 @@
+/*
+ * File:   lease.h
+ * Author: oetelaar
+ *
+ * Relays that are on only as long as someone keeps asking for it.
+ *
+ * A client switches a relay on with a lease of some ms and renews it
+ * before that runs out, when it stops (crashed, hung, network gone) the
+ * daemon switches the relay off. Renewing only moves the deadline, the
+ * board is not written. A relay that was on already when the lease came
+ * (D_OUT, another client) was not switched on by it and is left on when
+ * the lease runs out, unless it was switched off and the lease switched
+ * it on again meanwhile.
+ *
+ * The leases hang in a hashed timer wheel of LEASE_SLOTS slots, one slot
+ * per LEASE_TICK_MS. A renewal leaves the lease where it is, when its old
+ * slot comes round it is moved to the slot of the new deadline. So a
+ * renewal is O(1) and a tick only looks at the leases of its own slot.
+ * All leases that run out in one tick go to the scheduler as one batch
+ * (class lease), which makes one frame of them.
+ */
+
+#ifndef LEASE_H
+#define	LEASE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define LEASE_TICK_MS 10
+    /* 2.56 s round the wheel, longer leases are looked at once per round */
+#define LEASE_SLOTS 256
+
+    /* after sched_start(), returns 0 or -1 */
+    int lease_start(ios_handle_t **boards, int nboards);
+
+    /*
+     * lease relay pin of board for ms (> 0) from now, new or renewed
+     * returns 1 when the caller has to switch the relay on (new, or it
+     * was switched off meanwhile), 0 when it is on already, -1 on error.
+     * A new lease on a relay that is on already does not switch it off.
+     * On and off are as the relay will be once everything queued for the
+     * scheduler is written (sched_pending_relays), not as last written.
+     */
+    int lease_renew(unsigned board, int pin, unsigned ms);
+    /* forget the lease, the relay is left as it is */
+    void lease_end(unsigned board, int pin);
+
+    /* leases, renewals, expiries and how late they were, then start over */
+    void lease_report(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LEASE_H */
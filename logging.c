@@ -6,6 +6,18 @@
 
 #include "logging.h"
 
+/* one copy for all files that include logging.h */
+int log_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
+void (*lwsl_emit)(int level, const char *line) = lwsl_emit_stderr;
+
+static const char * const log_level_names[] = {
+    "ERR",
+    "WARN",
+    "NOTICE",
+    "INFO",
+    "DEBUG",
+};
+
 void
 lwsl_emit_stderr(int level, const char *line)
 {
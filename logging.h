@@ -41,22 +41,14 @@ extern void _lws_log(int filter, const char *format, ...);
 #define lwsl_debug(...) _lws_log(LLL_DEBUG, __VA_ARGS__)
 
 
-static int log_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
+extern int log_level;
 void lwsl_emit_stderr(int level, const char *line);
 void lwsl_emit_syslog(int level, const char *line);
-void (*lwsl_emit)(int level, const char *line); // = lwsl_emit_stderr;
+extern void (*lwsl_emit)(int level, const char *line); // = lwsl_emit_stderr;
 
 void lws_set_log_level(int level, void (*log_emit_function)(int level,
         const char *line));
 
-static const char * const log_level_names[] = {
-    "ERR",
-    "WARN",
-    "NOTICE",
-    "INFO",
-    "DEBUG",
-};
-
 #ifdef	__cplusplus
 }
 #endif
@@ -26,7 +26,25 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include "main.h"
+#include "ios.h"
 #include "logging.h"
+#include "ch341a.h"
+#include "evloop.h"
+#include "repl.h"
+#include "hook.h"
+#include "emu.h"
+#include "stats.h"
+#include "soak.h"
+#include "ctl.h"
+#include "gw.h"
+#include "mqtt.h"
+#include "ws.h"
+#include "lag.h"
+#include "sched.h"
+#include "lease.h"
+#ifdef WITH_FUSE
+#include "relayfs.h"
+#endif
 
 /* Control IO via existence of files in Temp directory 
  * External programs can easily monitor this using inotify scripts
@@ -39,396 +57,301 @@
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define EVENT_BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
-
-static const int FIRST_RELAY_NO = 1;
-static const int LAST_RELAY_NO = 8;
-
-typedef enum device_brand
-{
-    ABACOM = 0, ELOMAX = 1, DEVICE_BRAND_LAST
-} device_brand_t;
-
-/* For API documentation see iosolution.h */
-/* I2CSolution van Elomax is USB device */
-
-static const uint16_t vid_table[] = {0x1a86, 0x07a0};
-static const uint16_t pid_table[] = {0x5512, 0x1008};
-
-typedef struct
-{
-    uint32_t active_relays; // bit mask requested 
-    uint32_t outputbits; // bit mask set
-    uint8_t data[8]; // buf for Elomax
-
-    libusb_context *usb_context; // pointer to usb context
-    libusb_device_handle *device_handle; // pointer to the usb device handle
-    device_brand_t device_brand; /* 0 = ch341a 1= Elomax IOsolutions I2c device */
-
-    /* flag when output needs to be sent, but is not yet done (retry later ?) */
-    int output_pending; // cleared by write success 
-    // int verbose; // verbose output to console
-    int use_syslog; // use syslog for logging instead of console
-    int run_as_daemon; // run as daemon, use /tmp/ID/D_OUT_99 inotify for control
-    char *event_dir; // where to listen and send events
-} ios_handle_t;
+#define MAX_BOARDS 1024
 
 /* declaration */
-void USB_close_device(ios_handle_t *h);
-int USB_open_device(ios_handle_t *handle, uint16_t VID, uint16_t PID);
-int USB_setup_device(ios_handle_t *handle);
-int USB_write_IO(ios_handle_t *handle);
 int run_as_daemon(ios_handle_t *h);
 int run_once(ios_handle_t *h, int argc, char *argv[]);
 
-/* implementation */
-static int
-ios_send(ios_handle_t *handle)
-{
-    /* bmRequest Type	 
-     * Bit 7: Request direction (0=Host to device – Out, 1=Device to host – In).
-     * Bits 5-6: Request type (0=standard, 1=class, 2=vendor, 3=reserved).
-     * Bits 0-4: Recipient (0=device, 1=interface, 2=endpoint, 3=other).
-     *
-     * int usb_control_msg(
-     * usb_dev_handle *dev,
-     * int requesttype, 0x21 see doc
-     * int request, 0x09 (set configuration)
-     * int value, (??)
-     * int index, (??)
-     * char *bytes, (data)
-     * int size, (number of bytes in data)
-     * int timeout); (milli seconds)
-     * */
-    //libusb_set_configuration()
-    /* 0x21 Byte : 0010 0001 , class, interface, host to device */
-    if (NULL == handle->device_handle) {
-        fprintf(stderr, "could not send, handle==null\n");
-        return (-1);
-    }
-    static const int packet_len = 8;
-    int writen_size = libusb_control_transfer(
-                                              handle->device_handle, 0x21,
-                                              LIBUSB_REQUEST_SET_CONFIGURATION,
-                                              0x00, 0,
-                                              handle->data, packet_len,
-                                              100);
-
-    if (writen_size != packet_len) {
-        fprintf(stderr, "Failed to send all the byte of the packet (%i)\n", writen_size);
-
-    }
-
-    return writen_size;
-}
+static int pulse_us = -1; /* -p, run once pulses the relays instead of setting them */
 
 int
-USB_setup_device(ios_handle_t *handle)
+run_once(ios_handle_t *h, int argc, char *argv[])
 {
-    /* the elomax device needs some setup before accepting commands */
-    assert(handle);
-    assert(handle->device_brand < DEVICE_BRAND_LAST);
-
-    switch (handle->device_brand) {
-    case ABACOM:
-        lwsl_debug("ABACOM, nothing to do, USB_setup_device()\n");
-        break;
-    case ELOMAX:
-        /* Elomax setup */
-        lwsl_debug("ELOMAX, USB_setup_device() enable pull ups\n");
-        /* setup the pull up resistors */
-        handle->data[0] = 0x55;
-        handle->data[1] = 0xFF;
-        handle->data[2] = 0xFF;
-        int r;
-        r = ios_send(handle);
-        if (r < 0) {
-            if (handle->device_handle != NULL) {
-                libusb_close(handle->device_handle);
+    /* just set some outputs on or off and quit */
+    for (int i = optind; i < argc; i++) {
+        int relay = atoi(argv[i]);
+        if (relay < FIRST_RELAY_NO || relay > LAST_RELAY_NO) {
+            fprintf(stderr, "error: only give valid relay numbers (1-8) as parameter\n");
+            fprintf(stderr, "you can use -v as first option to enable verbose output debugging\n");
+            fprintf(stderr, "example: ./%s -v 1 5 7 will switch 1 5 and 7 on the rest will be off\n", argv[0]);
+            return 2;
+        }
+        h->active_relays |= (1 << (relay - 1));
+    }
+    lwsl_debug("writing byte %d to usb\n", h->active_relays);
+
+    if (0 == ios_open(h)) {
+        USB_setup_device(h);
+        if (pulse_us >= 0) {
+            /* the relays go on for a moment, the rest stays off */
+            uint32_t mask = h->active_relays;
+            h->active_relays = 0;
+            if (USB_pulse_IO(h, mask, (unsigned) pulse_us) != 0) {
+                USB_close_device(h);
+                return 3;
             }
-            handle->device_handle = NULL;
-            handle->output_pending = 1;
-            return -1;
         } else {
-            /* success */
-            /* check for pending output and do it */
-            if (handle->output_pending) {
-                if (USB_write_IO(handle) != -1) {
-                    return 0;
-                } else {
-                    return -1;
-                }
-            }
+            USB_write_IO(h);
         }
-        break;
-    default:
-        fprintf(stderr, "can not happen. invalid device brand\n");
+        USB_close_device(h);
+    } else {
+        lwsl_warn("Error : device not open\n");
+        return 3;
     }
-
-
     return 0;
 }
 
-static int
-send_relay_cmd(libusb_device_handle *dev, uint8_t cmd)
+/* all boards of this daemon, board 0 is the one from the command line */
+static ios_handle_t **boards;
+static int nboards = 1;
+static sched_client_t *inotify_client; /* the event directories, for the frame scheduler */
+/* inotify watch descriptor -> board, wds are small increasing numbers */
+static ios_handle_t **board_of_wd;
+static int nwd;
+
+static unsigned long int eventcounter = 0;
+static stats_hist_t event_latency; /* us from inotify read to board written */
+static unsigned stats_interval; /* -t seconds, 0 = no reports */
+static unsigned long soak_events; /* -S, 0 = no soak test */
+static char *ctl_listen; /* -c, relay commands over TCP */
+static char *mqtt_broker; /* -M host:port */
+static char *mqtt_prefix = "switch_relay"; /* -T, topics below this */
+static char *ws_listen; /* -w, websocket live state */
+static unsigned lag_ms = LAG_DEFAULT_MS; /* -L, log loop rounds slower than this */
+
+static ios_handle_t *
+board_lookup(int wd)
 {
-    static const unsigned char ch341a_cmd_part1[] = {0xa1, 0x6a, 0x1f, 0x00, 0x10};
-    static const unsigned char ch341a_cmd_part2[] = {0x3f, 0x00, 0x00, 0x00, 0x00};
-
-    uint8_t buf[32] = {0}; // buf is large enough
-    int n = sizeof (ch341a_cmd_part1);
-    int m = sizeof (ch341a_cmd_part2);
-
-    /* fill buf with complete message */
-    memcpy(buf, ch341a_cmd_part1, n);
-    buf[n] = cmd;
-    memcpy(buf + n + 1, ch341a_cmd_part2, m);
-
-    /* send message to usb endpoint */
-    static const int endpointid = 2; // for some reason
-    int numbytes = n + m + 1;
-    int actual_length = 0;
-
-    /* do usb action, rv !=0 on error */
-    int rv = libusb_bulk_transfer(dev, endpointid, buf, numbytes, &actual_length, 100);
-
-
-    //for (int i = 0; i < numbytes; i++)
-    //    lwsl_debug("pos=%02d val=%02x", i, buf[i]);
-
-    if (rv != 0)
-        lwsl_notice("libusb_bulk_transfer() failed");
-
-    // return 0 on successful write
-    return (numbytes != actual_length);
+    return (wd >= 0 && wd < nwd) ? board_of_wd[wd] : NULL;
 }
 
-/* Actual communication with the device and saving the status */
-int
-USB_write_IO(ios_handle_t *handle)
+static void
+board_set_pin(ios_handle_t *b, int pin, int on, uint64_t t0)
 {
-    assert(handle);
-    libusb_device_handle *dev = handle->device_handle;
-    assert(dev);
-    uint8_t active_relays = (uint8_t) handle->active_relays;
-    //uint8_t verbose = handle->verbose;
-
-    if (ELOMAX == handle->device_brand) {
-        // do the Elomax protocol
-        handle->data[0] = 0x4F; /* command for i2csolution */
-        handle->data[1] = 0x00; /* port 0 output */
-        handle->data[2] = 0x00; /* port 1 output */
-        handle->data[3] = 0x00;
-        handle->data[4] = 0x00;
-        handle->data[5] = 0x00;
-        handle->data[6] = 0x00;
-        handle->data[7] = 0x00;
-
-        handle->data[1] = (unsigned char) active_relays; /* bitjes van poort 0 */
-        handle->data[2] = 0xFF; /* bitjes van poort 1 (inputs) allemaal hoog wegens pullups */
-
-        int r = ios_send(handle);
-        if (r < 0) {
-            if (handle->device_handle != NULL)
-                libusb_close(handle->device_handle);
-            handle->device_handle = NULL;
-            handle->output_pending = 1;
-        } else {
-            /* succes, so reset flag */
-            handle->outputbits = active_relays; /* keep state here */
-            handle->output_pending = 0;
-        }
-
-    } else {
-        // do the ch341a protocol
-        /* Send the command frame */
-        if (send_relay_cmd(dev, 0x00)) goto error;
-        /* send stuff for every bit in the mask */
-        for (uint8_t mask = 128; mask > 0; mask >>= 1) {
-            if (active_relays & mask) {
-                /* Send "relay on" */
-                if (send_relay_cmd(dev, 0x20)) goto error;
-                if (send_relay_cmd(dev, 0x28)) goto error;
-                if (send_relay_cmd(dev, 0x20)) goto error;
-            } else {
-                /* Send "relay off" */
-                if (send_relay_cmd(dev, 0x00)) goto error;
-                if (send_relay_cmd(dev, 0x08)) goto error;
-                if (send_relay_cmd(dev, 0x00)) goto error;
-            }
-        }
-        /* End the command frame */
-        if (send_relay_cmd(dev, 0x00)) goto error;
-        if (send_relay_cmd(dev, 0x01)) goto error;
-    }
-
-    /* Remember the status */
-    handle->output_pending = 0;
-    handle->outputbits = active_relays;
-    return 0; // success
-error:
-    if (handle->device_handle != NULL)
-        libusb_close(handle->device_handle);
-    handle->device_handle = NULL;
-    handle->output_pending = 1;
-    return -1; // problems
+    if (pin < FIRST_RELAY_NO || pin > LAST_RELAY_NO)
+        return;
+    uint32_t bit = 1u << (pin - 1);
+
+    lwsl_info("board %d set pin=%d %s\n", b->board_index, pin, on ? "HIGH" : "LOW");
+    eventcounter++;
+    /* every file is a batch of its own, the scheduler merges them per board */
+    sched_add(inotify_client, b->board_index, on ? bit : 0, on ? 0 : bit);
+    sched_submit(inotify_client, t0);
 }
 
-int
-USB_open_device(ios_handle_t *handle, uint16_t VID, uint16_t PID)
+/* written, tag is when the event was read */
+static void
+inotify_done(sched_client_t *c, const sched_batch_t *b, void *arg)
 {
-    assert(NULL == handle->device_handle);
-
-    libusb_device **devs = {0}; // to retrieve a list of devices
-    libusb_device_handle *udh = NULL;
-    libusb_context *ctx = NULL;
+    (void) c;
+    (void) arg;
 
-    int r = libusb_init(&ctx); // initialize the library for the session we just declared
-    handle->usb_context = ctx;
+    stats_hist_add(&event_latency, evloop_now_us() - b->tag);
+}
 
-    if (r < 0) {
-        lwsl_err("Init Error %d\n", r); // there was an error
-        return -1;
+/*
+ * D_PULSE_<pin>_<us> : pulse now, in order with the D_OUT changes
+ * before it, then remove the file so the same pulse can be asked again
+ */
+static void
+board_pulse_pin(ios_handle_t *b, int pin, unsigned us, const char *name)
+{
+    char path[4096];
+
+    if (pin >= FIRST_RELAY_NO && pin <= LAST_RELAY_NO) {
+        eventcounter++;
+        /* the changes so far go first */
+        sched_flush();
+        if (USB_pulse_IO(b, 1u << (pin - 1), us) != 0)
+            lwsl_warn("board %d pulse pin=%d %u us failed\n", b->board_index, pin, us);
     }
+    snprintf(path, sizeof (path), "%s/%s", b->event_dir, name);
+    unlink(path);
+}
 
-    libusb_set_debug(ctx, 3);
-
-    ssize_t cnt = libusb_get_device_list(ctx, &devs); // get the list of devices
-    if (cnt < 0) {
-        lwsl_err("Get Device Error\n"); // there was an error
-        return -1;
+/*
+ * D_LEASE_<pin>_<ms> : relay on for ms, creating the file again renews it,
+ * _0 ends the lease and switches the relay off. The file is removed.
+ */
+static void
+board_lease_pin(ios_handle_t *b, int pin, unsigned ms, const char *name, uint64_t t0)
+{
+    char path[4096];
+
+    if (pin >= FIRST_RELAY_NO && pin <= LAST_RELAY_NO) {
+        if (!ms) {
+            lease_end(b->board_index, pin);
+            board_set_pin(b, pin, 0, t0);
+        } else if (lease_renew(b->board_index, pin, ms) > 0)
+            board_set_pin(b, pin, 1, t0);
+        else
+            eventcounter++; /* renewed, nothing to write */
     }
+    snprintf(path, sizeof (path), "%s/%s", b->event_dir, name);
+    unlink(path);
+}
 
+/* 
+ * read to determine the event change happens on “/tmp” directory. 
+ * called by the event loop when the inotify fd is readable
+ */
+static void
+inotify_event_cb(int fd, short revents, void *arg)
+{
+    char buffer[EVENT_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    (void) revents;
+    (void) arg;
 
-    lwsl_info("[%ld] Devices in list.\n", cnt);
+    int length = read(fd, buffer, EVENT_BUF_LEN);
+    uint64_t t0 = evloop_now_us();
 
-    udh = libusb_open_device_with_vid_pid(ctx, VID, PID); // ch341a_USB_VENDOR_ID, ch341a_USB_PROUCT_ID
-    if (!udh) {
-        lwsl_warn("Cannot open device: libusb %p\n", udh);
-        return -1;
-    } else {
-        lwsl_info("Device is open\n");
-
-        handle->device_handle = udh; // copy for later use
+    /*checking for error*/
+    if (length < 0) {
+        perror("read");
     }
 
-    libusb_free_device_list(devs, 1); // free the list, unref the devices in it
-
-    if (libusb_kernel_driver_active(udh, 0) == 1) { // find out if kernel driver is attached
-        lwsl_info("Kernel Driver Active\n");
-
-        if (libusb_detach_kernel_driver(udh, 0) == 0) // detach it
-            lwsl_info("Kernel Driver Detached!\n");
-        else
-            lwsl_info("Kernel Driver Detach failed!\n");
+    int i = 0;
 
-    }
+    /*actually read return the list of change events happens. 
+     * Here, read the change event one by one and process it accordingly.*/
+    while (i < length) {
+        struct inotify_event *event = (struct inotify_event *) &buffer[i];
+        ios_handle_t *h = board_lookup(event->wd);
 
-    r = libusb_claim_interface(udh, 0); // claim interface 0 
+        if (event->len && h) {
 
-    if (r < 0) {
-        lwsl_info("Cannot Claim Interface : %d\n", r);
-        handle->device_handle = NULL;
-        handle->output_pending = 1;
-        return -1;
+            if (event->mask & IN_CREATE) {
+                if (event->mask & IN_ISDIR) {
+                    lwsl_debug("New directory %s created.\n", event->name);
+                } else {
+                    lwsl_debug("New file %s created.\n", event->name);
+                    /* check pattern */
+                    int pin = 0;
+                    unsigned us = 0;
+                    if (sscanf(event->name, "D_OUT_%d", &pin))
+                        board_set_pin(h, pin, 1, t0);
+                    else if (sscanf(event->name, "D_PULSE_%d_%u", &pin, &us) == 2)
+                        board_pulse_pin(h, pin, us, event->name);
+                    else if (sscanf(event->name, "D_LEASE_%d_%u", &pin, &us) == 2)
+                        board_lease_pin(h, pin, us, event->name, t0);
+                }
+            } else if (event->mask & IN_DELETE) {
+                if (event->mask & IN_ISDIR) {
+                    lwsl_debug("Directory %s deleted.\n", event->name);
+                } else {
+                    lwsl_debug("File %s deleted.\n", event->name);
+                    /* check pattern */
+                    int pin = 0;
+                    if (sscanf(event->name, "D_OUT_%d", &pin))
+                        board_set_pin(h, pin, 0, t0);
+                }
+            }
+        }
+        i += EVENT_SIZE + event->len;
     }
-
-    lwsl_info("Claimed Interface\n");
-
-    handle->output_pending = 1;
-
-    return 0; // success
+    /* the scheduler writes the boards at the end of this round */
 }
 
-void
-USB_close_device(ios_handle_t *h)
+static void
+stats_report(void *arg)
 {
-    assert(h);
-    assert(h->usb_context);
-
-    if (h->device_handle)
-        libusb_close(h->device_handle);
-
-    libusb_exit(h->usb_context);
+    static unsigned long last_events;
+    static uint64_t last_cpu;
+    char lat[160];
+    (void) arg;
+
+    uint64_t cpu = stats_cpu_us();
+    uint64_t rss = stats_rss_kb();
+    unsigned long events = eventcounter - last_events;
+
+    stats_hist_format(&event_latency, lat, sizeof (lat));
+    lwsl_notice("stats: boards=%d events=%lu cpu/event=%llu us rss=%llu kB (%llu kB/board) latency us %s\n",
+                nboards, events,
+                (unsigned long long) (events ? (cpu - last_cpu) / events : 0),
+                (unsigned long long) rss, (unsigned long long) (rss / nboards), lat);
+
+    last_events = eventcounter;
+    last_cpu = cpu;
+    stats_hist_reset(&event_latency);
+    sched_report();
+    lease_report();
+    mqtt_report();
+    lag_report();
 }
 
-int
-run_once(ios_handle_t *h, int argc, char *argv[])
+/* base_dir/board<k>, created when missing */
+static char *
+board_event_dir(const char *base_dir, int k)
 {
-    /* just set some outputs on or off and quit */
-    for (int i = optind; i < argc; i++) {
-        int relay = atoi(argv[i]);
-        if (relay < FIRST_RELAY_NO || relay > LAST_RELAY_NO) {
-            fprintf(stderr, "error: only give valid relay numbers (1-8) as parameter\n");
-            fprintf(stderr, "you can use -v as first option to enable verbose output debugging\n");
-            fprintf(stderr, "example: ./%s -v 1 5 7 will switch 1 5 and 7 on the rest will be off\n", argv[0]);
-            return 2;
-        }
-        h->active_relays |= (1 << (relay - 1));
-    }
-    lwsl_debug("writing byte %d to usb\n", h->active_relays);
+    char dir[4096];
 
-    if (0 == USB_open_device(h,
-                             vid_table[h->device_brand],
-                             pid_table[h->device_brand])) {
-        USB_setup_device(h);
-        USB_write_IO(h);
-        USB_close_device(h);
-    } else {
-        lwsl_warn("Error : device not open\n");
-        return 3;
-    }
-    return 0;
+    snprintf(dir, sizeof (dir), "%s/board%d", base_dir, k);
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        lwsl_err("can not create %s : %s\n", dir, strerror(errno));
+    return strdup(dir);
 }
 
-int
-run_as_daemon(ios_handle_t *h)
+/* another board like t, number k, with its own event directory below base_dir */
+static ios_handle_t *
+board_new(ios_handle_t *t, int k, const char *base_dir)
 {
-    assert(h);
-    assert(h->device_brand < DEVICE_BRAND_LAST);
-
-    lwsl_info("Keep Running, daemon not forking, eventpath=%s pid=%d\n",
-              h->event_dir, getpid());
-
-    /* connect to USB IO board */
-    while (1) {
-        if (0 == USB_open_device(h,
-                                 vid_table[h->device_brand],
-                                 pid_table[h->device_brand])) {
-            USB_setup_device(h);
-            break;
-        } else {
-            lwsl_info("IO board not found, try again in 1 sec\n");
-            sleep(1);
-        }
+    ios_handle_t *b = calloc(1, sizeof (ios_handle_t));
+
+    b->device_brand = t->device_brand;
+    b->uio_stream = t->uio_stream;
+    b->board_index = k;
+    b->use_syslog = t->use_syslog;
+    b->run_as_daemon = t->run_as_daemon;
+
+    if (t->transport == &ios_emu_transport) {
+        /* every emulated board gets its own emulator */
+        emu_board_t *e = calloc(1, sizeof (emu_board_t));
+        emu_board_init(e, t->device_brand, NULL);
+        e->on_frame = ((emu_board_t *) t->transport_data)->on_frame;
+        emu_attach(b, e);
+    } else {
+        b->transport = t->transport;
     }
 
-    /* start the Inotify stuff */
-    int fd = 0;
-    int length = 0;
-    char buffer[EVENT_BUF_LEN] = {0};
-    int wd = 0;
-    int i = 0;
-    unsigned long int eventcounter = 0;
-
-    fd = inotify_init();
-
-    if (fd < 0)
-        perror("inotify_init");
+    b->event_dir = board_event_dir(base_dir, k);
+    return b;
+}
 
-    wd = inotify_add_watch(fd, h->event_dir, IN_ALL_EVENTS);
+static int
+board_watch(int fd, ios_handle_t *h)
+{
+    int wd = inotify_add_watch(fd, h->event_dir, IN_ALL_EVENTS);
 
-    if (wd < 0)
+    if (wd < 0) {
         perror("inotify_add_watch");
+        return -1;
+    }
+    if (wd >= nwd) {
+        int n = wd + 64;
+        ios_handle_t **p = realloc(board_of_wd, n * sizeof (*p));
+        if (!p)
+            return -1;
+        memset(p + nwd, 0, (n - nwd) * sizeof (*p));
+        board_of_wd = p;
+        nwd = n;
+    }
+    board_of_wd[wd] = h;
+    h->watch = wd;
+    return 0;
+}
 
-    /* set initial outputs based on stat() of files already present */
-
+/* set initial outputs based on stat() of files already present */
+static void
+board_initial_state(ios_handle_t *h)
+{
     char b[4096] = {0}; /* file name buffer */
     struct stat sb; /* stat result buffer */
     unsigned relaybits = 0; /* bitpattern to set the relays to, clear */
 
     /* loop over files, stat() files, set bits in pattern */
 
-    for (i = FIRST_RELAY_NO; i < (LAST_RELAY_NO + 1); i++) {
+    for (int i = FIRST_RELAY_NO; i < (LAST_RELAY_NO + 1); i++) {
         int len = snprintf(b, sizeof (b), "%s/D_OUT_%d", h->event_dir, i);
         lwsl_debug("stat( %s ) len=%d\n", b, len);
         if (stat(b, &sb) == 0) {
@@ -441,73 +364,115 @@ run_as_daemon(ios_handle_t *h)
     }
 
     h->active_relays = relaybits;
-    USB_write_IO(h);
-    /* read to determine the event change happens on “/tmp” directory. 
-     * Actually this read blocks until the change event occurs*/
+    if (h->device_handle)
+        USB_write_IO(h);
+    else
+        h->output_pending = 1; /* written when the board shows up */
+}
+
+int
+run_as_daemon(ios_handle_t *h)
+{
+    assert(h);
+    assert(h->device_brand < DEVICE_BRAND_LAST);
 
-    while (1) {
-        length = read(fd, buffer, EVENT_BUF_LEN);
+    lwsl_info("Keep Running, daemon not forking, eventpath=%s boards=%d pid=%d\n",
+              h->event_dir, nboards, getpid());
+
+    /* more than one board : event_dir/board0 .. event_dir/boardN-1 */
+    boards = calloc(nboards, sizeof (*boards));
+    boards[0] = h;
+    if (nboards > 1) {
+        char *base_dir = h->event_dir;
+        for (int k = 1; k < nboards; k++)
+            boards[k] = board_new(h, k, base_dir);
+        h->event_dir = board_event_dir(base_dir, 0);
+    }
 
-        /*checking for error*/
-        if (length < 0) {
-            perror("read");
-        }
+    /* fork the hook helper now, while we are still small (no devices, no sockets) */
+    if (hook_start(boards, nboards, h->hooks, h->nhooks) != 0)
+        return 4;
 
-        int i = 0;
-
-        /*actually read return the list of change events happens. 
-         * Here, read the change event one by one and process it accordingly.*/
-        while (i < length) {
-            struct inotify_event *event = (struct inotify_event *) &buffer[i];
-
-            if (event->len) {
-
-                if (event->mask & IN_CREATE) {
-                    if (event->mask & IN_ISDIR) {
-                        lwsl_debug("New directory %s created.\n", event->name);
-                    } else {
-                        lwsl_debug("New file %s created.\n", event->name);
-                        /* check pattern */
-                        int pin = 0;
-                        if (sscanf(event->name, "D_OUT_%d", &pin)) {
-                            h->active_relays |= 1 << (pin - 1);
-                            lwsl_info("set pin=%d HIGH\n", pin);
-                            eventcounter++;
-                        }
-                    }
-                } else if (event->mask & IN_DELETE) {
-                    if (event->mask & IN_ISDIR) {
-                        lwsl_debug("Directory %s deleted.\n", event->name);
-                    } else {
-                        lwsl_debug("File %s deleted.\n", event->name);
-                        /* check pattern */
-                        int pin = 0;
-                        if (sscanf(event->name, "D_OUT_%d", &pin)) {
-                            h->active_relays &= ~(1 << (pin - 1));
-
-                            lwsl_info("set pin=%d LOW\n", pin);
-                            eventcounter++;
-                        }
-                    }
-                }
-            }
-            i += EVENT_SIZE + event->len;
-        }
-        /* send the pins states to the IO board */
-        USB_write_IO(h);
+    /* boards that are not there yet are opened by the reconnect timer, nobody waits */
+    for (int k = 0; k < nboards; k++)
+        ios_connect(boards[k]);
+
+    /* start the Inotify stuff, one instance watches all directories */
+    int fd = inotify_init();
 
+    if (fd < 0)
+        perror("inotify_init");
+
+    for (int k = 0; k < nboards; k++)
+        board_watch(fd, boards[k]);
+
+    /* a standby must not touch its board, so before the first write */
+    if (h->repl_listen && repl_standby_start(boards, nboards, h->repl_listen) != 0)
+        return 4;
+    if (h->repl_peer && repl_primary_start(boards, nboards, h->repl_peer) != 0)
+        return 4;
+
+    for (int k = 0; k < nboards; k++)
+        board_initial_state(boards[k]);
+
+    /* every source hands its changes to the scheduler, it writes the boards */
+    if (sched_start(boards, nboards) != 0)
+        return 4;
+    inotify_client = sched_client_new("inotify", "inotify", inotify_done, NULL);
+    if (lease_start(boards, nboards) != 0)
+        return 4;
+
+    /* the inotify fd and the optional relay filesystem feed the same loop */
+    evloop_add(fd, POLLIN, inotify_event_cb, NULL);
+    evloop_set_kind(fd, LAG_INOTIFY);
+    lag_start(lag_ms);
+
+    if (ctl_listen && ctl_start(boards, nboards, ctl_listen) != 0)
+        return 4;
+    if (mqtt_broker && mqtt_start(boards, nboards, mqtt_broker, mqtt_prefix) != 0)
+        return 4;
+    if (ws_listen && ws_start(boards, nboards, ws_listen) != 0)
+        return 4;
+
+#ifdef WITH_FUSE
+    if (h->mount_dir && relayfs_start(boards, nboards, h->mount_dir) != 0)
+        lwsl_err("could not mount relay filesystem on %s\n", h->mount_dir);
+#endif
+
+    if (stats_interval)
+        evloop_timer_add(stats_interval * 1000, 1, stats_report, NULL);
+
+    /* soak test, generates its own events and ends the loop when done */
+    if (soak_events && soak_start(boards, nboards, soak_events) != 0)
+        return 4;
+
+    int rc = evloop_run();
+
+#ifdef WITH_FUSE
+    relayfs_stop();
+#endif
+
+    evloop_del(fd);
+
+    for (int k = 0; k < nboards; k++) {
+        /*removing the directory from the watch list.*/
+        inotify_rm_watch(fd, boards[k]->watch);
+        USB_close_device(boards[k]);
     }
-    /*removing the “/tmp” directory from the watch list.*/
-    inotify_rm_watch(fd, wd);
 
     /*closing the INOTIFY instance*/
     close(fd);
 
 
-    USB_close_device(h);
-
+    return rc;
+}
 
-    return 0;
+static void
+emu_log_frame(emu_board_t *b, uint32_t outputs, uint64_t t_us, void *arg)
+{
+    (void) arg;
+    lwsl_notice("emulated board frame %llu : outputs 0x%02x at %llu us\n",
+                (unsigned long long) b->frames, outputs, (unsigned long long) t_us);
 }
 
 int
@@ -526,32 +491,118 @@ main(int argc, char *argv[])
 
     opterr = 0;
     int c;
+    int use_emulator = 0;
+    char *gw_listen = NULL; /* -G, run as fleet gateway */
+    char *gw_hosts[GW_MAX_HOSTS];
+    int ngw_hosts = 0;
+    static emu_board_t emu; /* -e, lives as long as the program */
 
-    while ((c = getopt(argc, argv, "dhi:sm:z:")) != -1)
+    while ((c = getopt(argc, argv, "b:c:deF:G:f:hH:i:L:M:n:p:Q:r:sm:S:t:T:uw:x:z:")) != -1)
         switch (c) {
 
+        case 'F':
+            sched_set_budget(atoi(optarg));
+            break;
+        case 'Q':
+            if (sched_set_class(optarg) != 0) {
+                fprintf(stderr, "-Q %s : expected <inotify|ctl|mqtt|ws|lease>=<weight>[:<changes per second>]\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'L':
+            lag_ms = atoi(optarg);
+            break;
+        case 'M':
+            mqtt_broker = strdup(optarg);
+            break;
+        case 'T':
+            mqtt_prefix = strdup(optarg);
+            break;
+        case 'w':
+            ws_listen = strdup(optarg);
+            break;
+        case 'n':
+            nboards = atoi(optarg);
+            if (nboards < 1 || nboards > MAX_BOARDS) {
+                fprintf(stderr, "number of boards (-n) must be 1 .. %d\n", MAX_BOARDS);
+                exit(1);
+            }
+            break;
+        case 'p':
+            pulse_us = atoi(optarg);
+            if (pulse_us < 0 || pulse_us > CH341A_PULSE_MAX_US) {
+                fprintf(stderr, "pulse (-p) must be 0 .. %d us\n", CH341A_PULSE_MAX_US);
+                exit(1);
+            }
+            break;
+        case 'r':
+            h->repl_peer = strdup(optarg);
+            break;
         case 's':
             h->use_syslog = 1;
             lwsl_emit = lwsl_emit_syslog;
             break;
+        case 'b':
+            h->repl_listen = strdup(optarg);
+            break;
+        case 'c':
+            ctl_listen = strdup(optarg);
+            break;
         case 'd':
             h->run_as_daemon = 1;
             break;
+        case 'G':
+            gw_listen = strdup(optarg);
+            break;
+        case 'H':
+            if (ngw_hosts >= GW_MAX_HOSTS) {
+                fprintf(stderr, "at most %d gateway hosts (-H)\n", GW_MAX_HOSTS);
+                exit(1);
+            }
+            gw_hosts[ngw_hosts++] = strdup(optarg);
+            break;
         case 'i':
             h->event_dir = strdup(optarg);
             break;
+        case 'e':
+            use_emulator = 1;
+            break;
+        case 'u':
+            h->uio_stream = 1;
+            break;
+        case 'f':
+#ifdef WITH_FUSE
+            h->mount_dir = strdup(optarg);
+#else
+            fprintf(stderr, "built without relay filesystem support (make WITH_FUSE=1)\n");
+            exit(1);
+#endif
+            break;
         case 'h':
             fprintf(stderr, _helptext);
             exit(1);
             break;
         case 'm':
-            /* device brand/protocol 0=ch341 1=elomax */
+            /* device brand/protocol 0=ch341 1=elomax 2=ch341 parallel */
             h->device_brand = atoi(optarg);
             if (h->device_brand >= DEVICE_BRAND_LAST) {
-                fprintf(stderr, "devicebrand must be < %d, (ABACOM=0 or Elomax=1)\n", DEVICE_BRAND_LAST);
+                fprintf(stderr, "devicebrand must be < %d, (ABACOM=0, Elomax=1 or CH341A parallel=2)\n", DEVICE_BRAND_LAST);
                 abort();
             }
             break;
+        case 'S':
+            soak_events = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            stats_interval = atoi(optarg);
+            break;
+        case 'x':
+            if (h->nhooks >= HOOK_MAX) {
+                fprintf(stderr, "at most %d hooks (-x)\n", HOOK_MAX);
+                exit(1);
+            }
+            h->hooks[h->nhooks++] = strdup(optarg);
+            break;
         case 'z': /* set log level */
             log_level = atoi(optarg);
             if (log_level > 31) {
@@ -570,7 +621,21 @@ main(int argc, char *argv[])
 
 
 
-    if (h->run_as_daemon) {
+    if (use_emulator) {
+        /* no hardware, an emulated board shows what it would have done */
+        emu_board_init(&emu, h->device_brand, NULL);
+        emu.on_frame = emu_log_frame;
+        emu_attach(h, &emu);
+    }
+
+    if (gw_listen) {
+        /* no board here, only the daemons on the -H hosts */
+        if (ngw_hosts == 0) {
+            fprintf(stderr, "the gateway (-G) needs at least one host (-H)\n");
+            exit(1);
+        }
+        rc = gw_run(gw_listen, gw_hosts, ngw_hosts, stats_interval);
+    } else if (h->run_as_daemon) {
         /* we keep running until the end of time (or signal) */
         if (0 == h->event_dir) {
             fprintf(stderr, "using /tmp as default event directory\n");
@@ -19,10 +19,30 @@ extern "C" {
             "\nswitch_relay [options] [relay_number] [relay_number]"
             "\noptions:"
             "\n -s : use syslog for logging instead of stderr"
+            "\n -c <[addr:]port> : (with -d) accept relay commands over TCP, from the fleet gateway"
             "\n -d : keep running (as a daemon) does not fork (use something like supervisord)"
             "\n -i <directory_name> : use event listing on this directory instead of /tmp"
+            "\n -e : no hardware, drive an emulated board (logs every frame it takes)"
+            "\n -F <boards> : (with -d) write at most this many boards per 10 ms, the sources share them fairly (default 0 = no limit)"
+            "\n -f <mount_dir> : (with -d) mount a relay filesystem here, echo 1 > <mount_dir>/board0/3 sets relay 3"
+            "\n -G <[addr:]port> : run as fleet gateway, clients send lines of <host>/<board>/<relay>=<0|1> here"
+            "\n -H <[name=]host:port> : (with -G) a daemon started with -c, up to 256 of them, name is what the clients use"
             "\n -h : show help text"
-            "\n -m <0|1> : use Abacom=0 (default) or Elmax=1 protocol and device"
+            "\n -L <ms> : (with -d) log every round of the event loop that takes longer, with where the time went (default 100, 0 = never)"
+            "\n -M <host:port> : (with -d) connect to this MQTT broker, relays are set and reported on topics below the -T prefix"
+            "\n -n <boards> : (with -d) drive this many boards of the same kind, events in <event_dir>/board0 .. board<n-1>"
+            "\n -T <prefix> : (with -M) topic prefix, default switch_relay"
+            "\n -t <seconds> : (with -d) log statistics (cpu per event, memory per board, latency percentiles) this often"
+            "\n -S <events> : (with -d -e) soak test, generate this many events with failures and unplugs, exit 5 on leaks or latency drift"
+            "\n -p <us> : (without -d) pulse the given relays for this many microseconds (0 .. 10000), timed by the CH341A itself"
+            "\n -Q <class>=<weight>[:<changes/s>] : (with -d) share and quota of a source class : inotify ctl mqtt ws lease, can be repeated"
+            "\n -r <host:port> : (with -d) primary, replicate the relay state to a standby daemon"
+            "\n -b <[addr:]port> : (with -d) standby, listen for the primary, drive the board only when it is gone"
+            "\n -m <0|1|2> : use Abacom=0 (default) or Elmax=1 protocol and device, 2 = CH341A parallel mode for latch boards"
+            "\n -u : (with -m 0) send the shift register frame as one UIO stream instead of 27 commands, not yet tried on a board"
+            "\n -w <[addr:]port> : (with -d) websocket live state for dashboards, clients may send <board>=<mask> (0 .. 0xff) back"
+            "\n -x <command> : (with -d) run command (/bin/sh -c) after every relay change, can be given up to 8 times"
+            "\n    environment: RELAY_BOARD RELAY_OLD RELAY_NEW RELAY_CHANGED RELAY_REQUESTED (hex masks) RELAY_GENERATION RELAY_OK RELAY_TIME"
             "\n -z loglevel : set loglevel (default=7) valid levels : ERR = 1, WARN =2, NOTICE=4, INFO=8, DEBUG=16 OR together"
             "\n"
             "\n"
@@ -34,6 +54,12 @@ extern "C" {
             "\nWhen using (-d) the program will monitor /tmp/ for creation or removal of files"
             "\n /tmp/D_OUT_1 /tmp/D_OUT_2 .. /tmp_D_OUT_8"
             "\n create a file with that name and the output will be active (on) remove the file and the output will deactivate (off)"
+            "\n /tmp/D_PULSE_3_500 : pulse relay 3 for 500 us (CH341A board), the file is removed afterwards"
+            "\n"
+            "\nHot standby: run a second host with its own board wired in parallel"
+            "\n standby $ switch_relay -d -b 7341"
+            "\n primary $ switch_relay -d -r standby-host:7341"
+            "\n the standby takes over with the latest state when the primary stops (2 s without heartbeat), and hands back when it returns"
             "\n"
             "\nexample :"
             "\n $ touch /tmp/D_OUT_1 : will active relay no 1"
@@ -0,0 +1,603 @@
+/*
+ * File:   mqtt.c
+ * Author: oetelaar
+ *
+ * The MQTT bridge, see mqtt.h
+ * Only what we need of MQTT 3.1.1 : CONNECT with a last will, one
+ * SUBSCRIBE, PUBLISH both ways (we send QoS 0 only), the QoS 1 and 2
+ * acknowledgements and PINGREQ.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "mqtt.h"
+#include "evloop.h"
+#include "net.h"
+#include "sched.h"
+#include "lease.h"
+#include "logging.h"
+
+/* packet types, high nibble of the first byte */
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PUBREC 0x50
+#define MQTT_PUBREL 0x60
+#define MQTT_PUBCOMP 0x70
+#define MQTT_SUBSCRIBE 0x80
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xc0
+#define MQTT_PINGRESP 0xd0
+
+#define MQTT_TOPIC_MAX 256
+
+/* batch tag : connection, ack type and packet id, 0 = no ack (QoS 0) */
+#define MQTT_TAG(gen, type, id) ((uint64_t) (gen) << 32 | (uint64_t) (type) << 16 | (id))
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    char *host;
+    char *port;
+    char *prefix;
+    char *client_id;
+
+    int fd; /* -1 when not connected */
+    int connecting; /* TCP connect in progress */
+    int up; /* CONNACK seen */
+    int retry_timer;
+    int ping_timer;
+    int ping_outstanding;
+    net_buf_t in;
+    net_buf_t out;
+    uint16_t next_id;
+
+    /* every message is a batch for the frame scheduler */
+    sched_client_t *sc;
+    uint32_t gen; /* connections so far, acks of an older one are not sent */
+
+    /*
+     * QoS 2 packet ids between PUBREC and PUBREL, seen before = duplicate,
+     * part of the session, so kept over a reconnect when the broker resumes it
+     */
+    uint8_t qos2[65536 / 8];
+
+    /* messages not applied, topic or payload too long, since the last report */
+    unsigned long too_long;
+
+    /* state topics */
+    uint32_t *published;
+    uint8_t *have_published; /* 0 = publish everything */
+    uint8_t *to_publish;
+} mq = {.fd = -1};
+
+static void mqtt_connect(void *arg);
+
+/* ------------------------------------------------------------------ */
+/* encoding */
+
+static uint8_t *
+put_u16(uint8_t *p, unsigned v)
+{
+    *p++ = (uint8_t) (v >> 8);
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+static uint8_t *
+put_str(uint8_t *p, const char *s)
+{
+    size_t n = strlen(s);
+    p = put_u16(p, n);
+    memcpy(p, s, n);
+    return p + n;
+}
+
+/* fixed header + body into the output buffer, returns 0 or -1 */
+static int
+mqtt_send(uint8_t type, const uint8_t *body, size_t len)
+{
+    uint8_t hdr[5];
+    size_t n = 0;
+    size_t rl = len;
+
+    /* nothing goes out before our CONNECT */
+    if (mq.fd < 0 || mq.connecting)
+        return -1;
+    hdr[n++] = type;
+    do {
+        uint8_t b = rl & 0x7f;
+        rl >>= 7;
+        hdr[n++] = b | (rl ? 0x80 : 0);
+    } while (rl);
+
+    if (net_buf_append(&mq.out, hdr, n) != 0 || net_buf_append(&mq.out, body, len) != 0)
+        return -1;
+    return 0;
+}
+
+static void
+mqtt_send_id(uint8_t type, uint16_t id)
+{
+    uint8_t body[2];
+    put_u16(body, id);
+    mqtt_send(type, body, 2);
+}
+
+static void
+mqtt_publish(const char *topic, const char *payload, int retain)
+{
+    uint8_t body[MQTT_TOPIC_MAX + 64];
+    size_t plen = strlen(payload);
+
+    if (strlen(topic) + plen + 2 > sizeof (body))
+        return;
+    uint8_t *p = put_str(body, topic);
+    memcpy(p, payload, plen);
+    mqtt_send(MQTT_PUBLISH | (retain ? 1 : 0), body, p + plen - body);
+}
+
+/* ------------------------------------------------------------------ */
+/* connection */
+
+static void
+mqtt_flush(void)
+{
+    if (mq.fd < 0 || mq.connecting)
+        return;
+    if (net_buf_send(mq.fd, &mq.out) < 0) {
+        /* mqtt_fd_cb notices on the next round */
+        evloop_modify(mq.fd, POLLIN | POLLOUT);
+        return;
+    }
+    evloop_modify(mq.fd, POLLIN | (mq.out.len ? POLLOUT : 0));
+}
+
+static void
+mqtt_lost(const char *why)
+{
+    lwsl_warn("mqtt: broker %s:%s lost (%s), retry in %d ms\n",
+              mq.host, mq.port, why, MQTT_RETRY_MS);
+    if (mq.fd >= 0) {
+        evloop_del(mq.fd);
+        close(mq.fd);
+    }
+    mq.fd = -1;
+    mq.connecting = 0;
+    mq.up = 0;
+    mq.in.len = 0;
+    mq.out.len = 0;
+    /* not acked, the broker sends them again (persistent session) */
+    mq.gen++;
+    evloop_timer_del(mq.ping_timer);
+    mq.ping_timer = 0;
+    evloop_timer_del(mq.retry_timer);
+    mq.retry_timer = evloop_timer_add(MQTT_RETRY_MS, 0, mqtt_connect, NULL);
+}
+
+static void
+mqtt_send_connect(void)
+{
+    uint8_t body[3 * MQTT_TOPIC_MAX + 32];
+    char will[MQTT_TOPIC_MAX];
+    uint8_t *p = body;
+
+    snprintf(will, sizeof (will), "%s/status", mq.prefix);
+    p = put_str(p, "MQTT");
+    *p++ = 4; /* 3.1.1 */
+    /* persistent session, retained last will at QoS 0 */
+    *p++ = 0x20 | 0x04;
+    p = put_u16(p, MQTT_KEEPALIVE_S);
+    p = put_str(p, mq.client_id);
+    p = put_str(p, will);
+    p = put_str(p, "offline");
+    mqtt_send(MQTT_CONNECT, body, p - body);
+}
+
+static void
+mqtt_send_subscribe(void)
+{
+    uint8_t body[MQTT_TOPIC_MAX + 8];
+    char filter[MQTT_TOPIC_MAX];
+    uint8_t *p = body;
+
+    /* board<k>/relay<n>/set, board<k>/relay<n>/lease and board<k>/mask/set */
+    snprintf(filter, sizeof (filter), "%s/+/+/+", mq.prefix);
+    if (++mq.next_id == 0)
+        mq.next_id = 1;
+    p = put_u16(p, mq.next_id);
+    p = put_str(p, filter);
+    *p++ = 2; /* the publisher decides, up to QoS 2 */
+    mqtt_send(MQTT_SUBSCRIBE | 0x02, body, p - body);
+}
+
+static void
+mqtt_ping(void *arg)
+{
+    (void) arg;
+
+    if (mq.ping_outstanding) {
+        mqtt_lost("no ping response");
+        return;
+    }
+    mq.ping_outstanding = 1;
+    mqtt_send(MQTT_PINGREQ, NULL, 0);
+    mqtt_flush();
+}
+
+/* ------------------------------------------------------------------ */
+/* state topics */
+
+static void
+mqtt_publish_states(void *arg)
+{
+    char topic[MQTT_TOPIC_MAX];
+    char payload[16];
+    (void) arg;
+
+    if (!mq.up)
+        return;
+    for (int k = 0; k < mq.nboards; k++) {
+        if (!mq.to_publish[k])
+            continue;
+        mq.to_publish[k] = 0;
+        uint32_t bits = mq.boards[k]->outputbits;
+        uint32_t changed = mq.have_published[k] ? bits ^ mq.published[k] : ~0u;
+        if (!changed)
+            continue;
+        for (int n = FIRST_RELAY_NO; n <= LAST_RELAY_NO; n++) {
+            uint32_t bit = 1u << (n - 1);
+            if (!(changed & bit))
+                continue;
+            snprintf(topic, sizeof (topic), "%s/board%d/relay%d", mq.prefix, k, n);
+            mqtt_publish(topic, (bits & bit) ? "1" : "0", 1);
+        }
+        snprintf(topic, sizeof (topic), "%s/board%d/mask", mq.prefix, k);
+        snprintf(payload, sizeof (payload), "0x%02x", bits);
+        mqtt_publish(topic, payload, 1);
+        mq.published[k] = bits;
+        mq.have_published[k] = 1;
+    }
+    mqtt_flush();
+}
+
+/* after every write of a board, whoever did it, the state goes out once per round */
+static void
+mqtt_listener(ios_handle_t *h, uint32_t old_outputbits, void *arg)
+{
+    (void) old_outputbits;
+    (void) arg;
+
+    mq.to_publish[h->board_index] = 1;
+    evloop_defer(mqtt_publish_states, NULL);
+}
+
+/* ------------------------------------------------------------------ */
+/* commands */
+
+static void
+mqtt_flush_deferred(void *arg)
+{
+    (void) arg;
+    mqtt_flush();
+}
+
+/* the message is on the board, now it may be acknowledged */
+static void
+mqtt_done(sched_client_t *c, const sched_batch_t *b, void *arg)
+{
+    (void) c;
+    (void) arg;
+
+    if (!b->tag || (uint32_t) (b->tag >> 32) != mq.gen)
+        return;
+    mqtt_send_id((uint8_t) (b->tag >> 16), (uint16_t) b->tag);
+    /* all acks of this frame in one write */
+    evloop_defer(mqtt_flush_deferred, NULL);
+}
+
+static int
+parse_on_off(const char *s)
+{
+    if (!strcmp(s, "1") || !strcasecmp(s, "on") || !strcasecmp(s, "true"))
+        return 1;
+    if (!strcmp(s, "0") || !strcasecmp(s, "off") || !strcasecmp(s, "false"))
+        return 0;
+    return -1;
+}
+
+/* returns 0 when the topic and payload made sense */
+static int
+mqtt_apply(const char *topic, const char *payload)
+{
+    size_t pl = strlen(mq.prefix);
+    int k, n, end = 0;
+
+    if (strncmp(topic, mq.prefix, pl) || topic[pl] != '/')
+        return -1;
+    topic += pl + 1;
+
+    if (sscanf(topic, "board%d/relay%d/set%n", &k, &n, &end) == 2 && !topic[end]) {
+        int v = parse_on_off(payload);
+        if (k < 0 || k >= mq.nboards || n < FIRST_RELAY_NO || n > LAST_RELAY_NO || v < 0)
+            return -1;
+        uint32_t bit = 1u << (n - 1);
+        return sched_add(mq.sc, k, v ? bit : 0, v ? 0 : bit);
+    } else if (sscanf(topic, "board%d/relay%d/lease%n", &k, &n, &end) == 2 && !topic[end]) {
+        char *e;
+        unsigned long ms = strtoul(payload, &e, 10);
+        if (k < 0 || k >= mq.nboards || n < FIRST_RELAY_NO || n > LAST_RELAY_NO
+                || e == payload || *e || ms > UINT32_MAX)
+            return -1;
+        uint32_t bit = 1u << (n - 1);
+        if (!ms) {
+            lease_end(k, n);
+            return sched_add(mq.sc, k, 0, bit);
+        }
+        int r = lease_renew(k, n, ms);
+        /* a renewal is an empty batch, only acknowledged */
+        return r > 0 ? sched_add(mq.sc, k, bit, 0) : r;
+    } else if (sscanf(topic, "board%d/mask/set%n", &k, &end) == 1 && end && !topic[end]) {
+        char *e;
+        unsigned long m = strtoul(payload, &e, 0);
+        /* bits above the last relay would stay in active_relays, never written */
+        if (k < 0 || k >= mq.nboards || e == payload || *e || m > RELAY_MASK_ALL)
+            return -1;
+        return sched_add(mq.sc, k, (uint32_t) m, ~(uint32_t) m);
+    }
+    return -1;
+}
+
+static void
+mqtt_on_publish(uint8_t flags, const uint8_t *p, size_t len)
+{
+    int qos = (flags >> 1) & 3;
+    char topic[MQTT_TOPIC_MAX];
+    char payload[32];
+    uint16_t id = 0;
+
+    if (len < 2)
+        return;
+    size_t tl = (p[0] << 8) | p[1];
+    size_t off = 2 + tl + (qos ? 2 : 0);
+    if (off > len)
+        return;
+    if (qos)
+        id = (p[2 + tl] << 8) | p[3 + tl];
+
+    if (qos == 2 && (mq.qos2[id >> 3] & (1 << (id & 7)))) {
+        /*
+         * resent before our PUBREC arrived, already applied, acked again
+         * after the frame (after a reconnect the first ack was not sent)
+         */
+        if (sched_submit(mq.sc, MQTT_TAG(mq.gen, MQTT_PUBREC, id)) != 0)
+            mqtt_send_id(MQTT_PUBREC, id);
+        return;
+    }
+
+    size_t n = len - off;
+    if (tl >= sizeof (topic) || n >= sizeof (payload)) {
+        /* acked all the same, the broker would only send it again */
+        if (mq.too_long++ % 100 == 0)
+            lwsl_warn("mqtt: ignored %.*s, %s too long (%lu since the last report)\n",
+                      tl < sizeof (topic) ? (int) tl : 64, p + 2,
+                      tl >= sizeof (topic) ? "topic" : "payload", mq.too_long);
+    } else {
+        memcpy(topic, p + 2, tl);
+        topic[tl] = '\0';
+        memcpy(payload, p + off, n);
+        payload[n] = '\0';
+        /* trailing white space from shell tools */
+        while (n && (payload[n - 1] == '\n' || payload[n - 1] == ' ' || payload[n - 1] == '\r'))
+            payload[--n] = '\0';
+        if (mqtt_apply(topic, payload) != 0)
+            lwsl_warn("mqtt: ignored %.*s = %s\n", (int) tl, p + 2, payload);
+    }
+
+    /* also when ignored, the ack has to wait for the ones before it */
+    uint64_t tag = 0;
+    if (qos == 1)
+        tag = MQTT_TAG(mq.gen, MQTT_PUBACK, id);
+    else if (qos == 2) {
+        mq.qos2[id >> 3] |= 1 << (id & 7);
+        tag = MQTT_TAG(mq.gen, MQTT_PUBREC, id);
+    }
+    if (sched_submit(mq.sc, tag) != 0 && tag)
+        mqtt_send_id((uint8_t) (tag >> 16), id); /* no memory, ack it anyway */
+}
+
+static void
+mqtt_on_connack(const uint8_t *p, size_t len)
+{
+    char topic[MQTT_TOPIC_MAX];
+
+    if (len < 2 || p[1] != 0) {
+        lwsl_err("mqtt: broker refused the connection (code %d)\n", len < 2 ? -1 : p[1]);
+        mqtt_lost("refused");
+        return;
+    }
+    mq.up = 1;
+    lwsl_notice("mqtt: connected to %s:%s as %s%s\n", mq.host, mq.port, mq.client_id,
+                (p[0] & 1) ? ", session resumed" : "");
+    /* a new session, the broker forgot the QoS 2 messages in flight too */
+    if (!(p[0] & 1))
+        memset(mq.qos2, 0, sizeof (mq.qos2));
+    mqtt_send_subscribe();
+
+    snprintf(topic, sizeof (topic), "%s/status", mq.prefix);
+    mqtt_publish(topic, "online", 1);
+    for (int k = 0; k < mq.nboards; k++) {
+        mq.have_published[k] = 0;
+        mq.to_publish[k] = 1;
+    }
+    mqtt_publish_states(NULL);
+    mq.ping_timer = evloop_timer_add(MQTT_KEEPALIVE_S * 1000 / 2, 1, mqtt_ping, NULL);
+}
+
+/* one complete packet */
+static void
+mqtt_packet(uint8_t h, const uint8_t *p, size_t len)
+{
+    switch (h & 0xf0) {
+    case MQTT_CONNACK:
+        mqtt_on_connack(p, len);
+        break;
+    case MQTT_PUBLISH:
+        if (mq.up)
+            mqtt_on_publish(h & 0x0f, p, len);
+        break;
+    case MQTT_PUBREL:
+        if (len >= 2) {
+            uint16_t id = (p[0] << 8) | p[1];
+            mq.qos2[id >> 3] &= ~(1 << (id & 7));
+            mqtt_send_id(MQTT_PUBCOMP, id);
+        }
+        break;
+    case MQTT_SUBACK:
+        if (len >= 3 && p[2] == 0x80)
+            lwsl_err("mqtt: broker refused the subscription\n");
+        break;
+    case MQTT_PINGRESP:
+        mq.ping_outstanding = 0;
+        break;
+    default:
+        /* PUBACK etc, we only publish QoS 0 */
+        break;
+    }
+}
+
+static void
+mqtt_fd_cb(int fd, short revents, void *arg)
+{
+    (void) arg;
+
+    if (mq.connecting) {
+        int err = 0;
+        socklen_t len = sizeof (err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            mqtt_lost(strerror(err));
+            return;
+        }
+        mq.connecting = 0;
+        mq.ping_outstanding = 0;
+        mqtt_send_connect();
+        mqtt_flush();
+        return;
+    }
+
+    if (revents & POLLIN) {
+        if (net_buf_recv(fd, &mq.in) < 0) {
+            mqtt_lost("closed by broker");
+            return;
+        }
+        size_t i = 0;
+        while (mq.fd >= 0 && mq.in.len - i >= 2) {
+            /* remaining length, 1 to 4 bytes of 7 bits */
+            size_t rl = 0, n = 1;
+            int shift = 0, done = 0;
+            while (i + n < mq.in.len && n <= 4) {
+                uint8_t b = mq.in.data[i + n++];
+                rl |= (size_t) (b & 0x7f) << shift;
+                shift += 7;
+                if (!(b & 0x80)) {
+                    done = 1;
+                    break;
+                }
+            }
+            if (!done && n > 4) {
+                mqtt_lost("bad packet");
+                return;
+            }
+            if (rl > MQTT_MAX_PACKET) {
+                mqtt_lost("packet too large");
+                return;
+            }
+            if (!done || i + n + rl > mq.in.len)
+                break;
+            mqtt_packet(mq.in.data[i], mq.in.data + i + n, rl);
+            i += n + rl;
+        }
+        if (mq.fd < 0)
+            return;
+        net_buf_consume(&mq.in, i);
+    } else if (revents & (POLLERR | POLLHUP)) {
+        mqtt_lost("socket error");
+        return;
+    }
+
+    if (net_buf_send(fd, &mq.out) < 0) {
+        mqtt_lost(strerror(errno));
+        return;
+    }
+    evloop_modify(fd, POLLIN | (mq.out.len ? POLLOUT : 0));
+}
+
+static void
+mqtt_connect(void *arg)
+{
+    (void) arg;
+
+    mq.retry_timer = 0;
+    mq.fd = net_connect(mq.host, mq.port);
+    if (mq.fd < 0) {
+        mq.retry_timer = evloop_timer_add(MQTT_RETRY_MS, 0, mqtt_connect, NULL);
+        return;
+    }
+    mq.connecting = 1;
+    evloop_add(mq.fd, POLLOUT, mqtt_fd_cb, NULL);
+}
+
+int
+mqtt_start(ios_handle_t **boards, int nboards, const char *broker, const char *prefix)
+{
+    char id[MQTT_TOPIC_MAX];
+
+    assert(boards && nboards > 0);
+
+    if (net_split_host_port(broker, &mq.host, &mq.port) != 0 || !mq.host) {
+        lwsl_err("mqtt broker must be host:port, not %s\n", broker);
+        return -1;
+    }
+    if (strlen(prefix) > MQTT_TOPIC_MAX - 32 || strpbrk(prefix, "+#")) {
+        lwsl_err("mqtt topic prefix too long or with wildcards : %s\n", prefix);
+        return -1;
+    }
+    mq.prefix = strdup(prefix);
+    /* the same id every time, so the broker keeps our session */
+    snprintf(id, sizeof (id), "switch_relay/%s", prefix);
+    mq.client_id = strdup(id);
+
+    mq.boards = boards;
+    mq.nboards = nboards;
+    snprintf(id, sizeof (id), "mqtt %s:%s", mq.host, mq.port);
+    mq.sc = sched_client_new("mqtt", id, mqtt_done, NULL);
+    if (!mq.sc)
+        return -1;
+    mq.published = calloc(nboards, sizeof (*mq.published));
+    mq.have_published = calloc(nboards, 1);
+    mq.to_publish = calloc(nboards, 1);
+
+    for (int k = 0; k < nboards; k++)
+        ios_add_listener(boards[k], mqtt_listener, NULL);
+
+    mqtt_connect(NULL);
+    return 0;
+}
+
+void
+mqtt_report(void)
+{
+    if (!mq.too_long)
+        return;
+    lwsl_notice("mqtt: %lu message(s) ignored, topic or payload too long\n", mq.too_long);
+    mq.too_long = 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * File:   mqtt.h
+ * Author: oetelaar
+ *
+ * MQTT 3.1.1 client in the daemon event loop, no library.
+ *
+ * Subscribes to (k = board number, n = relay number)
+ *   <prefix>/board<k>/relay<n>/set   1 0 on off true false
+ *   <prefix>/board<k>/relay<n>/lease ms, on until then unless sent again (lease.h), 0 = off now
+ *   <prefix>/board<k>/mask/set       the whole mask, 0x05 or 5
+ * and publishes, retained, what the board confirmed (outputbits)
+ *   <prefix>/board<k>/relay<n>       1 or 0
+ *   <prefix>/board<k>/mask           0x05
+ *   <prefix>/status                  online, or offline (last will)
+ *
+ * Every message is a batch for the frame scheduler (sched.h), the ones
+ * that come in together go into one frame and every board they touched
+ * is written once. QoS 1 and 2 messages are acknowledged (PUBACK, PUBREC)
+ * only after that write, so a daemon that dies before the write gets them
+ * again from the broker (persistent session). QoS 0 messages are simply
+ * merged, the latest wins. Payloads of 32 bytes or more are ignored
+ * (logged, counted in the report) but acknowledged.
+ */
+
+#ifndef MQTT_H
+#define	MQTT_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define MQTT_KEEPALIVE_S 30
+#define MQTT_RETRY_MS 2000
+#define MQTT_MAX_PACKET (64 * 1024)
+
+    /* connect to broker host:port, topics below prefix, returns 0 or -1 */
+    int mqtt_start(ios_handle_t **boards, int nboards, const char *broker, const char *prefix);
+    /* messages that were ignored, then start over */
+    void mqtt_report(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MQTT_H */
@@ -0,0 +1,209 @@
+/*
+ * File:   net.c
+ * Author: oetelaar
+ *
+ * TCP helpers, see net.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "net.h"
+#include "logging.h"
+
+/* read at least this much at a time */
+#define NET_RECV_CHUNK 4096
+
+int
+net_split_host_port(const char *s, char **host, char **port)
+{
+    const char *colon = strrchr(s, ':');
+
+    if (colon) {
+        *host = strndup(s, colon - s);
+        *port = strdup(colon + 1);
+    } else {
+        *host = NULL;
+        *port = strdup(s);
+    }
+    return (*port && **port) ? 0 : -1;
+}
+
+void
+net_setup(int fd)
+{
+    int one = 1;
+    /* records are tiny and latency is what we care about */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void
+net_peer_name(int fd, char *buf, size_t len)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof (sa);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    if (getpeername(fd, (struct sockaddr *) &sa, &salen) != 0 ||
+        getnameinfo((struct sockaddr *) &sa, salen, host, sizeof (host), port, sizeof (port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        snprintf(buf, len, "fd %d", fd);
+    else
+        snprintf(buf, len, "%s:%s", host, port);
+}
+
+int
+net_listen(const char *listen_on, int backlog)
+{
+    struct addrinfo hints, *res = NULL;
+    char *host = NULL, *port = NULL;
+    int one = 1;
+
+    if (net_split_host_port(listen_on, &host, &port) != 0) {
+        lwsl_err("listen address must be [addr:]port, not %s\n", listen_on);
+        free(host);
+        free(port);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int r = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    free(port);
+    if (r != 0) {
+        lwsl_err("listen address %s : %s\n", listen_on, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, backlog) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        lwsl_err("can not listen on %s : %s\n", listen_on, strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int
+net_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *res = NULL;
+
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int r = getaddrinfo(host ? host : "localhost", port, &hints, &res);
+    if (r != 0) {
+        lwsl_err("%s:%s : %s\n", host, port, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) {
+        net_setup(fd);
+        if (connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+uint8_t *
+net_buf_reserve(net_buf_t *b, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n)
+            cap *= 2;
+        if (cap > NET_BUF_MAX)
+            return NULL;
+        uint8_t *p = realloc(b->data, cap);
+        if (!p)
+            return NULL;
+        b->data = p;
+        b->cap = cap;
+    }
+    return b->data + b->len;
+}
+
+int
+net_buf_append(net_buf_t *b, const void *p, size_t n)
+{
+    uint8_t *dst = net_buf_reserve(b, n);
+
+    if (!dst)
+        return -1;
+    memcpy(dst, p, n);
+    b->len += n;
+    return 0;
+}
+
+void
+net_buf_consume(net_buf_t *b, size_t n)
+{
+    if (n >= b->len) {
+        b->len = 0;
+        return;
+    }
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+void
+net_buf_free(net_buf_t *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof (*b));
+}
+
+ssize_t
+net_buf_send(int fd, net_buf_t *b)
+{
+    if (b->len == 0)
+        return 0;
+
+    ssize_t n = send(fd, b->data, b->len, MSG_NOSIGNAL);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    net_buf_consume(b, n);
+    return n;
+}
+
+ssize_t
+net_buf_recv(int fd, net_buf_t *b)
+{
+    uint8_t *p = net_buf_reserve(b, NET_RECV_CHUNK);
+
+    if (!p)
+        return -1;
+    ssize_t n = recv(fd, p, NET_RECV_CHUNK, 0);
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    b->len += n;
+    return n;
+}
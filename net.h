@@ -0,0 +1,59 @@
+/*
+ * File:   net.h
+ * Author: oetelaar
+ *
+ * TCP helpers for the modules that talk to other programs
+ * (replication, control connections, the gateway) :
+ * address parsing, listening and connecting sockets, and
+ * growing byte buffers for non blocking connections.
+ */
+
+#ifndef NET_H
+#define	NET_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+    /* a connection that does not read what we send is dropped at this size */
+#define NET_BUF_MAX (1024 * 1024)
+
+    typedef struct net_buf
+    {
+        uint8_t *data;
+        size_t len;
+        size_t cap;
+    } net_buf_t;
+
+    /* split [host:]port, *host is NULL when not given, returns 0 or -1 */
+    int net_split_host_port(const char *s, char **host, char **port);
+    /* no Nagle, non blocking */
+    void net_setup(int fd);
+    /* "addr:port" of the other side, for the logs */
+    void net_peer_name(int fd, char *buf, size_t len);
+    /* listening socket on [addr:]port, returns the fd or -1 (logged) */
+    int net_listen(const char *listen_on, int backlog);
+    /* start a non blocking connect, wait for POLLOUT and check SO_ERROR, returns the fd or -1 */
+    int net_connect(const char *host, const char *port);
+
+    /* room for n more bytes, returns where they go or NULL past NET_BUF_MAX */
+    uint8_t *net_buf_reserve(net_buf_t *b, size_t n);
+    /* append n bytes, returns 0 or -1 past NET_BUF_MAX */
+    int net_buf_append(net_buf_t *b, const void *p, size_t n);
+    /* drop n bytes from the front */
+    void net_buf_consume(net_buf_t *b, size_t n);
+    void net_buf_free(net_buf_t *b);
+    /* write what the socket takes, returns bytes written or -1 on a dead connection */
+    ssize_t net_buf_send(int fd, net_buf_t *b);
+    /* read what is there, returns bytes read, 0 when nothing, -1 on EOF or error */
+    ssize_t net_buf_recv(int fd, net_buf_t *b);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NET_H */
@@ -0,0 +1,451 @@
+/* 
+ * File:   relayfs.c
+ * Author: oetelaar
+ *
+ * Relays as files, using the libfuse3 low level API.
+ * The fuse fd is served from the daemon event loop, so a write() from
+ * a shell goes straight into USB_write_IO() without inotify or temp
+ * files in between, and the result goes back to the writer.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include "relayfs.h"
+#include "ch341a.h"
+#include "evloop.h"
+#include "lag.h"
+#include "logging.h"
+
+/* inode numbers, the tree is fixed so no lookup tables : a range per board */
+#define INO_ROOT FUSE_ROOT_ID
+#define INO_BOARDS 2
+#define INO_PER_BOARD 64
+#define INO_BOARD(k) (INO_BOARDS + (fuse_ino_t) (k) * INO_PER_BOARD)
+#define INO_RELAY(k, n) (INO_BOARD(k) + (n))
+
+static struct fuse_session *se = NULL;
+static struct fuse_buf fbuf; /* receive buffer, libfuse allocates the memory */
+static time_t mount_time;
+static ios_handle_t **boards;
+static int nboards;
+
+/* per open file, the last error of its writes for flush (close) */
+typedef struct relayfs_file
+{
+    int err;
+} relayfs_file_t;
+
+/* board of a board directory or relay file inode, -1 for anything else */
+static int
+board_of_ino(fuse_ino_t ino)
+{
+    if (ino < INO_BOARDS || ino >= INO_BOARD(nboards))
+        return -1;
+    return (int) ((ino - INO_BOARDS) / INO_PER_BOARD);
+}
+
+static int
+is_board_dir(fuse_ino_t ino)
+{
+    return board_of_ino(ino) >= 0 && (ino - INO_BOARDS) % INO_PER_BOARD == 0;
+}
+
+/* relay number for an inode, -1 when it is not a relay file */
+static int
+relay_of_ino(fuse_ino_t ino)
+{
+    if (board_of_ino(ino) < 0)
+        return -1;
+    int n = (int) ((ino - INO_BOARDS) % INO_PER_BOARD);
+    return n >= FIRST_RELAY_NO && n <= LAST_RELAY_NO ? n : -1;
+}
+
+static int
+relayfs_stat(fuse_ino_t ino, struct stat *st)
+{
+    memset(st, 0, sizeof (*st));
+    st->st_ino = ino;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = st->st_ctime = st->st_atime = mount_time;
+
+    if (ino == INO_ROOT || is_board_dir(ino)) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else if (relay_of_ino(ino) > 0) {
+        st->st_mode = S_IFREG | 0664;
+        st->st_nlink = 1;
+        st->st_size = 2; /* "0\n" or "1\n" */
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* 
+ * "1", "on" -> 1, "0", "off" -> 0, "pulse <us>" -> 2 with *us set,
+ * anything else -1
+ * leading and trailing white space (echo adds a newline) is fine
+ */
+static int
+parse_value(const char *buf, size_t size, unsigned *us)
+{
+    char word[8];
+    size_t i = 0, n = 0;
+
+    while (i < size && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\n'))
+        i++;
+    while (i < size && n < sizeof (word) - 1 && buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\n')
+        word[n++] = buf[i++];
+    word[n] = '\0';
+
+    if (!strcmp(word, "1") || !strcmp(word, "on"))
+        return 1;
+    if (!strcmp(word, "0") || !strcmp(word, "off"))
+        return 0;
+    if (!strcmp(word, "pulse")) {
+        char num[8];
+        n = 0;
+        while (i < size && (buf[i] == ' ' || buf[i] == '\t'))
+            i++;
+        while (i < size && n < sizeof (num) - 1 && buf[i] >= '0' && buf[i] <= '9')
+            num[n++] = buf[i++];
+        num[n] = '\0';
+        if (n == 0)
+            return -1;
+        *us = (unsigned) strtoul(num, NULL, 10);
+        return 2;
+    }
+    return -1;
+}
+
+/* push the requested state to the board, returns 0 or an errno value */
+static int
+relayfs_apply(ios_handle_t *h)
+{
+    if (NULL == h->device_handle) {
+        /* keep the request, it goes out when the board is back */
+        h->output_pending = 1;
+        return ENODEV;
+    }
+    if (USB_write_IO(h) != 0)
+        return EIO;
+    return 0;
+}
+
+static void
+relayfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    fuse_ino_t ino = 0;
+
+    memset(&e, 0, sizeof (e));
+
+    if (parent == INO_ROOT && !strncmp(name, "board", 5)) {
+        char *end = NULL;
+        long k = strtol(name + 5, &end, 10);
+        if (end != name + 5 && *end == '\0' && k >= 0 && k < nboards)
+            ino = INO_BOARD(k);
+    } else if (is_board_dir(parent)) {
+        char *end = NULL;
+        long relay = strtol(name, &end, 10);
+        if (end != name && *end == '\0' && relay >= FIRST_RELAY_NO && relay <= LAST_RELAY_NO)
+            ino = INO_RELAY(board_of_ino(parent), relay);
+    }
+
+    if (!ino) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    e.ino = ino;
+    e.attr_timeout = 1.0;
+    e.entry_timeout = 1.0;
+    relayfs_stat(ino, &e.attr);
+    fuse_reply_entry(req, &e);
+}
+
+static void
+relayfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat st;
+    (void) fi;
+
+    if (relayfs_stat(ino, &st) != 0)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &st, 1.0);
+}
+
+/* only here so "echo 1 > file" (O_TRUNC) works, the size never changes */
+static void
+relayfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                struct fuse_file_info *fi)
+{
+    (void) attr;
+    (void) to_set;
+    relayfs_getattr(req, ino, fi);
+}
+
+static void
+relayfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (relay_of_ino(ino) < 0) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    relayfs_file_t *f = calloc(1, sizeof (*f));
+    if (!f) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    /* no page cache, every read asks the daemon */
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) f;
+    if (fuse_reply_open(req, fi) != 0)
+        free(f); /* interrupted, no release will come */
+}
+
+/* the last close of the open file */
+static void
+relayfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    free((relayfs_file_t *) (uintptr_t) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void
+relayfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+             struct fuse_file_info *fi)
+{
+    ios_handle_t *h = boards[board_of_ino(ino)];
+    int relay = relay_of_ino(ino);
+    char buf[2];
+    (void) fi;
+
+    /* the confirmed state, not what was asked for */
+    buf[0] = (h->outputbits & (1u << (relay - 1))) ? '1' : '0';
+    buf[1] = '\n';
+
+    if (off >= (off_t) sizeof (buf)) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    size_t n = sizeof (buf) - off;
+    fuse_reply_buf(req, buf + off, n < size ? n : size);
+}
+
+static void
+relayfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+              off_t off, struct fuse_file_info *fi)
+{
+    ios_handle_t *h = boards[board_of_ino(ino)];
+    relayfs_file_t *f = (relayfs_file_t *) (uintptr_t) fi->fh;
+    int relay = relay_of_ino(ino);
+    unsigned us = 0;
+    int value = parse_value(buf, size, &us);
+    (void) off;
+
+    if (value < 0) {
+        f->err = EINVAL;
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    if (value == 2) {
+        /* the state stays as it is, the pulse goes out now or not at all */
+        int err = 0;
+        if (NULL == h->device_handle)
+            err = ENODEV;
+        else if (USB_pulse_IO(h, 1u << (relay - 1), us) != 0)
+            err = (h->device_brand != ABACOM || us > CH341A_PULSE_MAX_US) ? EINVAL : EIO;
+        lwsl_info("relayfs: board %d pulse pin=%d %u us\n", h->board_index, relay, us);
+        if (err) {
+            f->err = err;
+            fuse_reply_err(req, err);
+        } else {
+            fuse_reply_write(req, size);
+        }
+        return;
+    }
+
+    if (value)
+        h->active_relays |= 1u << (relay - 1);
+    else
+        h->active_relays &= ~(1u << (relay - 1));
+
+    lwsl_info("relayfs: board %d set pin=%d %s\n", h->board_index, relay, value ? "HIGH" : "LOW");
+
+    int err = relayfs_apply(h);
+    if (err) {
+        f->err = err;
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_write(req, size);
+    }
+}
+
+/* close() ends up here, report what went wrong with the writes */
+static void
+relayfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    relayfs_file_t *f = (relayfs_file_t *) (uintptr_t) fi->fh;
+    (void) ino;
+
+    /* a dup'ed fd closes without the error again */
+    int err = f->err;
+    f->err = 0;
+    fuse_reply_err(req, err);
+}
+
+static void
+relayfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (ino != INO_ROOT && !is_board_dir(ino))
+        fuse_reply_err(req, ENOTDIR);
+    else
+        fuse_reply_open(req, fi);
+}
+
+static void
+dirbuf_add(fuse_req_t req, char **p, size_t *size, const char *name, fuse_ino_t ino)
+{
+    struct stat st;
+    size_t oldsize = *size;
+
+    memset(&st, 0, sizeof (st));
+    st.st_ino = ino;
+    *size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    char *newp = realloc(*p, *size);
+    if (!newp) {
+        *size = oldsize;
+        return;
+    }
+    *p = newp;
+    fuse_add_direntry(req, *p + oldsize, *size - oldsize, name, &st, *size);
+}
+
+static void
+relayfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info *fi)
+{
+    char *p = NULL;
+    size_t len = 0;
+    char name[16];
+    (void) fi;
+
+    dirbuf_add(req, &p, &len, ".", ino);
+    dirbuf_add(req, &p, &len, "..", INO_ROOT);
+    if (ino == INO_ROOT) {
+        for (int k = 0; k < nboards; k++) {
+            snprintf(name, sizeof (name), "board%d", k);
+            dirbuf_add(req, &p, &len, name, INO_BOARD(k));
+        }
+    } else {
+        for (int i = FIRST_RELAY_NO; i <= LAST_RELAY_NO; i++) {
+            snprintf(name, sizeof (name), "%d", i);
+            dirbuf_add(req, &p, &len, name, INO_RELAY(board_of_ino(ino), i));
+        }
+    }
+
+    if (off < (off_t) len) {
+        size_t n = len - off;
+        fuse_reply_buf(req, p + off, n < size ? n : size);
+    } else {
+        fuse_reply_buf(req, NULL, 0);
+    }
+    free(p);
+}
+
+static const struct fuse_lowlevel_ops relayfs_ops = {
+    .lookup = relayfs_lookup,
+    .getattr = relayfs_getattr,
+    .setattr = relayfs_setattr,
+    .open = relayfs_open,
+    .read = relayfs_read,
+    .write = relayfs_write,
+    .flush = relayfs_flush,
+    .release = relayfs_release,
+    .opendir = relayfs_opendir,
+    .readdir = relayfs_readdir,
+};
+
+/* called by the event loop when the kernel has a request for us */
+static void
+relayfs_fd_cb(int fd, short revents, void *arg)
+{
+    (void) fd;
+    (void) arg;
+
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        lwsl_err("relay filesystem fd error, unmounting\n");
+        relayfs_stop();
+        return;
+    }
+
+    int res = fuse_session_receive_buf(se, &fbuf);
+    if (res == -EINTR || res == -EAGAIN)
+        return;
+    if (res <= 0 || fuse_session_exited(se)) {
+        lwsl_notice("relay filesystem unmounted (%d)\n", res);
+        relayfs_stop();
+        return;
+    }
+    fuse_session_process_buf(se, &fbuf);
+}
+
+int
+relayfs_start(ios_handle_t **b, int n, const char *mountpoint)
+{
+    char *argv[] = {"switch_relay", NULL};
+    struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+
+    assert(b && n > 0);
+    if (se)
+        return -1;
+
+    boards = b;
+    nboards = n;
+    mount_time = time(NULL);
+    se = fuse_session_new(&args, &relayfs_ops, sizeof (relayfs_ops), NULL);
+    if (!se)
+        return -1;
+
+    if (fuse_session_mount(se, mountpoint) != 0) {
+        fuse_session_destroy(se);
+        se = NULL;
+        return -1;
+    }
+
+    if (evloop_add(fuse_session_fd(se), POLLIN, relayfs_fd_cb, NULL) != 0) {
+        relayfs_stop();
+        return -1;
+    }
+    evloop_set_kind(fuse_session_fd(se), LAG_FUSE);
+
+    lwsl_notice("relay filesystem mounted on %s, %d board(s)\n", mountpoint, n);
+    return 0;
+}
+
+void
+relayfs_stop(void)
+{
+    if (!se)
+        return;
+
+    evloop_del(fuse_session_fd(se));
+    fuse_session_unmount(se);
+    fuse_session_destroy(se);
+    se = NULL;
+
+    free(fbuf.mem);
+    memset(&fbuf, 0, sizeof (fbuf));
+}
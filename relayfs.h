@@ -0,0 +1,29 @@
+/* 
+ * File:   relayfs.h
+ * Author: oetelaar
+ *
+ * Optional FUSE filesystem with one file per relay, build with WITH_FUSE=1
+ *   <mount_dir>/board0/1 .. <mount_dir>/board0/8, board1 .. with -n
+ * write "1" or "0" (or "on"/"off") to switch, read gives the confirmed state
+ * a failed write to the board comes back as errno from write() and close()
+ */
+
+#ifndef RELAYFS_H
+#define	RELAYFS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+    /* a directory per board, mount on mountpoint and add the fuse fd to the event loop, returns 0 or -1 */
+    int relayfs_start(ios_handle_t **boards, int nboards, const char *mountpoint);
+    /* unmount, safe to call when not mounted */
+    void relayfs_stop(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RELAYFS_H */
@@ -0,0 +1,542 @@
+/* 
+ * File:   repl.c
+ * Author: oetelaar
+ *
+ * Replication of the relay state from a primary to a standby daemon.
+ *
+ * The wire format is a stream of fixed 16 byte records, network order :
+ *   type (1) board (1) pad (2) mask (4) generation (8)
+ * primary -> standby : 'S' state, also sent as heartbeat
+ * standby -> primary : 'A' ack, highest generation it has of the board
+ * standby -> primary : 'R' refused, another primary is connected, then close
+ * Boards above 255 use the pad bytes too, (board >> 8) in the first.
+ *
+ * The state is the complete mask, so an update that has not gone out yet
+ * is simply overwritten by the next one (batching). The primary does not
+ * wait for acks before sending (pipelining), it only holds back once a
+ * board has REPL_WINDOW generations unacknowledged. The heartbeat goes
+ * out regardless, a standby that is behind must not take it for dead.
+ *
+ * A standby that took over hands the boards back when a primary connects
+ * again : it switches its own outputs off (the relays are wired in
+ * parallel, the primary has to be able to switch them off) and stands by.
+ */
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "repl.h"
+#include "evloop.h"
+#include "net.h"
+#include "logging.h"
+
+#define REPL_STATE 'S'
+#define REPL_ACK 'A'
+#define REPL_REFUSED 'R'
+#define REPL_RECORD_LEN 16
+#define REPL_IN_LEN (REPL_RECORD_LEN * 64)
+#define REPL_RETRY_MS 1000
+
+typedef struct
+{
+    int fd; /* -1 when not connected */
+    uint8_t *out; /* room for two records per board and one more */
+    size_t outlen;
+    size_t outcap;
+    uint8_t in[REPL_IN_LEN];
+    size_t inlen;
+} repl_conn_t;
+
+/* per board on the primary */
+typedef struct
+{
+    long state_at; /* offset of a state record not yet written, -1 none */
+    uint64_t sent_gen;
+    uint64_t acked_gen;
+} repl_board_t;
+
+/* primary side */
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    repl_board_t *b;
+    int behind; /* boards with a full window */
+    char *host;
+    char *port;
+    repl_conn_t c;
+    int connecting; /* non blocking connect() in progress */
+    int retry_timer;
+} prim = {.c.fd = -1};
+
+/* standby side */
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    int lfd; /* listening socket */
+    repl_conn_t c;
+    uint64_t *gen; /* latest generation received per board */
+    int *got; /* boards to ack after this read, and a mark per board */
+    uint8_t *got_mark;
+    uint64_t started; /* evloop_now_ms() at start */
+    uint64_t last_rx; /* evloop_now_ms() of the last record */
+    int seen_primary;
+} stby = {.lfd = -1, .c.fd = -1};
+
+static void
+put_record(uint8_t *p, uint8_t type, int board, uint32_t mask, uint64_t gen)
+{
+    uint32_t m = htonl(mask);
+    uint64_t g = htobe64(gen);
+
+    memset(p, 0, REPL_RECORD_LEN);
+    p[0] = type;
+    p[1] = (uint8_t) board;
+    p[2] = (uint8_t) (board >> 8);
+    memcpy(p + 4, &m, 4);
+    memcpy(p + 8, &g, 8);
+}
+
+static void
+get_record(const uint8_t *p, uint8_t *type, int *board, uint32_t *mask, uint64_t *gen)
+{
+    uint32_t m;
+    uint64_t g;
+
+    memcpy(&m, p + 4, 4);
+    memcpy(&g, p + 8, 8);
+    *type = p[0];
+    *board = p[1] | (p[2] << 8);
+    *mask = ntohl(m);
+    *gen = be64toh(g);
+}
+
+static int
+conn_init(repl_conn_t *c, int nboards)
+{
+    c->outcap = REPL_RECORD_LEN * (2 * (size_t) nboards + 1);
+    c->out = malloc(c->outcap);
+    return c->out ? 0 : -1;
+}
+
+static void
+conn_close(repl_conn_t *c)
+{
+    if (c->fd < 0)
+        return;
+    evloop_del(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    c->inlen = 0;
+    c->outlen = 0;
+}
+
+/* write what we can, returns bytes written or -1 on a dead connection */
+static ssize_t
+conn_flush(repl_conn_t *c)
+{
+    ssize_t n = 0;
+
+    if (c->outlen) {
+        n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+            n = 0;
+        }
+        memmove(c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+    evloop_modify(c->fd, POLLIN | (c->outlen ? POLLOUT : 0));
+    return n;
+}
+
+/* read what is there, returns -1 on EOF or error */
+static int
+conn_fill(repl_conn_t *c)
+{
+    ssize_t n = recv(c->fd, c->in + c->inlen, sizeof (c->in) - c->inlen, 0);
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->inlen += n;
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* primary */
+
+static void prim_connect(void *arg);
+
+static int
+prim_is_behind(const repl_board_t *b)
+{
+    return b->sent_gen - b->acked_gen > REPL_WINDOW;
+}
+
+static void
+prim_lost(const char *why)
+{
+    lwsl_warn("replication to %s:%s lost (%s), retry in %d ms\n",
+              prim.host, prim.port, why, REPL_RETRY_MS);
+    conn_close(&prim.c);
+    prim.connecting = 0;
+    for (int k = 0; k < prim.nboards; k++)
+        prim.b[k].state_at = -1;
+    evloop_timer_del(prim.retry_timer);
+    prim.retry_timer = evloop_timer_add(REPL_RETRY_MS, 0, prim_connect, NULL);
+}
+
+/* queue the current state of board k, merging with a record that has not gone out yet */
+static void
+prim_queue_state(int k)
+{
+    ios_handle_t *h = prim.boards[k];
+    repl_board_t *b = &prim.b[k];
+
+    if (prim.c.fd < 0 || prim.connecting)
+        return;
+
+    if (b->state_at < 0) {
+        /* at most one record per board on the wire and one waiting, so there is room */
+        assert(prim.c.outlen + REPL_RECORD_LEN <= prim.c.outcap);
+        b->state_at = prim.c.outlen;
+        prim.c.outlen += REPL_RECORD_LEN;
+    }
+    put_record(prim.c.out + b->state_at, REPL_STATE, k, h->active_relays, h->generation);
+    int was_behind = prim_is_behind(b);
+    b->sent_gen = h->generation;
+    prim.behind += prim_is_behind(b) - was_behind;
+}
+
+/* heartbeat : send even with a full window */
+static void
+prim_flush(int heartbeat)
+{
+    /* window full, the standby is behind, keep merging until it acks */
+    if (prim.behind && !heartbeat) {
+        evloop_modify(prim.c.fd, POLLIN);
+        return;
+    }
+
+    ssize_t n = conn_flush(&prim.c);
+    if (n < 0) {
+        prim_lost(strerror(errno));
+        return;
+    }
+    if (n == 0)
+        return;
+    for (int k = 0; k < prim.nboards; k++) {
+        repl_board_t *b = &prim.b[k];
+        if (b->state_at >= 0) {
+            b->state_at -= n;
+            if (b->state_at < 0)
+                b->state_at = -1; /* (part of) it is on the wire now */
+        }
+    }
+}
+
+static void
+prim_fd_cb(int fd, short revents, void *arg)
+{
+    (void) arg;
+
+    if (prim.connecting) {
+        int err = 0;
+        socklen_t len = sizeof (err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            prim_lost(strerror(err));
+            return;
+        }
+        prim.connecting = 0;
+        lwsl_notice("replicating to standby %s:%s\n", prim.host, prim.port);
+        /* the window counts from here, the standby gets every board */
+        prim.behind = 0;
+        for (int k = 0; k < prim.nboards; k++) {
+            prim.b[k].acked_gen = prim.b[k].sent_gen = prim.boards[k]->generation;
+            prim_queue_state(k);
+        }
+        prim_flush(0);
+        return;
+    }
+
+    if (revents & POLLIN) {
+        if (conn_fill(&prim.c) < 0) {
+            prim_lost("closed by standby");
+            return;
+        }
+        size_t i;
+        for (i = 0; i + REPL_RECORD_LEN <= prim.c.inlen; i += REPL_RECORD_LEN) {
+            uint8_t type;
+            int k;
+            uint32_t mask;
+            uint64_t gen;
+            get_record(prim.c.in + i, &type, &k, &mask, &gen);
+            if (type == REPL_REFUSED) {
+                lwsl_err("replication refused by %s:%s, another primary drives its boards, "
+                         "check -r of both daemons\n", prim.host, prim.port);
+                prim_lost("refused");
+                return;
+            }
+            if (type != REPL_ACK || k >= prim.nboards || gen <= prim.b[k].acked_gen)
+                continue;
+            int was_behind = prim_is_behind(&prim.b[k]);
+            prim.b[k].acked_gen = gen;
+            prim.behind -= was_behind - prim_is_behind(&prim.b[k]);
+        }
+        memmove(prim.c.in, prim.c.in + i, prim.c.inlen - i);
+        prim.c.inlen -= i;
+    }
+
+    if (revents & (POLLOUT | POLLIN))
+        prim_flush(0);
+    else if (revents & (POLLERR | POLLHUP))
+        prim_lost("socket error");
+}
+
+static void
+prim_connect(void *arg)
+{
+    (void) arg;
+
+    prim.retry_timer = 0;
+    int fd = net_connect(prim.host, prim.port);
+    if (fd < 0) {
+        prim.retry_timer = evloop_timer_add(REPL_RETRY_MS, 0, prim_connect, NULL);
+        return;
+    }
+
+    prim.c.fd = fd;
+    prim.connecting = 1;
+    evloop_add(fd, POLLOUT, prim_fd_cb, NULL);
+}
+
+/* every USB_write_IO() is a new generation for the standby */
+static void
+prim_listener(ios_handle_t *h, uint32_t old_outputbits, void *arg)
+{
+    (void) old_outputbits;
+    (void) arg;
+
+    prim_queue_state(h->board_index);
+    if (prim.c.fd >= 0 && !prim.connecting)
+        prim_flush(0);
+}
+
+/* send the state again when idle, the standby uses it to see we are alive */
+static void
+prim_heartbeat(void *arg)
+{
+    (void) arg;
+
+    if (prim.c.fd < 0 || prim.connecting)
+        return;
+    if (prim.c.outlen == 0)
+        prim_queue_state(0);
+    prim_flush(1);
+}
+
+int
+repl_primary_start(ios_handle_t **boards, int nboards, const char *peer)
+{
+    assert(boards && nboards > 0);
+
+    if (net_split_host_port(peer, &prim.host, &prim.port) != 0) {
+        lwsl_err("replication peer must be host:port, not %s\n", peer);
+        return -1;
+    }
+    prim.boards = boards;
+    prim.nboards = nboards;
+    prim.b = calloc(nboards, sizeof (*prim.b));
+    if (!prim.b || conn_init(&prim.c, nboards) != 0)
+        return -1;
+    for (int k = 0; k < nboards; k++) {
+        prim.b[k].state_at = -1;
+        ios_add_listener(boards[k], prim_listener, NULL);
+    }
+    evloop_timer_add(REPL_HEARTBEAT_MS, 1, prim_heartbeat, NULL);
+    prim_connect(NULL);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* standby */
+
+/* the primary is gone, drive our own boards with the latest state */
+static void
+stby_promote(const char *why)
+{
+    conn_close(&stby.c);
+    if (!stby.boards[0]->standby)
+        return;
+
+    lwsl_notice("primary lost (%s), taking over at generation %llu mask 0x%02x (board 0)\n",
+                why, (unsigned long long) stby.gen[0], stby.boards[0]->active_relays);
+
+    for (int k = 0; k < stby.nboards; k++) {
+        ios_handle_t *h = stby.boards[k];
+        h->standby = 0;
+        if (h->device_handle)
+            USB_write_IO(h);
+        else
+            h->output_pending = 1;
+    }
+}
+
+/* the primary is back, our outputs off and leave the boards to it */
+static void
+stby_demote(void)
+{
+    lwsl_notice("primary is back, switching our outputs off and standing by\n");
+
+    for (int k = 0; k < stby.nboards; k++) {
+        ios_handle_t *h = stby.boards[k];
+        h->active_relays = 0;
+        if (h->device_handle)
+            USB_write_IO(h);
+        else
+            h->output_pending = 1;
+        h->standby = 1;
+    }
+}
+
+/* the connection is gone, the watchdog takes over unless the primary is back in time */
+static void
+stby_lost(const char *why)
+{
+    conn_close(&stby.c);
+    lwsl_warn("primary connection lost (%s), taking over in %d ms unless it reconnects\n",
+              why, REPL_DEAD_MS);
+}
+
+static void
+stby_fd_cb(int fd, short revents, void *arg)
+{
+    int got = 0;
+    (void) fd;
+    (void) arg;
+
+    if (revents & POLLIN) {
+        if (conn_fill(&stby.c) < 0) {
+            stby_lost("connection closed");
+            return;
+        }
+        size_t i;
+        for (i = 0; i + REPL_RECORD_LEN <= stby.c.inlen; i += REPL_RECORD_LEN) {
+            uint8_t type;
+            int k;
+            uint32_t mask;
+            uint64_t gen;
+            get_record(stby.c.in + i, &type, &k, &mask, &gen);
+            if (type != REPL_STATE || k >= stby.nboards)
+                continue;
+            /* a reconnecting primary starts counting again, take its state */
+            stby.gen[k] = gen;
+            stby.boards[k]->active_relays = mask;
+            if (!stby.got_mark[k]) {
+                stby.got_mark[k] = 1;
+                stby.got[got++] = k;
+            }
+        }
+        memmove(stby.c.in, stby.c.in + i, stby.c.inlen - i);
+        stby.c.inlen -= i;
+        stby.last_rx = evloop_now_ms();
+    }
+
+    /* one ack per board for everything read in this go */
+    for (int i = 0; i < got; i++) {
+        int k = stby.got[i];
+        stby.got_mark[k] = 0;
+        if (stby.c.outlen + REPL_RECORD_LEN > stby.c.outcap)
+            continue; /* the next one acks it */
+        put_record(stby.c.out + stby.c.outlen, REPL_ACK, k, stby.boards[k]->active_relays, stby.gen[k]);
+        stby.c.outlen += REPL_RECORD_LEN;
+    }
+
+    if (conn_flush(&stby.c) < 0)
+        stby_lost("socket error");
+    else if (!(revents & POLLIN) && (revents & (POLLERR | POLLHUP)))
+        stby_lost("socket error");
+}
+
+static void
+stby_accept_cb(int fd, short revents, void *arg)
+{
+    (void) revents;
+    (void) arg;
+
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+
+    if (stby.c.fd >= 0) {
+        /* two primaries, tell the second one so it does not think it is replicated */
+        uint8_t r[REPL_RECORD_LEN];
+        put_record(r, REPL_REFUSED, 0, 0, 0);
+        if (send(cfd, r, sizeof (r), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t) sizeof (r))
+            lwsl_debug("replication refusal not sent : %s\n", strerror(errno));
+        lwsl_err("replication connection refused, already have a primary\n");
+        close(cfd);
+        return;
+    }
+    if (!stby.boards[0]->standby)
+        stby_demote();
+
+    net_setup(cfd);
+    stby.c.fd = cfd;
+    stby.seen_primary = 1;
+    stby.last_rx = evloop_now_ms();
+    evloop_add(cfd, POLLIN, stby_fd_cb, NULL);
+    lwsl_notice("primary connected, standing by\n");
+}
+
+static void
+stby_watchdog(void *arg)
+{
+    (void) arg;
+
+    uint64_t now = evloop_now_ms();
+
+    if (!stby.boards[0]->standby)
+        return;
+    if (stby.seen_primary && now - stby.last_rx > REPL_DEAD_MS)
+        stby_promote(stby.c.fd >= 0 ? "heartbeat timeout" : "did not reconnect");
+    else if (!stby.seen_primary && now - stby.started > REPL_STARTUP_MS)
+        stby_promote("no primary since start");
+}
+
+int
+repl_standby_start(ios_handle_t **boards, int nboards, const char *listen_on)
+{
+    assert(boards && nboards > 0);
+
+    stby.gen = calloc(nboards, sizeof (*stby.gen));
+    stby.got = calloc(nboards, sizeof (*stby.got));
+    stby.got_mark = calloc(nboards, 1);
+    if (!stby.gen || !stby.got || !stby.got_mark || conn_init(&stby.c, nboards) != 0)
+        return -1;
+
+    int fd = net_listen(listen_on, 4);
+    if (fd < 0)
+        return -1;
+
+    stby.boards = boards;
+    stby.nboards = nboards;
+    stby.lfd = fd;
+    stby.started = evloop_now_ms();
+    for (int k = 0; k < nboards; k++)
+        boards[k]->standby = 1;
+    evloop_add(fd, POLLIN, stby_accept_cb, NULL);
+    /* check often, the take over has to be quick */
+    evloop_timer_add(REPL_HEARTBEAT_MS / 4, 1, stby_watchdog, NULL);
+    lwsl_notice("standby, waiting for the primary on %s\n", listen_on);
+    return 0;
+}
@@ -0,0 +1,48 @@
+/* 
+ * File:   repl.h
+ * Author: oetelaar
+ *
+ * Hot standby : a primary daemon streams every generation of the relay
+ * state over TCP to a standby daemon with its own boards wired in parallel.
+ * The standby keeps the state but does not drive its boards until the
+ * primary goes away, then it writes the latest state at once. When the
+ * primary connects again the standby switches its outputs off and stands
+ * by again, a second primary is refused and told so.
+ * With -n every board is replicated, both daemons need the same -n.
+ */
+
+#ifndef REPL_H
+#define	REPL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+    /*
+     * heartbeat from the primary, the standby takes over after REPL_DEAD_MS
+     * of silence (also after a dropped connection that is not back by then).
+     * A round of the primary's loop can take several USB timeouts of 100 ms
+     * and a reconnect takes REPL_RETRY_MS, the dead time is well above both
+     */
+#define REPL_HEARTBEAT_MS 100
+#define REPL_DEAD_MS (20 * REPL_HEARTBEAT_MS)
+    /* generations the primary may have in flight without an ack */
+#define REPL_WINDOW 64
+    /*
+     * a standby that never had a primary takes over after this, so a
+     * primary that does not come up at all does not leave the boards alone
+     */
+#define REPL_STARTUP_MS 10000
+
+    /* primary : replicate to host:port, keeps reconnecting, returns 0 or -1 */
+    int repl_primary_start(ios_handle_t **boards, int nboards, const char *peer);
+    /* standby : listen on [addr:]port for the primary, returns 0 or -1 */
+    int repl_standby_start(ios_handle_t **boards, int nboards, const char *listen_on);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* REPL_H */
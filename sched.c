@@ -0,0 +1,501 @@
+/*
+ * File:   sched.c
+ * Author: oetelaar
+ *
+ * The frame scheduler, see sched.h
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sched.h"
+#include "evloop.h"
+#include "stats.h"
+#include "logging.h"
+
+typedef struct sched_class
+{
+    const char *name;
+    unsigned weight;
+    unsigned quota; /* changes per second, 0 = no limit */
+} sched_class_t;
+
+static sched_class_t classes[] = {
+    {"inotify", 1, 0},
+    {"ctl", 1, 0},
+    {"mqtt", 1, 0},
+    {"ws", 1, 0},
+    {"lease", 1, 0},
+};
+#define NCLASSES ((int) (sizeof (classes) / sizeof (classes[0])))
+
+struct sched_client
+{
+    char name[48];
+    const sched_class_t *cls;
+    sched_done_t done;
+    void *arg;
+
+    sched_batch_t *open; /* being built */
+    sched_batch_t *head, *tail;
+    int queued;
+    long deficit;
+    double tokens; /* quota left */
+    uint64_t refill_us;
+    int dead; /* freed during a tick */
+    const sched_batch_t *cur; /* sched_pending_relays() */
+
+    /* since the last report */
+    unsigned long batches;
+    unsigned long changes;
+    unsigned long held; /* ticks that ended with batches of ours waiting */
+    stats_hist_t latency; /* submitted to written */
+
+    struct sched_client *prev, *next;
+};
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    unsigned budget;
+    sched_client_t *clients;
+    sched_client_t *rr; /* first one looked at in the next tick */
+    sched_client_t *dead;
+
+    /* the frame */
+    int *frame;
+    int nframe;
+    uint8_t *in_frame;
+    uint8_t *failed;
+
+    int in_tick;
+    int timer;
+    uint64_t last_tick_us;
+    uint64_t seq; /* batches submitted */
+} sched;
+
+static void sched_tick(void *arg);
+
+int
+sched_set_class(const char *spec)
+{
+    char name[32];
+    unsigned w = 1, q = 0;
+
+    if (sscanf(spec, "%31[^=]=%u:%u", name, &w, &q) < 2 || w == 0)
+        return -1;
+    for (int i = 0; i < NCLASSES; i++)
+        if (!strcmp(classes[i].name, name)) {
+            classes[i].weight = w;
+            classes[i].quota = q;
+            return 0;
+        }
+    return -1;
+}
+
+void
+sched_set_budget(unsigned boards)
+{
+    sched.budget = boards;
+}
+
+int
+sched_start(ios_handle_t **boards, int nboards)
+{
+    assert(boards && nboards > 0);
+
+    sched.boards = boards;
+    sched.nboards = nboards;
+    sched.frame = calloc(nboards, sizeof (*sched.frame));
+    sched.in_frame = calloc(nboards, 1);
+    sched.failed = calloc(nboards, 1);
+    if (!sched.frame || !sched.in_frame || !sched.failed)
+        return -1;
+    for (int i = 0; i < NCLASSES; i++)
+        if (classes[i].weight != 1 || classes[i].quota)
+            lwsl_notice("sched: %s weight %u quota %u/s\n", classes[i].name,
+                        classes[i].weight, classes[i].quota);
+    if (sched.budget)
+        lwsl_notice("sched: at most %u board(s) per %d ms\n", sched.budget, SCHED_TICK_MS);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* clients */
+
+sched_client_t *
+sched_client_new(const char *cls, const char *name, sched_done_t done, void *arg)
+{
+    const sched_class_t *k = NULL;
+
+    for (int i = 0; i < NCLASSES && !k; i++)
+        if (!strcmp(classes[i].name, cls))
+            k = &classes[i];
+    assert(k);
+
+    sched_client_t *c = calloc(1, sizeof (*c));
+    if (!c)
+        return NULL;
+    snprintf(c->name, sizeof (c->name), "%s", name);
+    c->cls = k;
+    c->done = done;
+    c->arg = arg;
+    c->tokens = 1;
+    c->refill_us = evloop_now_us();
+
+    c->next = sched.clients;
+    if (sched.clients)
+        sched.clients->prev = c;
+    sched.clients = c;
+    return c;
+}
+
+static void
+sched_drop_batches(sched_client_t *c)
+{
+    while (c->head) {
+        sched_batch_t *b = c->head;
+        c->head = b->next;
+        free(b);
+    }
+    c->tail = NULL;
+    c->queued = 0;
+    free(c->open);
+    c->open = NULL;
+}
+
+void
+sched_client_free(sched_client_t *c)
+{
+    if (!c)
+        return;
+    sched_drop_batches(c);
+    if (sched.rr == c)
+        sched.rr = c->next;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        sched.clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (sched.in_tick) {
+        /* its accepted batches are still in the frame, free it after */
+        c->dead = 1;
+        c->next = sched.dead;
+        sched.dead = c;
+        return;
+    }
+    free(c);
+}
+
+int
+sched_add(sched_client_t *c, unsigned board, uint32_t set, uint32_t clear)
+{
+    sched_batch_t *b = c->open;
+
+    if (!b || b->n == b->cap) {
+        int cap = b ? b->cap * 2 : 4;
+        b = realloc(b, sizeof (*b) + cap * sizeof (b->ch[0]));
+        if (!b)
+            return -1;
+        if (!c->open)
+            b->n = 0;
+        b->cap = cap;
+        c->open = b;
+    }
+    b->ch[b->n].board = board;
+    b->ch[b->n].set = set;
+    b->ch[b->n].clear = clear;
+    b->n++;
+    return 0;
+}
+
+/*
+ * a tick as soon as allowed : at the end of this round when the last one
+ * is SCHED_TICK_MS ago, else when that is, so what comes in meanwhile
+ * (over several rounds) goes into one frame
+ */
+static void
+sched_kick(void)
+{
+    if (sched.timer)
+        return;
+    uint64_t since = evloop_now_us() - sched.last_tick_us;
+    if (since < SCHED_TICK_MS * 1000) {
+        unsigned ms = (SCHED_TICK_MS * 1000 - since + 999) / 1000;
+        sched.timer = evloop_timer_add(ms, 0, sched_tick, NULL);
+        return;
+    }
+    evloop_defer(sched_tick, NULL);
+}
+
+int
+sched_submit(sched_client_t *c, uint64_t tag)
+{
+    sched_batch_t *b = c->open;
+
+    if (!b) {
+        b = malloc(sizeof (*b));
+        if (!b)
+            return -1;
+        b->n = b->cap = 0;
+    }
+    c->open = NULL;
+    b->next = NULL;
+    b->client = c;
+    b->tag = tag;
+    b->submitted_us = evloop_now_us();
+    b->seq = ++sched.seq;
+    if (c->tail)
+        c->tail->next = b;
+    else
+        c->head = b;
+    c->tail = b;
+    c->queued++;
+    sched_kick();
+    return 0;
+}
+
+int
+sched_queued(const sched_client_t *c)
+{
+    return c->queued;
+}
+
+static uint32_t
+sched_batch_relays(const sched_batch_t *b, unsigned board, uint32_t r)
+{
+    for (int i = 0; i < b->n; i++)
+        if (b->ch[i].board == board)
+            r = (r | b->ch[i].set) & ~b->ch[i].clear;
+    return r;
+}
+
+uint32_t
+sched_pending_relays(unsigned board)
+{
+    if (board >= (unsigned) sched.nboards)
+        return 0;
+    uint32_t r = sched.boards[board]->active_relays;
+    sched_client_t *c;
+
+    /* the queues merged by seq, each one is in order already */
+    for (c = sched.clients; c; c = c->next)
+        c->cur = c->head;
+    for (;;) {
+        sched_client_t *first = NULL;
+        for (c = sched.clients; c; c = c->next)
+            if (c->cur && (!first || c->cur->seq < first->cur->seq))
+                first = c;
+        if (!first)
+            break;
+        r = sched_batch_relays(first->cur, board, r);
+        first->cur = first->cur->next;
+    }
+    for (c = sched.clients; c; c = c->next)
+        if (c->open)
+            r = sched_batch_relays(c->open, board, r);
+    return r;
+}
+
+int
+sched_board_failed(unsigned board)
+{
+    return board >= (unsigned) sched.nboards || sched.failed[board];
+}
+
+/* ------------------------------------------------------------------ */
+/* ticks */
+
+/* boards the batch would add to the frame */
+static int
+sched_cost(const sched_batch_t *b)
+{
+    int cost = 0;
+
+    for (int i = 0; i < b->n; i++) {
+        unsigned k = b->ch[i].board;
+        if (k < (unsigned) sched.nboards && !sched.in_frame[k]) {
+            /* counted once, the mark is taken back below */
+            sched.in_frame[k] = 2;
+            cost++;
+        }
+    }
+    for (int i = 0; i < b->n; i++) {
+        unsigned k = b->ch[i].board;
+        if (k < (unsigned) sched.nboards && sched.in_frame[k] == 2)
+            sched.in_frame[k] = 0;
+    }
+    return cost;
+}
+
+static void
+sched_apply(const sched_batch_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        unsigned k = b->ch[i].board;
+        if (k >= (unsigned) sched.nboards)
+            continue;
+        ios_handle_t *h = sched.boards[k];
+        h->active_relays = (h->active_relays | b->ch[i].set) & ~b->ch[i].clear;
+        if (!sched.in_frame[k]) {
+            sched.in_frame[k] = 1;
+            sched.frame[sched.nframe++] = k;
+        }
+    }
+}
+
+static void
+sched_refill(sched_client_t *c, uint64_t now)
+{
+    unsigned q = c->cls->quota;
+
+    if (!q)
+        return;
+    double burst = q / 10.0 > 1 ? q / 10.0 : 1;
+    c->tokens += (double) q * (now - c->refill_us) / 1e6;
+    if (c->tokens > burst)
+        c->tokens = burst;
+    c->refill_us = now;
+}
+
+static void
+sched_tick(void *arg)
+{
+    sched_batch_t *acc = NULL, **acc_tail = &acc;
+    long budget = sched.budget ? (long) sched.budget : LONG_MAX;
+    uint64_t now = evloop_now_us();
+    (void) arg;
+
+    evloop_timer_del(sched.timer);
+    sched.timer = 0;
+    sched.last_tick_us = now;
+    sched.in_tick = 1;
+
+    for (sched_client_t *c = sched.clients; c; c = c->next)
+        sched_refill(c, now);
+
+    /* deficit round robin, passes until the frame is full or nobody can go */
+    int more = sched.clients != NULL;
+    while (more) {
+        more = 0;
+        sched_client_t *start = sched.rr ? sched.rr : sched.clients;
+        sched_client_t *c = start;
+        do {
+            if (!c->head) {
+                c->deficit = 0;
+            } else {
+                c->deficit += (long) c->cls->weight * SCHED_QUANTUM;
+                while (c->head) {
+                    sched_batch_t *b = c->head;
+                    if (c->cls->quota && c->tokens < 1)
+                        break;
+                    long cost = sched_cost(b);
+                    if (cost > c->deficit) {
+                        more = 1;
+                        break;
+                    }
+                    if (cost > budget && sched.nframe) {
+                        more = 0;
+                        goto full;
+                    }
+                    c->head = b->next;
+                    if (!c->head)
+                        c->tail = NULL;
+                    c->queued--;
+                    b->next = NULL;
+                    *acc_tail = b;
+                    acc_tail = &b->next;
+                    sched_apply(b);
+                    c->deficit -= cost;
+                    budget -= cost;
+                    c->tokens -= b->n ? b->n : 1;
+                    c->batches++;
+                    c->changes += b->n;
+                }
+            }
+            c = c->next ? c->next : sched.clients;
+        } while (c != start);
+    }
+full:
+    /* the next tick starts with the next client */
+    if (sched.rr)
+        sched.rr = sched.rr->next;
+    if (!sched.rr)
+        sched.rr = sched.clients;
+
+    /* the frame, every board once */
+    for (int i = 0; i < sched.nframe; i++) {
+        ios_handle_t *h = sched.boards[sched.frame[i]];
+        int ok = 0;
+        if (h->device_handle)
+            ok = USB_write_IO(h) == 0;
+        else
+            h->output_pending = 1;
+        sched.failed[h->board_index] = !ok;
+    }
+
+    uint64_t written = evloop_now_us();
+    while (acc) {
+        sched_batch_t *b = acc;
+        acc = b->next;
+        sched_client_t *c = b->client;
+        if (!c->dead) {
+            stats_hist_add(&c->latency, written - b->submitted_us);
+            if (c->done)
+                c->done(c, b, c->arg);
+        }
+        free(b);
+    }
+    for (int i = 0; i < sched.nframe; i++) {
+        sched.in_frame[sched.frame[i]] = 0;
+        sched.failed[sched.frame[i]] = 0;
+    }
+    sched.nframe = 0;
+
+    sched.in_tick = 0;
+    while (sched.dead) {
+        sched_client_t *c = sched.dead;
+        sched.dead = c->next;
+        free(c);
+    }
+
+    /* left over by budget or quota, next tick */
+    int waiting = 0;
+    for (sched_client_t *c = sched.clients; c; c = c->next)
+        if (c->head) {
+            c->held++;
+            waiting = 1;
+        }
+    if (waiting)
+        sched.timer = evloop_timer_add(SCHED_TICK_MS, 0, sched_tick, NULL);
+}
+
+void
+sched_flush(void)
+{
+    if (!sched.in_tick)
+        sched_tick(NULL);
+}
+
+void
+sched_report(void)
+{
+    char lat[160];
+
+    for (sched_client_t *c = sched.clients; c; c = c->next) {
+        if (!c->batches && !c->queued)
+            continue;
+        stats_hist_format(&c->latency, lat, sizeof (lat));
+        lwsl_notice("sched: %s batches=%lu changes=%lu held=%lu queued=%d latency us %s\n",
+                    c->name, c->batches, c->changes, c->held, c->queued, lat);
+        c->batches = 0;
+        c->changes = 0;
+        c->held = 0;
+        stats_hist_reset(&c->latency);
+    }
+}
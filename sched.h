@@ -0,0 +1,101 @@
+/*
+ * File:   sched.h
+ * Author: oetelaar
+ *
+ * One place where the relay changes of all sources (the event directory,
+ * command connections, MQTT, websocket clients, expired leases) are put
+ * into frames.
+ *
+ * Every connection, and the event directory, is a client with its own
+ * queue. A client hands in batches, a batch is one message of the source
+ * (a file event, a ctl message, an MQTT publish) and always goes into one
+ * frame as a whole. Each tick the batches are taken from the clients by
+ * deficit round robin, weighted per class, until the frame budget (boards
+ * written per tick) is used up. A batch costs the boards it adds to the
+ * frame, so changes to a board already in the frame are free. Then every
+ * board in the frame is written once and the clients are told, in order.
+ *
+ * Per class a weight (share of the frame when it is full) and a quota
+ * (changes per second, 0 = no limit) can be given, every client of the
+ * class gets them. Ticks are at least SCHED_TICK_MS apart, about one
+ * frame of the CH341A : a change after a quiet time goes out at the end
+ * of the loop round it came in, changes that come within SCHED_TICK_MS
+ * of the last tick wait for the next one and go out together. Without a
+ * budget a tick takes everything that is there except for a quota.
+ */
+
+#ifndef SCHED_H
+#define	SCHED_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define SCHED_TICK_MS 10
+    /* deficit added per pass, in boards, times the weight */
+#define SCHED_QUANTUM 4
+    /* a client with this many batches waiting should stop reading */
+#define SCHED_MAX_QUEUED 256
+
+    typedef struct sched_change
+    {
+        unsigned board;
+        uint32_t set;
+        uint32_t clear;
+    } sched_change_t;
+
+    typedef struct sched_client sched_client_t;
+
+    typedef struct sched_batch
+    {
+        struct sched_batch *next;
+        sched_client_t *client;
+        uint64_t tag; /* for the source, a sequence number or packet id */
+        uint64_t submitted_us;
+        uint64_t seq; /* order of submission over all clients */
+        int n, cap;
+        sched_change_t ch[];
+    } sched_batch_t;
+
+    /* the batch has been written, see sched_board_failed() for how it went */
+    typedef void (*sched_done_t)(sched_client_t *c, const sched_batch_t *b, void *arg);
+
+    /* "<class>=<weight>[:<quota>]", before sched_start, returns 0 or -1 */
+    int sched_set_class(const char *spec);
+    /* boards written per tick, 0 = no limit */
+    void sched_set_budget(unsigned boards);
+    int sched_start(ios_handle_t **boards, int nboards);
+
+    /* class is one of inotify ctl mqtt ws lease, name is for the reports */
+    sched_client_t *sched_client_new(const char *cls, const char *name, sched_done_t done, void *arg);
+    /* queued batches are dropped without done, safe from inside done */
+    void sched_client_free(sched_client_t *c);
+
+    /* a change into the batch being built, returns 0 or -1 */
+    int sched_add(sched_client_t *c, unsigned board, uint32_t set, uint32_t clear);
+    /* queue the batch being built (also when empty), returns 0 or -1 */
+    int sched_submit(sched_client_t *c, uint64_t tag);
+    /* batches waiting */
+    int sched_queued(const sched_client_t *c);
+
+    /*
+     * the relays of board as they will be once everything queued (and
+     * being built) is written, in the order it was submitted
+     */
+    uint32_t sched_pending_relays(unsigned board);
+
+    /* inside done : the board was not written (no such board, not connected, USB error) */
+    int sched_board_failed(unsigned board);
+
+    /* a tick now, for what has to be out before something else (a pulse) */
+    void sched_flush(void);
+    /* per client latency and counts, then start over */
+    void sched_report(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SCHED_H */
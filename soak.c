@@ -0,0 +1,214 @@
+/* 
+ * File:   soak.c
+ * Author: oetelaar
+ *
+ * The events go the normal way : files are created and removed in the
+ * event directories, inotify tells the daemon, the daemon writes the
+ * emulated board. Latency is from touching the file to the write.
+ *
+ * Growth check : the first eighth of the samples is warm up, the rest
+ * is cut in four quarters. When the quarter averages go up every time
+ * and the last is clearly above the first, that is a leak (or drift).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "soak.h"
+#include "emu.h"
+#include "evloop.h"
+#include "stats.h"
+#include "logging.h"
+
+typedef struct
+{
+    double rss_kb;
+    double fds;
+    double devices;
+    double p99_us;
+} soak_sample_t;
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    unsigned long events; /* to do */
+    unsigned long done;
+    unsigned long sample_every;
+    uint32_t *on; /* per board, relays we switched on through files */
+    uint64_t *op_us; /* per board, when we touched a file, 0 = nothing pending */
+    stats_hist_t latency; /* of this sample period */
+    soak_sample_t samples[SOAK_SAMPLES + 1];
+    int nsamples;
+    int timer;
+    unsigned int seed;
+} soak;
+
+static void
+soak_listener(ios_handle_t *h, uint32_t old_outputbits, void *arg)
+{
+    (void) old_outputbits;
+    (void) arg;
+
+    uint64_t *op = &soak.op_us[h->board_index];
+    if (*op && !h->output_pending) {
+        stats_hist_add(&soak.latency, evloop_now_us() - *op);
+        *op = 0;
+    }
+}
+
+static void
+soak_sample(void)
+{
+    if (soak.nsamples > SOAK_SAMPLES)
+        return;
+
+    soak_sample_t *s = &soak.samples[soak.nsamples++];
+    s->rss_kb = stats_rss_kb();
+    s->fds = stats_open_fds();
+    s->devices = ios_open_device_count();
+    s->p99_us = stats_hist_percentile(&soak.latency, 0.99);
+    lwsl_info("soak: %lu events rss=%.0f kB fds=%.0f devices=%.0f p99=%.0f us\n",
+              soak.done, s->rss_kb, s->fds, s->devices, s->p99_us);
+    stats_hist_reset(&soak.latency);
+}
+
+/* quarter averages after warm up keep rising and the rise is more than the tolerance */
+static int
+soak_grows(size_t offset, double tol_rel, double tol_abs, const char *what)
+{
+    int start = soak.nsamples / 8;
+    int len = soak.nsamples - start;
+    double q[4];
+
+    if (len < 8)
+        return 0;
+
+    for (int i = 0; i < 4; i++) {
+        int a = start + i * len / 4, b = start + (i + 1) * len / 4;
+        q[i] = 0;
+        for (int k = a; k < b; k++)
+            q[i] += *(double *) ((char *) &soak.samples[k] + offset);
+        q[i] /= (b - a);
+    }
+
+    if (q[0] < q[1] && q[1] < q[2] && q[2] < q[3] &&
+        q[3] - q[0] > tol_abs && q[3] > q[0] * (1.0 + tol_rel)) {
+        lwsl_err("soak: %s keeps growing : %.1f %.1f %.1f %.1f\n", what, q[0], q[1], q[2], q[3]);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+soak_replug(void *arg)
+{
+    emu_board_t *e = arg;
+    e->present = 1;
+}
+
+static void
+soak_finish(void)
+{
+    int bad = 0;
+    char path[4096];
+
+    evloop_timer_del(soak.timer);
+    soak_sample();
+
+    bad |= soak_grows(offsetof(soak_sample_t, rss_kb), 0.02, 64, "memory (rss kB)");
+    bad |= soak_grows(offsetof(soak_sample_t, fds), 0, 0.5, "open fds");
+    bad |= soak_grows(offsetof(soak_sample_t, devices), 0, 0.5, "open device handles");
+    bad |= soak_grows(offsetof(soak_sample_t, p99_us), 1.0, 100, "p99 latency (us)");
+
+    /* leave the directories as we found them */
+    for (int k = 0; k < soak.nboards; k++)
+        for (int pin = FIRST_RELAY_NO; pin <= LAST_RELAY_NO; pin++)
+            if (soak.on[k] & (1u << (pin - 1))) {
+                snprintf(path, sizeof (path), "%s/D_OUT_%d", soak.boards[k]->event_dir, pin);
+                unlink(path);
+            }
+
+    lwsl_notice("soak: %lu events, %d samples : %s\n", soak.done, soak.nsamples,
+                bad ? "FAILED" : "passed");
+    evloop_quit(bad ? 5 : 0);
+}
+
+static void
+soak_tick(void *arg)
+{
+    char path[4096];
+    (void) arg;
+
+    for (int n = 0; n < SOAK_BATCH && soak.done < soak.events; n++) {
+        int k = rand_r(&soak.seed) % soak.nboards;
+        int pin = FIRST_RELAY_NO + rand_r(&soak.seed) % (LAST_RELAY_NO - FIRST_RELAY_NO + 1);
+        uint32_t bit = 1u << (pin - 1);
+        ios_handle_t *h = soak.boards[k];
+        emu_board_t *e = h->transport_data;
+
+        snprintf(path, sizeof (path), "%s/D_OUT_%d", h->event_dir, pin);
+        if (soak.on[k] & bit) {
+            if (unlink(path) != 0 && errno != ENOENT)
+                lwsl_err("soak: unlink %s : %s\n", path, strerror(errno));
+        } else {
+            int fd = open(path, O_CREAT | O_WRONLY, 0666);
+            if (fd < 0)
+                lwsl_err("soak: create %s : %s\n", path, strerror(errno));
+            else
+                close(fd);
+        }
+        soak.on[k] ^= bit;
+        if (!soak.op_us[k])
+            soak.op_us[k] = evloop_now_us();
+        soak.done++;
+
+        /* failure injection and reconnect cycles */
+        if (soak.done % SOAK_FAIL_EVERY == 0)
+            e->fail_next = 1;
+        if (soak.done % SOAK_UNPLUG_EVERY == 0 && e->present) {
+            e->present = 0;
+            evloop_timer_add(SOAK_UNPLUG_MS, 0, soak_replug, e);
+        }
+        if (soak.done % soak.sample_every == 0)
+            soak_sample();
+    }
+
+    if (soak.done >= soak.events)
+        soak_finish();
+}
+
+int
+soak_start(ios_handle_t **boards, int nboards, unsigned long events)
+{
+    if (nboards < 1)
+        return -1;
+    for (int k = 0; k < nboards; k++)
+        if (boards[k]->transport != &ios_emu_transport) {
+            lwsl_err("soak test only on emulated boards (-e)\n");
+            return -1;
+        }
+
+    memset(&soak, 0, sizeof (soak));
+    soak.boards = boards;
+    soak.nboards = nboards;
+    soak.events = events;
+    soak.sample_every = events / SOAK_SAMPLES ? events / SOAK_SAMPLES : 1;
+    soak.on = calloc((size_t) nboards, sizeof (*soak.on));
+    soak.op_us = calloc((size_t) nboards, sizeof (*soak.op_us));
+    soak.seed = 1;
+
+    /* files that were already there count as on */
+    for (int k = 0; k < nboards; k++) {
+        soak.on[k] = boards[k]->active_relays;
+        ios_add_listener(boards[k], soak_listener, NULL);
+    }
+
+    soak.timer = evloop_timer_add(1, 1, soak_tick, NULL);
+    lwsl_notice("soak: %lu events on %d emulated board(s)\n", events, nboards);
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* 
+ * File:   soak.h
+ * Author: oetelaar
+ *
+ * Soak test for the daemon (-S, needs -e) : generate a long stream of
+ * relay events through the event directories, unplug and replug the
+ * emulated boards and let transfers fail now and then. Along the way
+ * sample memory, open fds, open device handles and latency, and fail
+ * when any of them keeps growing.
+ */
+
+#ifndef SOAK_H
+#define	SOAK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+    /* events per timer tick, the tick is 1 ms */
+#define SOAK_BATCH 16
+    /* samples taken over the whole run */
+#define SOAK_SAMPLES 64
+    /* every this many events : one transfer fails, one board is unplugged */
+#define SOAK_FAIL_EVERY 1000
+#define SOAK_UNPLUG_EVERY 10000
+#define SOAK_UNPLUG_MS 200
+
+    /* 
+     * start generating events on the emulated boards, when done the
+     * event loop is stopped with 0 (pass) or 5 (growth found)
+     */
+    int soak_start(ios_handle_t **boards, int nboards, unsigned long events);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOAK_H */
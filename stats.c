@@ -0,0 +1,128 @@
+/* 
+ * File:   stats.c
+ * Author: oetelaar
+ *
+ * see stats.h
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+#define SUB (1 << STATS_SUB_BITS)
+
+static int
+bucket_of(uint64_t v)
+{
+    if (v < SUB)
+        return (int) v;
+    int e = 63 - __builtin_clzll(v); /* e >= STATS_SUB_BITS */
+    int sub = (int) (v >> (e - STATS_SUB_BITS)) & (SUB - 1);
+    return (e - STATS_SUB_BITS + 1) * SUB + sub;
+}
+
+/* highest value that lands in bucket b */
+static uint64_t
+bucket_top(int b)
+{
+    if (b < SUB)
+        return (uint64_t) b;
+    int e = b / SUB + STATS_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (b % SUB);
+    uint64_t low = (1ULL << e) | (sub << (e - STATS_SUB_BITS));
+    return low + (1ULL << (e - STATS_SUB_BITS)) - 1;
+}
+
+void
+stats_hist_add(stats_hist_t *s, uint64_t v)
+{
+    s->count++;
+    s->sum += v;
+    if (v > s->max)
+        s->max = v;
+    s->bucket[bucket_of(v)]++;
+}
+
+uint64_t
+stats_hist_percentile(const stats_hist_t *s, double p)
+{
+    if (!s->count)
+        return 0;
+
+    uint64_t want = (uint64_t) (p * s->count);
+    if (want >= s->count)
+        want = s->count - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += s->bucket[b];
+        if (seen > want) {
+            uint64_t top = bucket_top(b);
+            return top < s->max ? top : s->max;
+        }
+    }
+    return s->max;
+}
+
+void
+stats_hist_reset(stats_hist_t *s)
+{
+    memset(s, 0, sizeof (*s));
+}
+
+int
+stats_hist_format(const stats_hist_t *s, char *buf, int len)
+{
+    return snprintf(buf, len, "n=%llu avg=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu",
+                    (unsigned long long) s->count,
+                    (unsigned long long) (s->count ? s->sum / s->count : 0),
+                    (unsigned long long) stats_hist_percentile(s, 0.50),
+                    (unsigned long long) stats_hist_percentile(s, 0.90),
+                    (unsigned long long) stats_hist_percentile(s, 0.99),
+                    (unsigned long long) stats_hist_percentile(s, 0.999),
+                    (unsigned long long) s->max);
+}
+
+uint64_t
+stats_cpu_us(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+            ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+uint64_t
+stats_rss_kb(void)
+{
+    unsigned long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (uint64_t) resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int
+stats_open_fds(void)
+{
+    DIR *d = opendir("/proc/self/fd");
+    struct dirent *e;
+    int n = 0;
+
+    if (!d)
+        return -1;
+    while ((e = readdir(d)) != NULL)
+        if (e->d_name[0] != '.')
+            n++;
+    closedir(d);
+    return n - 1; /* not the one of opendir() itself */
+}
@@ -0,0 +1,48 @@
+/* 
+ * File:   stats.h
+ * Author: oetelaar
+ *
+ * Cheap latency histograms and process figures for the daemon reports.
+ * Buckets are log-linear (4 per power of two), good to 25%,
+ * adding a sample is a few instructions and no allocation.
+ */
+
+#ifndef STATS_H
+#define	STATS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define STATS_SUB_BITS 2
+#define STATS_BUCKETS (64 << STATS_SUB_BITS)
+
+    typedef struct
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t bucket[STATS_BUCKETS];
+    } stats_hist_t;
+
+    void stats_hist_add(stats_hist_t *s, uint64_t v);
+    /* value below which fraction p (0..1) of the samples are, upper bucket bound */
+    uint64_t stats_hist_percentile(const stats_hist_t *s, double p);
+    void stats_hist_reset(stats_hist_t *s);
+    /* "n=.. avg=.. p50=.. p90=.. p99=.. p99.9=.. max=.." into buf */
+    int stats_hist_format(const stats_hist_t *s, char *buf, int len);
+
+    /* user + system cpu time of the process in us */
+    uint64_t stats_cpu_us(void);
+    /* resident set size in kB, 0 when unknown */
+    uint64_t stats_rss_kb(void);
+    /* open file descriptors of the process, -1 when unknown */
+    int stats_open_fds(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* STATS_H */
@@ -0,0 +1,65 @@
+/*
+ * File:   bench_ch341a.c
+ * Author: oetelaar
+ *
+ * ns per expansion of the relay bits into CH341A commands, the vector
+ * version against the plain C one, for chains of 8 to 1024 bits.
+ * Build with CFLAGS+=-DCH341A_NO_SIMD to see both plain.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ch341a.h"
+
+#define ROUNDS 200000
+
+typedef size_t (*expand_t)(const uint8_t *bits, size_t nbits, uint8_t *out);
+
+static uint8_t bits[CH341A_MAX_CHAIN_BITS / 8];
+static uint8_t out[CH341A_FRAME_LEN(CH341A_MAX_CHAIN_BITS)];
+static volatile size_t sink;
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+ns_per_call(expand_t fn, size_t nbits)
+{
+    double best = 0;
+
+    /* best of 5, the others had the cpu taken away */
+    for (int r = 0; r < 5; r++) {
+        double t0 = now_ns();
+        for (int i = 0; i < ROUNDS; i++) {
+            bits[0] = (uint8_t) i;
+            sink += fn(bits, nbits, out);
+        }
+        double t = (now_ns() - t0) / ROUNDS;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int
+main(void)
+{
+    static const size_t lengths[] = {8, 64, 256, 1024};
+
+    for (size_t i = 0; i < sizeof (bits); i++)
+        bits[i] = (uint8_t) (i * 101 + 7);
+    printf("%6s %10s %10s %8s\n", "bits", "vector ns", "plain ns", "speedup");
+    for (size_t k = 0; k < sizeof (lengths) / sizeof (lengths[0]); k++) {
+        double v = ns_per_call(ch341a_expand_bits, lengths[k]);
+        double s = ns_per_call(ch341a_expand_bits_scalar, lengths[k]);
+        printf("%6zu %10.1f %10.1f %7.1fx\n", lengths[k], v, s, s / v);
+    }
+    return 0;
+}
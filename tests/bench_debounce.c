@@ -0,0 +1,132 @@
+/*
+ * File:   bench_debounce.c
+ * Author: oetelaar
+ *
+ * ns per sample of all inputs, the bit sliced debounce against a plain
+ * counter per input, for 8 to 1024 inputs at rest, with 1% of them
+ * bouncing and with all of them bouncing. Counters of 8 samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "debounce.h"
+
+#define MAX_INPUTS 1024
+#define PATTERNS 4096
+#define SAMPLES 8
+
+typedef struct
+{
+    unsigned count;
+    int state;
+} plain_input_t;
+
+static debounce_word_t raws[PATTERNS][DEBOUNCE_WORDS(MAX_INPUTS)];
+static debounce_word_t rise[DEBOUNCE_WORDS(MAX_INPUTS)], fall[DEBOUNCE_WORDS(MAX_INPUTS)];
+static plain_input_t plain[MAX_INPUTS];
+static volatile long sink;
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t
+xorshift(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* the way it was done per input, what the bit sliced one replaces */
+static int
+plain_sample(int n, const debounce_word_t *raw)
+{
+    int edges = 0;
+
+    memset(rise, 0, DEBOUNCE_WORDS(n) * sizeof (*rise));
+    memset(fall, 0, DEBOUNCE_WORDS(n) * sizeof (*fall));
+    for (int i = 0; i < n; i++) {
+        debounce_word_t bit = (debounce_word_t) 1 << (i % DEBOUNCE_WORD_BITS);
+        int in = (raw[i / DEBOUNCE_WORD_BITS] & bit) != 0;
+
+        if (in && plain[i].count < SAMPLES)
+            plain[i].count++;
+        else if (!in && plain[i].count > 0)
+            plain[i].count--;
+        int state = plain[i].count == SAMPLES ? 1 : plain[i].count == 0 ? 0 : plain[i].state;
+        if (state != plain[i].state) {
+            edges++;
+            if (state)
+                rise[i / DEBOUNCE_WORD_BITS] |= bit;
+            else
+                fall[i / DEBOUNCE_WORD_BITS] |= bit;
+        }
+        plain[i].state = state;
+    }
+    return edges;
+}
+
+/* a slow square wave on all inputs, bouncing ones get random bits on top */
+static void
+make_patterns(int n, double bouncing)
+{
+    for (int t = 0; t < PATTERNS; t++)
+        for (int w = 0; w < DEBOUNCE_WORDS(n); w++) {
+            debounce_word_t base = (t / 500) & 1 ? ~(debounce_word_t) 0 : 0;
+            debounce_word_t noise = 0;
+            for (int b = 0; b < DEBOUNCE_WORD_BITS; b++)
+                if ((double) (xorshift() & 0xffff) < bouncing * 65536)
+                    noise |= (debounce_word_t) 1 << b;
+            raws[t][w] = base ^ (noise & xorshift());
+        }
+}
+
+int
+main(void)
+{
+    static const int inputs[] = {8, 64, 256, 1024};
+    static const double bouncing[] = {0, 0.01, 1.0};
+
+    printf("%6s %8s %12s %12s %8s\n", "inputs", "bouncing", "sliced ns", "plain ns", "speedup");
+    for (size_t l = 0; l < sizeof (bouncing) / sizeof (bouncing[0]); l++)
+        for (size_t k = 0; k < sizeof (inputs) / sizeof (inputs[0]); k++) {
+            int n = inputs[k];
+            int rounds = 64 * MAX_INPUTS / n + 1;
+            debounce_t d;
+
+            make_patterns(n, bouncing[l]);
+            if (debounce_init(&d, n, SAMPLES) != 0)
+                return 1;
+            memset(plain, 0, sizeof (plain));
+
+            double t0 = now_ns();
+            for (int r = 0; r < rounds; r++)
+                for (int t = 0; t < PATTERNS; t++)
+                    sink += debounce_sample(&d, raws[t], rise, fall);
+            double sliced = (now_ns() - t0) / ((double) rounds * PATTERNS);
+
+            /* the plain one is slow, fewer rounds */
+            rounds = rounds / 8 + 1;
+            t0 = now_ns();
+            for (int r = 0; r < rounds; r++)
+                for (int t = 0; t < PATTERNS; t++)
+                    sink += plain_sample(n, raws[t]);
+            double per_input = (now_ns() - t0) / ((double) rounds * PATTERNS);
+
+            printf("%6d %7.0f%% %12.1f %12.1f %7.1fx\n", n, bouncing[l] * 100,
+                   sliced, per_input, per_input / sliced);
+            debounce_free(&d);
+        }
+    return 0;
+}
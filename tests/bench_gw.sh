@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# File:   bench_gw.sh
+# Author: oetelaar
+#
+# The fleet gateway over loopback : N daemons with 4 emulated boards each,
+# a gateway in front of them and tests/gw_load as the client, one request
+# at a time, many in flight, and many changes per request.
+#
+#  $ tests/bench_gw.sh       : 8 daemons
+#  $ tests/bench_gw.sh 32    : 32 daemons
+#
+
+BIN=${BIN:-./switch_relay}
+LOAD=${LOAD:-tests/gw_load}
+N=${1:-8}
+PORT=${PORT:-17400}
+
+if [ ! -x "$BIN" ] || [ ! -x "$LOAD" ]; then
+    echo "no $BIN or $LOAD, run make $BIN $LOAD first" >&2
+    exit 1
+fi
+
+dir=$(mktemp -d /tmp/switch_relay_gw.XXXXXX) || exit 1
+pids=""
+hosts=""
+trap 'kill $pids 2>/dev/null; rm -rf "$dir"' EXIT INT TERM
+
+i=0
+while [ $i -lt "$N" ]; do
+    mkdir -p "$dir/$i"
+    $BIN -d -e -n 4 -i "$dir/$i" -c 127.0.0.1:$((PORT + 1 + i)) -z 1 > /dev/null 2>&1 &
+    pids="$pids $!"
+    hosts="$hosts -H h$i=127.0.0.1:$((PORT + 1 + i))"
+    i=$((i + 1))
+done
+sleep 0.5
+$BIN -G 127.0.0.1:$PORT $hosts -z 1 > /dev/null 2>&1 &
+pids="$pids $!"
+sleep 0.5
+
+$LOAD $PORT 20000 1 "$N" 1
+$LOAD $PORT 200000 256 "$N" 1
+$LOAD $PORT 50000 64 "$N" 8
@@ -0,0 +1,83 @@
+/*
+ * File:   bench_modes.c
+ * Author: oetelaar
+ *
+ * The ways to get 8 relays onto a board, on the emulator with a simulated
+ * clock : transfers and bytes per frame, the time the bus needs for them
+ * (EMU_TRANSFER_US per transfer) and host cpu per frame.
+ *   shift, per pin  the shift register with one set output transfer per
+ *                   pin change (-m 0, the default)
+ *   shift, stream   the shift register with the frame as one UIO stream (-m 0 -u)
+ *   parallel        a latch on the data pins, CH341A MEM mode (-m 2)
+ *   elomax          the Elomax output command (-m 1)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ios.h"
+#include "emu.h"
+#include "clock.h"
+#include "evloop.h"
+#include "logging.h"
+
+#define FRAMES 100000
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench(const char *name, device_brand_t brand, int uio_stream)
+{
+    clock_source_t sim;
+    emu_board_t b;
+    ios_handle_t h;
+
+    clock_sim_init(&sim, 0);
+    evloop_set_clock(&sim);
+    emu_board_init(&b, brand, &sim);
+    memset(&h, 0, sizeof (h));
+    h.device_brand = brand;
+    h.uio_stream = uio_stream;
+    emu_attach(&h, &b);
+    if (ios_open(&h) != 0 || USB_setup_device(&h) != 0) {
+        printf("%-16s could not open the emulated board\n", name);
+        return;
+    }
+
+    uint64_t f0 = b.frames, x0 = b.transfers, y0 = b.bytes, t0 = clock_now_us(&sim);
+    double w0 = now_ns();
+    for (int i = 0; i < FRAMES; i++) {
+        h.active_relays = (uint32_t) (i * 37) & 0xff;
+        if (USB_write_IO(&h) != 0) {
+            printf("%-16s write failed\n", name);
+            return;
+        }
+    }
+    double cpu = (now_ns() - w0) / FRAMES;
+    uint64_t frames = b.frames - f0;
+
+    printf("%-16s %10.1f %8.1f %10.0f %8.0f %s\n", name,
+           (double) (b.transfers - x0) / frames, (double) (b.bytes - y0) / frames,
+           (double) (clock_now_us(&sim) - t0) / frames, cpu,
+           frames == FRAMES && b.outputs == h.active_relays ? "ok" : "WRONG");
+    USB_close_device(&h);
+}
+
+int
+main(void)
+{
+    log_level = LLL_ERR;
+    printf("%-16s %10s %8s %10s %8s\n", "", "transfers", "bytes", "bus us", "cpu ns");
+    bench("shift, per pin", ABACOM, 0);
+    bench("shift, stream", ABACOM, 1);
+    bench("parallel", CH341A_PAR, 0);
+    bench("elomax", ELOMAX, 0);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * File:   gw_load.c
+ * Author: oetelaar
+ *
+ * Load for the fleet gateway : one client connection that keeps up to
+ * window request lines in flight, each with changes for the given
+ * number of hosts (named h0 .. h<n-1>, boards 0 .. 3), and times every
+ * line from sent to answered.
+ *
+ *  $ tests/gw_load <port> <requests> <window> <hosts> <changes per request>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define BUF_LEN 65536
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+connect_local(int port)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+    memset(&sa, 0, sizeof (sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &sa, sizeof (sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+    static char in[BUF_LEN], out[BUF_LEN];
+    size_t inlen = 0;
+    int sent = 0, done = 0, errors = 0;
+
+    if (argc != 6) {
+        fprintf(stderr, "usage: %s <port> <requests> <window> <hosts> <changes per request>\n", argv[0]);
+        return 2;
+    }
+    int port = atoi(argv[1]), nreq = atoi(argv[2]), window = atoi(argv[3]);
+    int nhosts = atoi(argv[4]), per = atoi(argv[5]);
+    if (nreq < 1 || window < 1 || nhosts < 1 || per < 1) {
+        fprintf(stderr, "all numbers must be 1 or more\n");
+        return 2;
+    }
+
+    int fd = connect_local(port);
+    if (fd < 0) {
+        perror("connect");
+        return 1;
+    }
+    /* sent time by line number (from 1), latency by answer */
+    double *t0 = calloc(nreq + 1, sizeof (*t0));
+    double *lat = calloc(nreq, sizeof (*lat));
+    if (!t0 || !lat)
+        return 1;
+
+    double start = now_us();
+    while (done < nreq) {
+        size_t outlen = 0;
+        while (sent < nreq && sent - done < window && outlen < BUF_LEN - 64 * (size_t) per) {
+            sent++;
+            t0[sent] = now_us();
+            for (int k = 0; k < per; k++)
+                outlen += sprintf(out + outlen, "%sh%d/%d/%d=%d", k ? " " : "",
+                                  (sent + k) % nhosts, (sent / nhosts + k) % 4, k % 8 + 1, (sent + k) & 1);
+            out[outlen++] = '\n';
+        }
+        if (outlen && write(fd, out, outlen) != (ssize_t) outlen) {
+            perror("write");
+            return 1;
+        }
+
+        ssize_t n = read(fd, in + inlen, sizeof (in) - inlen);
+        if (n <= 0) {
+            fprintf(stderr, "gateway closed the connection\n");
+            return 1;
+        }
+        inlen += n;
+        size_t s = 0;
+        for (size_t i = 0; i < inlen; i++) {
+            if (in[i] != '\n')
+                continue;
+            unsigned long id = strtoul(in + s, NULL, 10);
+            if (i - s < 3 || memcmp(in + i - 3, " ok", 3) != 0)
+                errors++;
+            if (id >= 1 && id <= (unsigned long) nreq)
+                lat[done++] = now_us() - t0[id];
+            s = i + 1;
+        }
+        memmove(in, in + s, inlen - s);
+        inlen -= s;
+    }
+
+    double secs = (now_us() - start) / 1e6;
+    qsort(lat, nreq, sizeof (*lat), cmp_double);
+    printf("hosts=%d changes/req=%d window=%d : %.0f req/s %.0f changes/s, us p50=%.0f p99=%.0f p99.9=%.0f max=%.0f, errors=%d\n",
+           nhosts, per, window, nreq / secs, (double) nreq * per / secs,
+           lat[nreq / 2], lat[nreq * 99 / 100], lat[nreq * 999 / 1000], lat[nreq - 1], errors);
+    close(fd);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# File:   scale.sh
+# Author: oetelaar
+#
+# How the daemon scales with the number of boards : for every N a daemon
+# with N emulated boards and N event directories runs the soak workload
+# (files created and removed at random, a failed transfer every 1000
+# events, an unplug every 10000) and the statistics of its busiest
+# second are printed, one line per N.
+#
+#  $ tests/scale.sh                  : 50000 events for 1 10 100 250 500 1000 boards
+#  $ tests/scale.sh 200000 64 512    : 200000 events for 64 and 512 boards
+#
+
+BIN=${BIN:-./switch_relay}
+EVENTS=${1:-50000}
+[ $# -gt 0 ] && shift
+SIZES=${*:-1 10 100 250 500 1000}
+
+if [ ! -x "$BIN" ]; then
+    echo "no $BIN, run make first" >&2
+    exit 1
+fi
+
+printf "%6s %9s %9s %10s %9s %9s %9s %9s\n" \
+    boards "events/s" "cpu us/ev" "kB/board" "p50 us" "p99 us" "p99.9 us" "max us"
+
+for n in $SIZES; do
+    dir=$(mktemp -d /tmp/switch_relay_scale.XXXXXX) || exit 1
+    log=$dir.log
+    start=$(date +%s.%N)
+    $BIN -d -e -n "$n" -i "$dir" -S "$EVENTS" -t 1 -z 5 2> "$log"
+    rc=$?
+    end=$(date +%s.%N)
+
+    # the stats line with the most events is the daemon at full load
+    awk -v n="$n" -v ev="$EVENTS" -v t="$end - $start" -v rc="$rc" '
+        BEGIN { split(t, a, " - "); secs = a[1] - a[2] }
+        /NOTICE: stats: / {
+            for (i = 1; i <= NF; i++) {
+                split($i, kv, "=")
+                v[kv[1]] = kv[2]
+            }
+            if (v["events"] + 0 > best) {
+                best = v["events"] + 0
+                cpu = v["cpu/event"]; p50 = v["p50"]; p99 = v["p99"]
+                p999 = v["p99.9"]; max = v["max"]
+                match($0, /\(([0-9]+) kB\/board\)/)
+                kb = substr($0, RSTART + 1, RLENGTH - 11)
+            }
+        }
+        END {
+            if (!best)
+                printf "%6d no statistics, exit code %d\n", n, rc
+            else
+                printf "%6d %9.0f %9s %10s %9s %9s %9s %9s%s\n", n, ev / secs,
+                    cpu, kb, p50, p99, p999, max, rc ? "  (soak exit " rc ")" : ""
+        }' "$log"
+    rm -rf "$dir" "$log"
+done
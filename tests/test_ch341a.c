@@ -0,0 +1,127 @@
+/*
+ * File:   test_ch341a.c
+ * Author: oetelaar
+ *
+ * The CH341A encodings : the vector expansion against the plain C one for
+ * every byte value and every length, and the UIO stream frame against the
+ * pin changes of the plain frame.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "ch341a.h"
+
+#define MAX_BITS CH341A_MAX_CHAIN_BITS
+#define GUARD 64
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static uint8_t bits[MAX_BITS / 8];
+static uint8_t vec[CH341A_FRAME_LEN(MAX_BITS) + GUARD];
+static uint8_t ref[CH341A_FRAME_LEN(MAX_BITS) + GUARD];
+
+/* the vector and the plain expansion give the same bytes, and no more */
+static int
+same_expansion(size_t nbits)
+{
+    memset(vec, 0xee, sizeof (vec));
+    memset(ref, 0xee, sizeof (ref));
+    size_t n = ch341a_expand_bits(bits, nbits, vec);
+    size_t m = ch341a_expand_bits_scalar(bits, nbits, ref);
+
+    return n == m && n == nbits * CH341A_CMDS_PER_BIT && !memcmp(vec, ref, sizeof (vec));
+}
+
+/* every byte value in every position, every length up to 256, then 1024 */
+static void
+test_expand(void)
+{
+    int bad = 0;
+
+    for (int v = 0; v < 256 && !bad; v++) {
+        /* v itself at the start, the rest differs per position */
+        for (size_t i = 0; i < sizeof (bits); i++)
+            bits[i] = (uint8_t) (v + i * 37);
+        for (size_t nbits = 1; nbits <= 256 && !bad; nbits++)
+            bad = !same_expansion(nbits);
+        if (!bad)
+            bad = !same_expansion(MAX_BITS);
+        if (bad)
+            fprintf(stderr, "expansion differs for byte 0x%02x\n", v);
+    }
+    CHECK(!bad);
+
+    /* the bit to command layout itself */
+    bits[0] = 0x80;
+    CHECK(ch341a_expand_bits(bits, 2, vec) == 6);
+    CHECK(!memcmp(vec, "\x20\x28\x20\x00\x08\x00", 6));
+}
+
+/* play a UIO stream, the pins it sets one after the other */
+static size_t
+stream_pins(const uint8_t *buf, size_t len, uint8_t *pins)
+{
+    size_t n = 0;
+
+    for (size_t p = 0; p < len; p += CH341A_PACKET_LEN) {
+        if (buf[p] != CH341A_CMD_UIO_STREAM)
+            return 0;
+        for (size_t i = p + 1; i < len && i < p + CH341A_PACKET_LEN; i++) {
+            if (buf[i] == CH341A_UIO_STM_END)
+                break;
+            if ((buf[i] & 0xc0) == CH341A_UIO_STM_OUT)
+                pins[n++] = buf[i] & 0x3f;
+        }
+    }
+    return n;
+}
+
+static void
+test_stream_frame(void)
+{
+    static uint8_t stream[CH341A_STREAM_FRAME_LEN(MAX_BITS)];
+    static uint8_t pins[CH341A_FRAME_LEN(MAX_BITS)];
+    static const size_t lengths[] = {1, 7, 8, 9, 10, 16, 64, 255, 1024};
+    int bad = 0;
+
+    for (size_t i = 0; i < sizeof (bits); i++)
+        bits[i] = (uint8_t) (i * 101 + 7);
+    for (size_t k = 0; k < sizeof (lengths) / sizeof (lengths[0]); k++) {
+        size_t nbits = lengths[k];
+        size_t n = ch341a_build_stream_frame(bits, nbits, stream);
+        size_t m = ch341a_build_frame(bits, nbits, ref);
+        if (n == 0 || n > CH341A_STREAM_FRAME_LEN(nbits)
+            || stream_pins(stream, n, pins) != m || memcmp(pins, ref, m)) {
+            fprintf(stderr, "stream frame of %zu bits differs\n", nbits);
+            bad = 1;
+        }
+    }
+    CHECK(!bad);
+
+    /* a board of 8 relays is one packet */
+    CHECK(ch341a_build_stream_frame(bits, 8, stream) <= CH341A_PACKET_LEN);
+    CHECK(CH341A_STREAM_FRAME_LEN(8) == CH341A_PACKET_LEN);
+    CHECK(ch341a_build_stream_frame(bits, 0, stream) == 0);
+    CHECK(ch341a_build_stream_frame(bits, MAX_BITS + 1, stream) == 0);
+}
+
+int
+main(void)
+{
+    test_expand();
+    test_stream_frame();
+
+    if (failures) {
+        fprintf(stderr, "test_ch341a: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_ch341a: ok\n");
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * File:   test_debounce.c
+ * Author: oetelaar
+ *
+ * The bit sliced debounce against the plain one it stands for : every
+ * input its own counter 0 .. samples, up on a 1, down on a 0, the state
+ * follows when the counter hits an end. Random inputs with changing
+ * amounts of bounce, for input counts around the word boundaries and
+ * counters of 1 to 8 bits, edges, edge counts and states must all agree
+ * after every sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debounce.h"
+
+#define MAX_INPUTS 1024
+#define SAMPLES_PER_CASE 20000
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    unsigned long long a_ = (a), b_ = (b); \
+    if (a_ != b_) { \
+        fprintf(stderr, "%s:%d: %s = %llu, expected %llu\n", __FILE__, __LINE__, #a, a_, b_); \
+        failures++; \
+    } \
+} while (0)
+
+/* the reference, one input at a time */
+typedef struct
+{
+    unsigned count;
+    int state;
+} ref_input_t;
+
+static int
+ref_sample(ref_input_t *r, int n, unsigned samples, const debounce_word_t *raw,
+           debounce_word_t *rise, debounce_word_t *fall)
+{
+    int edges = 0;
+
+    memset(rise, 0, DEBOUNCE_WORDS(n) * sizeof (*rise));
+    memset(fall, 0, DEBOUNCE_WORDS(n) * sizeof (*fall));
+    for (int i = 0; i < n; i++) {
+        debounce_word_t bit = (debounce_word_t) 1 << (i % DEBOUNCE_WORD_BITS);
+        int in = (raw[i / DEBOUNCE_WORD_BITS] & bit) != 0;
+
+        if (in && r[i].count < samples)
+            r[i].count++;
+        else if (!in && r[i].count > 0)
+            r[i].count--;
+        int state = r[i].count == samples ? 1 : r[i].count == 0 ? 0 : r[i].state;
+        if (state != r[i].state) {
+            edges++;
+            if (state)
+                rise[i / DEBOUNCE_WORD_BITS] |= bit;
+            else
+                fall[i / DEBOUNCE_WORD_BITS] |= bit;
+        }
+        r[i].state = state;
+    }
+    return edges;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t
+xorshift(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* every input 1 with percent % chance, bits past the last input set at random */
+static void
+random_inputs(debounce_word_t *raw, int n, unsigned percent)
+{
+    for (int w = 0; w < DEBOUNCE_WORDS(n); w++) {
+        raw[w] = xorshift() & xorshift() & xorshift(); /* junk past n stays */
+        for (int b = 0; b < DEBOUNCE_WORD_BITS && w * DEBOUNCE_WORD_BITS + b < n; b++) {
+            debounce_word_t bit = (debounce_word_t) 1 << b;
+            raw[w] = xorshift() % 100 < percent ? raw[w] | bit : raw[w] & ~bit;
+        }
+    }
+}
+
+static void
+test_against_reference(int n, unsigned samples)
+{
+    static ref_input_t ref[MAX_INPUTS];
+    debounce_word_t raw[DEBOUNCE_WORDS(MAX_INPUTS)];
+    debounce_word_t rise[DEBOUNCE_WORDS(MAX_INPUTS)], fall[DEBOUNCE_WORDS(MAX_INPUTS)];
+    debounce_word_t rrise[DEBOUNCE_WORDS(MAX_INPUTS)], rfall[DEBOUNCE_WORDS(MAX_INPUTS)];
+    int nwords = DEBOUNCE_WORDS(n);
+    unsigned percent = 50;
+    debounce_t d;
+
+    if (debounce_init(&d, n, samples) != 0) {
+        fprintf(stderr, "debounce_init(%d, %u) failed\n", n, samples);
+        failures++;
+        return;
+    }
+    memset(ref, 0, sizeof (ref));
+
+    for (int t = 0; t < SAMPLES_PER_CASE; t++) {
+        /* stretches of mostly closed, mostly open and bouncing */
+        if (t % 1000 == 0)
+            percent = (unsigned) (xorshift() % 101);
+
+        random_inputs(raw, n, percent);
+        int e = debounce_sample(&d, raw, rise, fall);
+        int re = ref_sample(ref, n, samples, raw, rrise, rfall);
+        int same = e == re && !memcmp(rise, rrise, nwords * sizeof (*rise))
+                && !memcmp(fall, rfall, nwords * sizeof (*fall));
+        for (int i = 0; same && i < n; i++)
+            same = debounce_state(&d, i) == ref[i].state;
+        if (!same) {
+            fprintf(stderr, "inputs %d samples %u : differs from the reference at sample %d\n", n, samples, t);
+            failures++;
+            break;
+        }
+        /* once in a while a reset, as after a reconnect */
+        if (t % 4999 == 4998) {
+            random_inputs(raw, n, percent);
+            debounce_reset(&d, raw);
+            for (int i = 0; i < n; i++) {
+                ref[i].state = (raw[i / DEBOUNCE_WORD_BITS] >> (i % DEBOUNCE_WORD_BITS)) & 1;
+                ref[i].count = ref[i].state ? samples : 0;
+            }
+        }
+    }
+    debounce_free(&d);
+}
+
+/* a contact closes with bounce, one rising edge after samples closed samples */
+static void
+test_bounce(void)
+{
+    debounce_t d;
+    debounce_word_t raw[1], rise[1], fall[1];
+    int edges = 0, t;
+
+    CHECK_EQ(debounce_init(&d, 8, 4), 0);
+    static const int bounce[] = {1, 0, 1, 1, 0, 1, 0, 1, 1, 1};
+    for (t = 0; t < (int) (sizeof (bounce) / sizeof (bounce[0])); t++) {
+        raw[0] = bounce[t] ? 0x04 : 0;
+        edges += debounce_sample(&d, raw, rise, fall);
+        if (edges)
+            break;
+    }
+    /* 1 0 1 1 0 1 0 1 1 1 : the counter reaches 4 at the last one */
+    CHECK_EQ(t, 9);
+    CHECK_EQ(edges, 1);
+    CHECK_EQ(rise[0], 0x04);
+    CHECK_EQ(fall[0], 0);
+    CHECK_EQ(debounce_state(&d, 2), 1);
+    CHECK_EQ(debounce_state(&d, 3), 0);
+
+    /* rise and fall may be left out */
+    raw[0] = 0;
+    for (t = 0; t < 3; t++)
+        CHECK_EQ(debounce_sample(&d, raw, NULL, NULL), 0);
+    CHECK_EQ(debounce_sample(&d, raw, NULL, NULL), 1);
+    CHECK_EQ(debounce_state(&d, 2), 0);
+    debounce_free(&d);
+
+    CHECK(debounce_init(&d, 8, 0) != 0);
+    CHECK(debounce_init(&d, 8, 256) != 0);
+}
+
+int
+main(void)
+{
+    static const int inputs[] = {1, 8, 63, 64, 65, 100, 1024};
+    static const unsigned samples[] = {1, 2, 3, 4, 5, 7, 8, 16, 100, 255};
+
+    test_bounce();
+    for (size_t i = 0; i < sizeof (inputs) / sizeof (inputs[0]); i++)
+        for (size_t s = 0; s < sizeof (samples) / sizeof (samples[0]); s++)
+            test_against_reference(inputs[i], samples[s]);
+
+    if (failures) {
+        fprintf(stderr, "test_debounce: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_debounce: ok\n");
+    return 0;
+}
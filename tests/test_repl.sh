@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# File:   test_repl.sh
+# Author: oetelaar
+#
+# Hot standby over loopback, two daemons with an emulated board each :
+#   the primary stalls 400 ms   : the standby must not take over
+#   the primary is killed       : the standby takes over with the latest state
+#   the primary comes back      : the standby switches its outputs off and stands by
+#   a second primary            : refused, and it says so
+#
+#  $ tests/test_repl.sh
+#
+
+BIN=${BIN:-./switch_relay}
+PORT=${PORT:-17341}
+
+if [ ! -x "$BIN" ]; then
+    echo "no $BIN, run make first" >&2
+    exit 1
+fi
+
+dir=$(mktemp -d /tmp/switch_relay_repl.XXXXXX) || exit 1
+pids=""
+trap 'kill $pids 2>/dev/null; rm -rf "$dir"' EXIT INT TERM
+mkdir -p "$dir/s" "$dir/p" "$dir/q"
+failures=0
+
+check() {
+    if ! grep -q "$2" "$1"; then
+        echo "test_repl: $3 (no '$2' in $(basename "$1"))" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+check_not() {
+    if grep -q "$2" "$1"; then
+        echo "test_repl: $3" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+# the outputs of the last frame the emulated board took
+last_frame() {
+    grep "emulated board frame" "$1" | tail -1 | sed 's/.*outputs \(0x[0-9a-f]*\).*/\1/'
+}
+
+primary() {
+    $BIN -d -e -i "$dir/p" -r 127.0.0.1:$PORT >> "$dir/p.log" 2>&1 &
+    ppid=$!
+    pids="$pids $ppid"
+}
+
+$BIN -d -e -i "$dir/s" -b 127.0.0.1:$PORT > "$dir/s.log" 2>&1 &
+pids="$pids $!"
+sleep 0.3
+touch "$dir/p/D_OUT_3"
+primary
+sleep 0.5
+check "$dir/s.log" "primary connected" "the primary did not connect"
+
+kill -STOP $ppid
+sleep 0.4
+kill -CONT $ppid
+sleep 0.5
+check_not "$dir/s.log" "taking over" "the standby took over from a primary that stalled 400 ms"
+
+kill -9 $ppid
+wait $ppid 2>/dev/null
+sleep 2.5
+check "$dir/s.log" "taking over" "the standby did not take over from a dead primary"
+[ "$(last_frame "$dir/s.log")" = 0x04 ] || {
+    echo "test_repl: the standby took over with $(last_frame "$dir/s.log"), not 0x04" >&2
+    failures=$((failures + 1))
+}
+
+# the primary comes back with relay 3 off, the standby must let go of it
+rm -f "$dir/p/D_OUT_3"
+primary
+sleep 1
+check "$dir/s.log" "primary is back" "the standby did not hand back to the primary"
+check_not "$dir/p.log" "refused" "the returning primary was refused"
+[ "$(last_frame "$dir/s.log")" = 0x00 ] || {
+    echo "test_repl: the standby kept its outputs at $(last_frame "$dir/s.log")" >&2
+    failures=$((failures + 1))
+}
+
+$BIN -d -e -i "$dir/q" -r 127.0.0.1:$PORT > "$dir/q.log" 2>&1 &
+pids="$pids $!"
+sleep 0.5
+check "$dir/q.log" "replication refused" "a second primary was not told it is refused"
+
+if [ $failures -ne 0 ]; then
+    echo "test_repl: $failures check(s) failed" >&2
+    exit 1
+fi
+echo "test_repl: ok"
@@ -0,0 +1,422 @@
+/*
+ * File:   test_sim.c
+ * Author: oetelaar
+ *
+ * The board code on emulated boards and a simulated clock : every frame
+ * a board takes is recorded with its time, and checked to the us.
+ * Hours of timers run in milliseconds, nothing here sleeps.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "ios.h"
+#include "emu.h"
+#include "clock.h"
+#include "evloop.h"
+#include "sched.h"
+#include "lease.h"
+#include "logging.h"
+
+#define NBOARDS 3
+#define MAX_FRAMES 8192
+#define T0_US 1000000
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    unsigned long long a_ = (a), b_ = (b); \
+    if (a_ != b_) { \
+        fprintf(stderr, "%s:%d: %s = %llu, expected %llu\n", __FILE__, __LINE__, #a, a_, b_); \
+        failures++; \
+    } \
+} while (0)
+
+typedef struct
+{
+    int board;
+    uint32_t outputs;
+    uint64_t t_us;
+} frame_t;
+
+static clock_source_t sim;
+static emu_board_t emu[NBOARDS];
+static ios_handle_t handle[NBOARDS];
+static ios_handle_t *boards[NBOARDS];
+static frame_t frames[MAX_FRAMES];
+static int nframes;
+
+static void
+record_frame(emu_board_t *b, uint32_t outputs, uint64_t t_us, void *arg)
+{
+    (void) b;
+    if (nframes < MAX_FRAMES) {
+        frames[nframes].board = (int) (long) arg;
+        frames[nframes].outputs = outputs;
+        frames[nframes].t_us = t_us;
+        nframes++;
+    }
+}
+
+static uint64_t
+now_us(void)
+{
+    return clock_now_us(&sim);
+}
+
+/* let the loop run, the clock goes from timer to timer */
+static void
+run_for_ms(uint64_t ms)
+{
+    evloop_run_until(evloop_now_ms() + ms);
+}
+
+static void
+setup(void)
+{
+    clock_sim_init(&sim, T0_US);
+    evloop_set_clock(&sim);
+
+    for (int k = 0; k < NBOARDS; k++) {
+        ios_handle_t *h = &handle[k];
+        h->device_brand = ABACOM;
+        h->board_index = k;
+        h->run_as_daemon = 1;
+        emu_board_init(&emu[k], ABACOM, &sim);
+        emu[k].on_frame = record_frame;
+        emu[k].on_frame_arg = (void *) (long) k;
+        emu_attach(h, &emu[k]);
+        boards[k] = h;
+        CHECK_EQ(ios_open(h), 0);
+        CHECK_EQ(USB_setup_device(h), 0);
+    }
+}
+
+/* one write is one frame, the latch goes up after the last transfer */
+static void
+test_write(void)
+{
+    ios_handle_t *h = boards[0];
+    uint64_t t = now_us();
+    uint64_t transfers = emu[0].transfers;
+
+    nframes = 0;
+    h->active_relays = 0x05;
+    CHECK_EQ(USB_write_IO(h), 0);
+    CHECK_EQ(nframes, 1);
+    CHECK_EQ(frames[0].outputs, 0x05);
+    CHECK_EQ(emu[0].transfers - transfers, 27);
+    CHECK_EQ(frames[0].t_us, t + 27 * EMU_TRANSFER_US);
+    CHECK_EQ(h->outputbits, 0x05);
+    CHECK(!h->output_pending);
+}
+
+/* the chip times the pulse, on and off frames exactly us apart */
+static void
+test_pulse(void)
+{
+    ios_handle_t *h = boards[0];
+
+    nframes = 0;
+    CHECK_EQ(USB_pulse_IO(h, 0x08, 500), 0);
+    CHECK_EQ(nframes, 2);
+    CHECK_EQ(frames[0].outputs, 0x0d);
+    CHECK_EQ(frames[1].outputs, 0x05);
+    CHECK_EQ(frames[1].t_us - frames[0].t_us, 500);
+    /* a pulse does not change the state */
+    CHECK_EQ(h->outputbits, 0x05);
+}
+
+/* unplugged : tries after 50, 100, 200, 400 ms ..., the state waits for the board */
+static void
+test_reconnect(void)
+{
+    ios_handle_t *h = boards[1];
+    uint64_t t = now_us();
+
+    nframes = 0;
+    emu[1].present = 0;
+    h->active_relays = 0x07;
+    CHECK(USB_write_IO(h) != 0);
+    CHECK(h->device_handle == NULL);
+    CHECK(h->output_pending);
+
+    /* 50 + 100 + 200 ms have passed, the next try is at 750 ms */
+    run_for_ms(500);
+    CHECK_EQ(nframes, 0);
+    CHECK_EQ(h->reconnect_delay_ms, 400);
+    emu[1].present = 1;
+    run_for_ms(300);
+    CHECK_EQ(nframes, 1);
+    CHECK_EQ(frames[0].board, 1);
+    CHECK_EQ(frames[0].outputs, 0x07);
+    CHECK_EQ(frames[0].t_us, t + 750000 + 27 * EMU_TRANSFER_US);
+    CHECK(h->device_handle != NULL);
+    CHECK_EQ(h->reconnect_delay_ms, 0);
+}
+
+/* a board missing at start does not hold the daemon up, it is written when it comes */
+static void
+test_connect_later(void)
+{
+    ios_handle_t *h = boards[1];
+    uint64_t t = now_us();
+
+    USB_close_device(h);
+    CHECK(h->device_handle == NULL);
+    emu[1].present = 0;
+    nframes = 0;
+    CHECK(ios_connect(h) != 0);
+    CHECK_EQ(now_us(), t);
+    h->active_relays = 0x22;
+
+    run_for_ms(20);
+    emu[1].present = 1;
+    run_for_ms(100);
+    CHECK_EQ(nframes, 1);
+    CHECK_EQ(frames[0].outputs, 0x22);
+    CHECK_EQ(frames[0].t_us, t + RECONNECT_MIN_MS * 1000 + 27 * EMU_TRANSFER_US);
+}
+/* -u : the same frame as one UIO stream, one transfer */
+static void
+test_write_stream(void)
+{
+    ios_handle_t *h = boards[0];
+    uint64_t t = now_us();
+    uint64_t transfers = emu[0].transfers;
+
+    nframes = 0;
+    h->uio_stream = 1;
+    h->active_relays = 0x06;
+    CHECK_EQ(USB_write_IO(h), 0);
+    CHECK_EQ(nframes, 1);
+    CHECK_EQ(frames[0].outputs, 0x06);
+    CHECK_EQ(emu[0].transfers - transfers, 1);
+    CHECK_EQ(frames[0].t_us, t + EMU_TRANSFER_US);
+    h->uio_stream = 0;
+    h->active_relays = 0x05;
+    CHECK_EQ(USB_write_IO(h), 0);
+    CHECK_EQ(emu[0].outputs, 0x05);
+}
+
+static int hour_ticks;
+
+static void
+hour_tick(void *arg)
+{
+    ios_handle_t *h = arg;
+
+    hour_ticks++;
+    h->active_relays ^= 0x80;
+    USB_write_IO(h);
+}
+
+/* a timer toggling a relay every second, for an hour */
+static void
+test_hour(void)
+{
+    ios_handle_t *h = boards[2];
+    uint64_t t = now_us();
+    int id = evloop_timer_add(1000, 1, hour_tick, h);
+
+    nframes = 0;
+    hour_ticks = 0;
+    run_for_ms(3600 * 1000);
+    evloop_timer_del(id);
+
+    CHECK_EQ(hour_ticks, 3600);
+    CHECK_EQ(nframes, 3600);
+    int exact = 1;
+    for (int i = 0; i < nframes && exact; i++)
+        exact = frames[i].outputs == ((i & 1) ? 0x00u : 0x80u)
+                && frames[i].t_us == t + (uint64_t) (i + 1) * 1000000 + 27 * EMU_TRANSFER_US;
+    CHECK(exact);
+}
+
+static void
+done(sched_client_t *c, const sched_batch_t *b, void *arg)
+{
+    (void) c;
+    (void) b;
+    ++*(int *) arg;
+}
+
+/* a budget of one board per tick spreads three boards over three ticks */
+static void
+test_sched_budget(void)
+{
+    int acked = 0;
+    sched_client_t *c = sched_client_new("ctl", "test", done, &acked);
+
+    sched_set_budget(1);
+    nframes = 0;
+    for (int k = 0; k < NBOARDS; k++) {
+        sched_add(c, k, 0x10, 0);
+        sched_submit(c, k);
+    }
+    uint64_t t = now_us();
+    run_for_ms(200);
+
+    CHECK_EQ(acked, NBOARDS);
+    CHECK_EQ(nframes, NBOARDS);
+    for (int k = 0; k < nframes; k++) {
+        CHECK_EQ(frames[k].board, k);
+        CHECK(frames[k].outputs & 0x10);
+    }
+    /* ticks SCHED_TICK_MS apart, each after the transfers of the one before */
+    CHECK(frames[1].t_us - frames[0].t_us >= SCHED_TICK_MS * 1000);
+    CHECK(frames[2].t_us - frames[1].t_us >= SCHED_TICK_MS * 1000);
+    CHECK(frames[0].t_us < t + SCHED_TICK_MS * 1000 + 27 * EMU_TRANSFER_US);
+    sched_set_budget(0);
+    sched_client_free(c);
+}
+
+/* without a budget changes from rounds within SCHED_TICK_MS share a frame */
+static void
+test_sched_window(void)
+{
+    int acked = 0;
+    sched_client_t *c = sched_client_new("mqtt", "test", done, &acked);
+
+    /* frames of one transfer, so the window is not hidden behind a slow write */
+    boards[0]->uio_stream = 1;
+    run_for_ms(100);
+    nframes = 0;
+    sched_add(c, 0, 0x01, 0);
+    sched_submit(c, 1);
+    run_for_ms(3);
+    /* the first after a quiet time goes out at once */
+    CHECK_EQ(nframes, 1);
+    sched_add(c, 0, 0x02, 0);
+    sched_submit(c, 2);
+    run_for_ms(2);
+    sched_add(c, 0, 0x04, 0);
+    sched_submit(c, 3);
+    run_for_ms(100);
+
+    CHECK_EQ(acked, 3);
+    CHECK_EQ(nframes, 2);
+    CHECK_EQ(frames[1].outputs & 0x07, 0x07);
+    CHECK(frames[1].t_us - frames[0].t_us >= SCHED_TICK_MS * 1000);
+    sched_add(c, 0, 0, 0x07);
+    sched_submit(c, 4);
+    run_for_ms(100);
+    boards[0]->uio_stream = 0;
+    sched_client_free(c);
+}
+
+/* a lease switches off what it switched on, not what was on before it */
+static void
+test_lease_was_on(void)
+{
+    int acked = 0;
+    sched_client_t *c = sched_client_new("ctl", "test", done, &acked);
+
+    sched_add(c, 1, 0x01, 0x02);
+    sched_submit(c, 1);
+    run_for_ms(20);
+    CHECK_EQ(boards[1]->active_relays & 0x03, 0x01);
+
+    CHECK_EQ(lease_renew(1, 1, 50), 0);
+    CHECK_EQ(lease_renew(1, 2, 50), 1);
+    sched_add(c, 1, 0x02, 0);
+    sched_submit(c, 2);
+    run_for_ms(20);
+    CHECK_EQ(boards[1]->active_relays & 0x03, 0x03);
+
+    run_for_ms(200);
+    CHECK_EQ(acked, 2);
+    CHECK_EQ(boards[1]->active_relays & 0x03, 0x01);
+    CHECK_EQ(emu[1].outputs & 0x03, 0x01);
+    sched_add(c, 1, 0, 0x01);
+    sched_submit(c, 3);
+    run_for_ms(20);
+    sched_client_free(c);
+}
+
+/* a set or clear queued in the same round counts, not what was written last */
+static void
+test_lease_queued(void)
+{
+    int acked = 0;
+    sched_client_t *c = sched_client_new("mqtt", "test", done, &acked);
+
+    /* relay 3 on, 4 and 5 off, then in one round : 3 off, lease 3 */
+    sched_add(c, 2, 0x04, 0x18);
+    sched_submit(c, 1);
+    run_for_ms(20);
+    sched_add(c, 2, 0, 0x04);
+    sched_submit(c, 2);
+    CHECK_EQ(lease_renew(2, 3, 50), 1);
+    sched_add(c, 2, 0x04, 0);
+    sched_submit(c, 3);
+    run_for_ms(20);
+    CHECK_EQ(emu[2].outputs & 0x04, 0x04);
+    run_for_ms(100);
+    CHECK_EQ(emu[2].outputs & 0x04, 0);
+
+    /* relay 4 off, then in one round : on, lease, the client wants it on after */
+    sched_add(c, 2, 0x08, 0);
+    sched_submit(c, 4);
+    CHECK_EQ(lease_renew(2, 4, 50), 0);
+    sched_submit(c, 5);
+    run_for_ms(200);
+    CHECK_EQ(emu[2].outputs & 0x08, 0x08);
+
+    /* ms near UINT32_MAX must not wrap round to the next tick */
+    CHECK_EQ(lease_renew(2, 5, UINT32_MAX), 1);
+    sched_add(c, 2, 0x10, 0);
+    sched_submit(c, 6);
+    run_for_ms(LEASE_SLOTS * LEASE_TICK_MS + 200);
+    CHECK_EQ(emu[2].outputs & 0x10, 0x10);
+    lease_end(2, 5);
+
+    CHECK_EQ(acked, 6);
+    sched_add(c, 2, 0, 0x18);
+    sched_submit(c, 7);
+    run_for_ms(20);
+    sched_client_free(c);
+}
+
+/* with nothing left to wait for the loop must return, not spin */
+static void
+test_nothing_to_wait_for(void)
+{
+    log_level = 0;
+    CHECK_EQ(evloop_run(), -1);
+    log_level = LLL_ERR;
+}
+
+int
+main(void)
+{
+    log_level = LLL_ERR;
+    setup();
+    if (sched_start(boards, NBOARDS) != 0 || lease_start(boards, NBOARDS) != 0)
+        return 1;
+
+    test_write();
+    test_pulse();
+    test_write_stream();
+    test_reconnect();
+    test_connect_later();
+    test_hour();
+    test_sched_budget();
+    test_sched_window();
+    test_lease_was_on();
+    test_lease_queued();
+    test_nothing_to_wait_for();
+
+    if (failures) {
+        fprintf(stderr, "test_sim: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_sim: ok\n");
+    return 0;
+}
@@ -0,0 +1,661 @@
+/*
+ * File:   ws.c
+ * Author: oetelaar
+ *
+ * The WebSocket live state, see ws.h
+ * Only what a dashboard needs of RFC 6455 : the handshake, unfragmented
+ * text messages both ways, ping and close.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ws.h"
+#include "evloop.h"
+#include "net.h"
+#include "sched.h"
+#include "logging.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_REQUEST 4096
+
+#define WS_OP_TEXT 0x1
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+/* close codes */
+#define WS_PROTOCOL_ERROR 1002
+#define WS_UNSUPPORTED 1003
+#define WS_TOO_BIG 1009
+
+/* a frame as it goes on the wire, shared by every connection it is queued on */
+typedef struct ws_msg
+{
+    int refs;
+    size_t len;
+    uint8_t data[];
+} ws_msg_t;
+
+typedef struct ws_conn
+{
+    int fd;
+    int open; /* handshake done */
+    int closing; /* drop it once out is sent */
+    net_buf_t in;
+    net_buf_t out; /* frames for this connection only : handshake, pong, errors, close */
+    ws_msg_t *queue[WS_QUEUE_LEN];
+    int qhead, qlen;
+    size_t qoff; /* bytes of the head already sent */
+    int resync; /* send the full state when the queue is empty */
+    sched_client_t *sc; /* every message with commands is a batch */
+    int throttled; /* not reading, too many batches waiting */
+    struct ws_conn *prev, *next;
+} ws_conn_t;
+
+static struct
+{
+    ios_handle_t **boards;
+    int nboards;
+    ws_conn_t *conns;
+    int nconns;
+    /* boards whose outputs changed in this round */
+    int *changed;
+    int nchanged;
+    uint8_t *is_changed;
+    ws_msg_t *snapshot; /* every board, until the next change */
+    unsigned long resyncs; /* slow clients that lost their queue */
+    int lfd;
+} ws = {.lfd = -1};
+
+/* ------------------------------------------------------------------ */
+/* the handshake needs SHA-1 and base64 */
+
+static uint32_t
+rol(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+static void
+sha1(const uint8_t *msg, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    uint64_t bits = (uint64_t) len * 8;
+    size_t total = (len + 9 + 63) / 64 * 64; /* message, 0x80, length, padded */
+
+    for (size_t off = 0; off < total; off += 64) {
+        uint32_t w[80];
+        uint8_t block[64];
+
+        for (int i = 0; i < 64; i++) {
+            size_t k = off + i;
+            if (k < len)
+                block[i] = msg[k];
+            else if (k == len)
+                block[i] = 0x80;
+            else if (k >= total - 8)
+                block[i] = (uint8_t) (bits >> (8 * (total - 1 - k)));
+            else
+                block[i] = 0;
+        }
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+            (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++)
+        digest[i] = (uint8_t) (h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void
+base64(const uint8_t *in, size_t len, char *out)
+{
+    static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i = 0; i + 2 < len; i += 3) {
+        uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        *out++ = tab[v >> 18];
+        *out++ = tab[(v >> 12) & 63];
+        *out++ = tab[(v >> 6) & 63];
+        *out++ = tab[v & 63];
+    }
+    if (i < len) {
+        uint32_t v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0);
+        *out++ = tab[v >> 18];
+        *out++ = tab[(v >> 12) & 63];
+        *out++ = i + 1 < len ? tab[(v >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+/* ------------------------------------------------------------------ */
+/* frames */
+
+static size_t
+ws_frame_header(uint8_t *p, uint8_t op, size_t len)
+{
+    p[0] = 0x80 | op;
+    if (len < 126) {
+        p[1] = (uint8_t) len;
+        return 2;
+    }
+    if (len < 65536) {
+        p[1] = 126;
+        p[2] = (uint8_t) (len >> 8);
+        p[3] = (uint8_t) len;
+        return 4;
+    }
+    p[1] = 127;
+    for (int i = 0; i < 8; i++)
+        p[2 + i] = (uint8_t) ((uint64_t) len >> (56 - 8 * i));
+    return 10;
+}
+
+static ws_msg_t *
+ws_msg_new(uint8_t op, const char *payload, size_t len)
+{
+    ws_msg_t *m = malloc(sizeof (*m) + 10 + len);
+
+    if (!m)
+        return NULL;
+    m->refs = 1;
+    m->len = ws_frame_header(m->data, op, len);
+    memcpy(m->data + m->len, payload, len);
+    m->len += len;
+    return m;
+}
+
+static void
+ws_msg_unref(ws_msg_t *m)
+{
+    if (m && --m->refs == 0)
+        free(m);
+}
+
+/* a frame for this connection only, returns 0 or -1 */
+static int
+ws_send_own(ws_conn_t *c, uint8_t op, const void *payload, size_t len)
+{
+    uint8_t hdr[10];
+
+    if (net_buf_append(&c->out, hdr, ws_frame_header(hdr, op, len)) != 0 ||
+        net_buf_append(&c->out, payload, len) != 0)
+        return -1;
+    return 0;
+}
+
+static void
+ws_send_close(ws_conn_t *c, unsigned code)
+{
+    uint8_t p[2] = {(uint8_t) (code >> 8), (uint8_t) code};
+
+    ws_send_own(c, WS_OP_CLOSE, p, sizeof (p));
+    c->closing = 1;
+}
+
+/* [[board,outputs],...] of the boards in which, or of all when which is NULL */
+static ws_msg_t *
+ws_state_msg(const int *which, int n)
+{
+    size_t cap = (size_t) n * 24 + 4;
+    char *s = malloc(cap);
+    size_t len = 0;
+
+    if (!s)
+        return NULL;
+    s[len++] = '[';
+    for (int i = 0; i < n; i++) {
+        int k = which ? which[i] : i;
+        len += snprintf(s + len, cap - len, "%s[%d,%u]", i ? "," : "", k, ws.boards[k]->outputbits);
+    }
+    s[len++] = ']';
+
+    ws_msg_t *m = ws_msg_new(WS_OP_TEXT, s, len);
+    free(s);
+    return m;
+}
+
+static ws_msg_t *
+ws_snapshot(void)
+{
+    if (!ws.snapshot)
+        ws.snapshot = ws_state_msg(NULL, ws.nboards);
+    return ws.snapshot;
+}
+
+/* ------------------------------------------------------------------ */
+/* connections */
+
+static void
+ws_close(ws_conn_t *c)
+{
+    lwsl_info("ws: connection closed\n");
+    evloop_del(c->fd);
+    close(c->fd);
+    sched_client_free(c->sc);
+    for (int i = 0; i < c->qlen; i++)
+        ws_msg_unref(c->queue[(c->qhead + i) % WS_QUEUE_LEN]);
+    net_buf_free(&c->in);
+    net_buf_free(&c->out);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        ws.conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    ws.nconns--;
+    free(c);
+}
+
+static void
+ws_queue(ws_conn_t *c, ws_msg_t *m)
+{
+    if (c->resync)
+        return; /* the full state it gets covers this one */
+    if (c->qlen == WS_QUEUE_LEN) {
+        /* too slow, keep what is half sent, catch up with the full state later */
+        int keep = c->qoff ? 1 : 0;
+        for (int i = keep; i < c->qlen; i++)
+            ws_msg_unref(c->queue[(c->qhead + i) % WS_QUEUE_LEN]);
+        c->qlen = keep;
+        c->resync = 1;
+        ws.resyncs++;
+        lwsl_info("ws: client too slow, it gets the full state later (%lu so far)\n", ws.resyncs);
+        return;
+    }
+    m->refs++;
+    c->queue[(c->qhead + c->qlen++) % WS_QUEUE_LEN] = m;
+}
+
+/*
+ * write what the socket takes, frames of our own only go in between
+ * the shared ones. returns 0, or -1 when the connection has to go
+ */
+static int
+ws_flush(ws_conn_t *c)
+{
+    for (;;) {
+        if (c->qoff == 0 && c->out.len) {
+            if (net_buf_send(c->fd, &c->out) < 0)
+                return -1;
+            if (c->out.len)
+                break;
+        }
+        if (c->qlen == 0) {
+            ws_msg_t *m;
+            if (c->resync && c->open && (m = ws_snapshot())) {
+                c->resync = 0;
+                ws_queue(c, m);
+                continue;
+            }
+            break;
+        }
+        ws_msg_t *m = c->queue[c->qhead];
+        ssize_t n = send(c->fd, m->data + c->qoff, m->len - c->qoff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return -1;
+        }
+        c->qoff += n;
+        if (c->qoff < m->len)
+            break;
+        ws_msg_unref(m);
+        c->qhead = (c->qhead + 1) % WS_QUEUE_LEN;
+        c->qlen--;
+        c->qoff = 0;
+    }
+    if (c->closing && c->out.len == 0)
+        return -1;
+    c->throttled = sched_queued(c->sc) >= SCHED_MAX_QUEUED;
+    evloop_modify(c->fd, (c->throttled ? 0 : POLLIN) |
+                  (c->out.len || c->qlen || c->resync ? POLLOUT : 0));
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* state out, commands in */
+
+/* once per round, the boards that changed go to everybody in one message */
+static void
+ws_broadcast(void *arg)
+{
+    (void) arg;
+
+    ws_msg_unref(ws.snapshot);
+    ws.snapshot = NULL;
+    ws_msg_t *m = ws.nconns ? ws_state_msg(ws.changed, ws.nchanged) : NULL;
+    for (int i = 0; i < ws.nchanged; i++)
+        ws.is_changed[ws.changed[i]] = 0;
+    ws.nchanged = 0;
+
+    ws_conn_t *next;
+    for (ws_conn_t *c = ws.conns; c; c = next) {
+        next = c->next;
+        if (!c->open)
+            continue;
+        if (m)
+            ws_queue(c, m);
+        else
+            c->resync = 1; /* no memory now, the full state later */
+        if (ws_flush(c) < 0)
+            ws_close(c);
+    }
+    ws_msg_unref(m);
+}
+
+static void
+ws_listener(ios_handle_t *h, uint32_t old_outputbits, void *arg)
+{
+    (void) arg;
+
+    if (h->outputbits == old_outputbits || ws.is_changed[h->board_index])
+        return;
+    ws.is_changed[h->board_index] = 1;
+    ws.changed[ws.nchanged++] = h->board_index;
+    evloop_defer(ws_broadcast, NULL);
+}
+
+/* a message is on the boards, the state goes out by ws_listener */
+static void
+ws_done(sched_client_t *sc, const sched_batch_t *b, void *arg)
+{
+    ws_conn_t *c = arg;
+    (void) sc;
+    (void) b;
+
+    /* room again, read on */
+    if (c->throttled && ws_flush(c) < 0)
+        ws_close(c);
+}
+
+/* <board>=<mask> ..., returns 0 or -1 when the reply did not fit or no memory */
+static int
+ws_command(ws_conn_t *c, const uint8_t *p, size_t len)
+{
+    char buf[WS_MAX_FRAME + 1];
+    char *save, *tok;
+    int n = 0;
+
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    for (tok = strtok_r(buf, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char *e, *v;
+        long k = strtol(tok, &e, 10);
+        unsigned long m = 0;
+        int ok = e != tok && *e == '=' && k >= 0 && k < ws.nboards;
+
+        if (ok) {
+            v = e + 1;
+            m = strtoul(v, &e, 0);
+            ok = e != v && !*e && m <= RELAY_MASK_ALL;
+        }
+        if (!ok) {
+            char err[64];
+            int elen = snprintf(err, sizeof (err), "{\"error\":\"bad %.40s\"}", tok);
+            if (ws_send_own(c, WS_OP_TEXT, err, elen) != 0)
+                return -1;
+            continue;
+        }
+        if (sched_add(c->sc, k, (uint32_t) m, ~(uint32_t) m) != 0)
+            return -1;
+        n++;
+    }
+    /* the whole message goes into one frame */
+    if (n && sched_submit(c->sc, 0) != 0)
+        return -1;
+    return 0;
+}
+
+/* returns 0 when the rest of the request still has to come, 1 when done */
+static int
+ws_handshake(ws_conn_t *c)
+{
+    static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char *req, *end, *key = NULL;
+    size_t klen = 0;
+
+    /* keep it a string, for strstr */
+    if (!net_buf_reserve(&c->in, 1))
+        return -1;
+    c->in.data[c->in.len] = '\0';
+    req = (char *) c->in.data;
+    end = strstr(req, "\r\n\r\n");
+    if (!end) {
+        if (c->in.len <= WS_MAX_REQUEST)
+            return 0;
+        net_buf_append(&c->out, bad, sizeof (bad) - 1);
+        c->closing = 1;
+        return 1;
+    }
+    *end = '\0';
+
+    if (!strncmp(req, "GET ", 4)) {
+        for (char *line = strstr(req, "\r\n"); line; line = strstr(line, "\r\n")) {
+            line += 2;
+            if (!strncasecmp(line, "Sec-WebSocket-Key:", 18)) {
+                key = line + 18;
+                key += strspn(key, " \t");
+                klen = strcspn(key, " \t\r\n");
+                break;
+            }
+        }
+    }
+    if (!key || !klen || klen > 64) {
+        net_buf_append(&c->out, bad, sizeof (bad) - 1);
+        c->closing = 1;
+        return 1;
+    }
+
+    char buf[64 + sizeof (WS_GUID)];
+    uint8_t digest[20];
+    char accept[32];
+    char resp[160];
+
+    memcpy(buf, key, klen);
+    memcpy(buf + klen, WS_GUID, sizeof (WS_GUID) - 1);
+    sha1((uint8_t *) buf, klen + sizeof (WS_GUID) - 1, digest);
+    base64(digest, sizeof (digest), accept);
+    int n = snprintf(resp, sizeof (resp), "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    net_buf_append(&c->out, resp, n);
+    net_buf_consume(&c->in, end + 4 - req);
+    c->open = 1;
+    /* the first message is the full state */
+    c->resync = 1;
+    lwsl_info("ws: client connected, %d connection(s)\n", ws.nconns);
+    return 1;
+}
+
+/* the complete frames in c->in, returns 0 or -1 when the connection has to go */
+static int
+ws_read_frames(ws_conn_t *c)
+{
+    size_t i = 0;
+
+    while (!c->closing && c->in.len - i >= 2) {
+        uint8_t *p = c->in.data + i;
+        size_t avail = c->in.len - i;
+        size_t hl = 2, len = p[1] & 0x7f;
+        uint8_t op = p[0] & 0x0f;
+
+        /* clients must mask */
+        if (!(p[1] & 0x80)) {
+            ws_send_close(c, WS_PROTOCOL_ERROR);
+            break;
+        }
+        if (len == 126) {
+            if (avail < 4)
+                break;
+            len = p[2] << 8 | p[3];
+            hl = 4;
+        } else if (len == 127) {
+            if (avail < 10)
+                break;
+            len = 0;
+            for (int k = 0; k < 8; k++)
+                len = len << 8 | p[2 + k];
+            hl = 10;
+        }
+        if (len > WS_MAX_FRAME) {
+            ws_send_close(c, WS_TOO_BIG);
+            break;
+        }
+        if (avail < hl + 4 + len)
+            break;
+
+        uint8_t *mask = p + hl;
+        uint8_t *data = p + hl + 4;
+        for (size_t k = 0; k < len; k++)
+            data[k] ^= mask[k & 3];
+        i += hl + 4 + len;
+
+        if (!(p[0] & 0x80)) {
+            /* fragments, a dashboard has no use for them */
+            ws_send_close(c, WS_UNSUPPORTED);
+            break;
+        }
+        switch (op) {
+        case WS_OP_TEXT:
+            if (ws_command(c, data, len) != 0)
+                return -1;
+            break;
+        case WS_OP_PING:
+            if (ws_send_own(c, WS_OP_PONG, data, len) != 0)
+                return -1;
+            break;
+        case WS_OP_PONG:
+            break;
+        case WS_OP_CLOSE:
+            ws_send_own(c, WS_OP_CLOSE, data, len >= 2 ? 2 : 0);
+            c->closing = 1;
+            break;
+        default:
+            ws_send_close(c, WS_UNSUPPORTED);
+            break;
+        }
+    }
+    net_buf_consume(&c->in, i);
+    return 0;
+}
+
+static void
+ws_fd_cb(int fd, short revents, void *arg)
+{
+    ws_conn_t *c = arg;
+    (void) fd;
+
+    if (revents & POLLIN) {
+        if (net_buf_recv(c->fd, &c->in) < 0) {
+            ws_close(c);
+            return;
+        }
+        if (!c->open && !c->closing && ws_handshake(c) < 0) {
+            ws_close(c);
+            return;
+        }
+        if (c->open && ws_read_frames(c) != 0) {
+            ws_close(c);
+            return;
+        }
+    } else if (revents & (POLLERR | POLLHUP)) {
+        ws_close(c);
+        return;
+    }
+
+    if (ws_flush(c) < 0)
+        ws_close(c);
+}
+
+static void
+ws_accept_cb(int fd, short revents, void *arg)
+{
+    (void) revents;
+    (void) arg;
+
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+
+    ws_conn_t *c = calloc(1, sizeof (*c));
+    char name[80] = "ws ";
+    if (c) {
+        net_peer_name(cfd, name + 3, sizeof (name) - 3);
+        c->sc = sched_client_new("ws", name, ws_done, c);
+    }
+    if (!c || !c->sc) {
+        free(c);
+        close(cfd);
+        return;
+    }
+    net_setup(cfd);
+    c->fd = cfd;
+    c->next = ws.conns;
+    if (ws.conns)
+        ws.conns->prev = c;
+    ws.conns = c;
+    ws.nconns++;
+    evloop_add(cfd, POLLIN, ws_fd_cb, c);
+}
+
+int
+ws_start(ios_handle_t **boards, int nboards, const char *listen_on)
+{
+    assert(boards && nboards > 0);
+
+    int fd = net_listen(listen_on, 64);
+    if (fd < 0)
+        return -1;
+
+    ws.boards = boards;
+    ws.nboards = nboards;
+    ws.changed = calloc(nboards, sizeof (*ws.changed));
+    ws.is_changed = calloc(nboards, 1);
+    ws.lfd = fd;
+
+    for (int k = 0; k < nboards; k++)
+        ios_add_listener(boards[k], ws_listener, NULL);
+
+    evloop_add(fd, POLLIN, ws_accept_cb, NULL);
+    lwsl_notice("websocket live state on %s for %d board(s)\n", listen_on, nboards);
+    return 0;
+}
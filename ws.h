@@ -0,0 +1,43 @@
+/*
+ * File:   ws.h
+ * Author: oetelaar
+ *
+ * WebSocket (RFC 6455) live state for dashboards, no library.
+ *
+ * A browser connects to ws://<host>:<port>/ and gets text messages,
+ * JSON arrays of [board, outputs] pairs, outputs as confirmed by the board :
+ *   [[0,24],[1,0],[2,5]]   right after connecting, every board
+ *   [[0,26]]               afterwards, the boards that changed in a round
+ * It may send back text messages with one or more mask commands
+ *   0=0x1a 2=5             board 0 relays 2,4,5 on, board 2 relays 1,3 on
+ * which go through the frame scheduler (sched.h) like the changes of
+ * every other source, each board written once per frame. A bad command
+ * is answered with {"error":"..."}.
+ *
+ * Every message is built once and the same bytes are queued on all
+ * connections. A client that does not keep up (WS_QUEUE_LEN messages
+ * waiting) loses its queue and gets one full state message instead,
+ * when it has room again.
+ */
+
+#ifndef WS_H
+#define	WS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "ios.h"
+
+#define WS_QUEUE_LEN 32
+    /* largest message we take from a client */
+#define WS_MAX_FRAME 4096
+
+    /* accept WebSocket connections on [addr:]port for these boards, returns 0 or -1 */
+    int ws_start(ios_handle_t **boards, int nboards, const char *listen_on);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_H */